@@ -1,5 +1,10 @@
 #include <stdlib.h>
 #include <stdio.h>
+#include <errno.h>
+#include <limits.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/uio.h>
 
 #include "argo.h"
 #include "global.h"
@@ -512,153 +517,117 @@ static int argo_str_equal(ARGO_STRING *s1, ARGO_STRING *s2){
     }
     return -1;
 }
-static int putSpaces(FILE* f){
-    if(!indent_level){
+/*
+ * State threaded through the writer functions.  The "indent" field plays
+ * the role of the global indent_level, so that independent subtrees can be
+ * rendered on worker threads, each starting from the indent level it would
+ * have had in a sequential write.  The "split" field is non-NULL only on
+ * the thread that is dividing a large pretty-printed tree into segments.
+ */
+typedef struct argo_writer {
+    FILE *f;
+    int indent;
+    struct argo_split *split;
+} ARGO_WRITER;
+
+static int argo_write_node(ARGO_WRITER *w, ARGO_VALUE *v);
+static void argo_split_members(ARGO_WRITER *w, ARGO_VALUE *list);
+
+static int putSpaces(ARGO_WRITER *w){
+    if(!w->indent){
         // indent_level = global_options & 0x000000FF;
-        indent_level=1;
-        if(!indent_level)
-            indent_level = -1;
+        w->indent=1;
+        if(!w->indent)
+            w->indent = -1;
     }
-    if(indent_level>0){
-        fputc(ARGO_LF,f);
-        for(int i =0; i< indent_level*(global_options & 0x000000FF); i++){
-            fputc(ARGO_SPACE,f);
+    if(w->indent>0){
+        fputc(ARGO_LF,w->f);
+        for(int i =0; i< w->indent*(global_options & 0x000000FF); i++){
+            fputc(ARGO_SPACE,w->f);
         }
     }
     return 0;
 }
 
-int argo_write_object(ARGO_OBJECT *o, FILE *f){
-    fputc(ARGO_LBRACE,f);
-    if(o->member_list->next != o->member_list){
+/*
+ * Write the members (or elements) of a list, starting at "first" and
+ * stopping before "end".  Every member other than the head of the list
+ * is preceded by a comma.
+ */
+static void argo_write_members(ARGO_WRITER *w, ARGO_VALUE *list, ARGO_VALUE *first, ARGO_VALUE *end){
+    for(ARGO_VALUE *v = first; v != end; v = v->next){
+        if(v != list->next)
+            fputc(ARGO_COMMA,w->f);
         if(global_options & 0x000000FF)
-            putSpaces(f);
-        argo_write_value(o->member_list->next, f);
-        if(o->member_list->next->next != o->member_list){
-            fputc( ARGO_COMMA,f);
-            if(global_options & 0x000000FF)
-                putSpaces(f);
-        }
-        ARGO_VALUE *currentMember = o->member_list;
-        currentMember = currentMember->next;
-        currentMember = currentMember->next;
-        // while(!argo_str_equal(&currentMember->name,&o->member_list->name)){
-        if(currentMember != o->member_list)
-            while(currentMember->next != o->member_list){
-                argo_write_value(currentMember, f);
-                currentMember = currentMember->next;
-                fputc( ARGO_COMMA,f);
-                if(global_options & 0x000000FF)
-                    putSpaces(f);
-            }
-        if(o->member_list->next->next != o->member_list)
-            argo_write_value(currentMember, f);
-    
-        // indent_level -= global_options & 0x000000FF;
-        if(global_options & 0x000000FF){
-            indent_level--;
-            if(indent_level){
-                putSpaces(f);
-                fputc( ARGO_RBRACE,f);
-            }
-            else{
-                fputc(ARGO_LF,f);
-                fputc( ARGO_RBRACE,f);
-                fputc(ARGO_LF,f);
-                
-            }
-        }
-        else{
-            fputc( ARGO_RBRACE,f);
-        }
-    }
-    else{
-        if(indent_level!=1)
-            putSpaces(f);
-        else
-            fputc(ARGO_LF, f);
-        indent_level--;
-        fputc(ARGO_RBRACE,f);
+            putSpaces(w);
+        argo_write_node(w, v);
     }
-    return 0;
 }
 
-int argo_write_array(ARGO_ARRAY *a, FILE *f){
-    fputc(ARGO_LBRACK,f);
-    
-    if(a->element_list->next != a->element_list){
-        if(global_options & 0x000000FF)
-        putSpaces(f);
-        argo_write_value(a->element_list->next, f);
-        if(a->element_list->next->next != a->element_list){
-            fputc( ARGO_COMMA,f);
-            if(global_options & 0x000000FF)
-                putSpaces(f);
-        }
-        ARGO_VALUE *currentMember = a->element_list;
-        currentMember = currentMember->next;
-        currentMember = currentMember->next;
-        // while(!argo_str_equal(&currentMember->name,&o->member_list->name)){
-        if(currentMember != a->element_list)
-            while(currentMember->next != a->element_list){
-                argo_write_value(currentMember, f);
-                currentMember = currentMember->next;
-                fputc( ARGO_COMMA,f);
-                if(global_options & 0x000000FF)
-                    putSpaces(f);
-            }
-        if(a->element_list->next->next != a->element_list)
-            argo_write_value(currentMember, f);
+static int argo_write_list(ARGO_WRITER *w, ARGO_VALUE *list, ARGO_CHAR open, ARGO_CHAR close){
+    fputc(open,w->f);
+    if(list->next != list){
+        if(w->split)
+            argo_split_members(w, list);
+        else
+            argo_write_members(w, list, list->next, list);
         // indent_level -= global_options & 0x000000FF;
         if(global_options & 0x000000FF){
-            indent_level--;
-            if(indent_level){
-                putSpaces(f);
-                fputc( ARGO_RBRACK,f);
+            w->indent--;
+            if(w->indent){
+                putSpaces(w);
+                fputc(close,w->f);
             }
             else{
-                fputc(ARGO_LF,f);
-                fputc( ARGO_RBRACK,f);
-                fputc(ARGO_LF,f);
+                fputc(ARGO_LF,w->f);
+                fputc(close,w->f);
+                fputc(ARGO_LF,w->f);
             }
         }
         else{
-            fputc( ARGO_RBRACK,f);
+            fputc(close,w->f);
         }
     }
     else{
-        if(indent_level!=1)
-            putSpaces(f);
+        if(w->indent!=1)
+            putSpaces(w);
         else
-            fputc(ARGO_LF, f);
-        indent_level--;
-        fputc( ARGO_RBRACK,f);
+            fputc(ARGO_LF, w->f);
+        w->indent--;
+        fputc(close,w->f);
     }
     return 0;
 }
 
+int argo_write_object(ARGO_OBJECT *o, ARGO_WRITER *w){
+    return argo_write_list(w, o->member_list, ARGO_LBRACE, ARGO_RBRACE);
+}
+
+int argo_write_array(ARGO_ARRAY *a, ARGO_WRITER *w){
+    return argo_write_list(w, a->element_list, ARGO_LBRACK, ARGO_RBRACK);
+}
 
-int argo_write_value(ARGO_VALUE *v, FILE *f) { //TODO
+static int argo_write_node(ARGO_WRITER *w, ARGO_VALUE *v){
     int n=0;
     if(v->name.content){
-        fputc(ARGO_QUOTE,f);
-        n=argo_write_string(&v->name,f);
-        fputc(ARGO_QUOTE, f);
-        fputc(ARGO_COLON,f);
-        if(indent_level>0)
-            fputc(ARGO_SPACE,f);
+        fputc(ARGO_QUOTE,w->f);
+        n=argo_write_string(&v->name,w->f);
+        fputc(ARGO_QUOTE, w->f);
+        fputc(ARGO_COLON,w->f);
+        if(w->indent>0)
+            fputc(ARGO_SPACE,w->f);
     }
     switch (v->type)
     {
     case 1: //BASIC CASE
         if(v->content.basic ==ARGO_NULL){
-            fputs( ARGO_NULL_TOKEN,f);
+            fputs( ARGO_NULL_TOKEN,w->f);
         }
         else if(v->content.basic==ARGO_TRUE){
-            fputs( ARGO_TRUE_TOKEN,f);
+            fputs( ARGO_TRUE_TOKEN,w->f);
         }
         else if(v->content.basic == ARGO_FALSE){
-            fputs(ARGO_FALSE_TOKEN,f);
+            fputs(ARGO_FALSE_TOKEN,w->f);
         }
         else{
             return -1;
@@ -667,30 +636,338 @@ int argo_write_value(ARGO_VALUE *v, FILE *f) { //TODO
         break;
 
     case 2: //NUMBER CASE
-        return argo_write_number(&v->content.number, f);
+        return argo_write_number(&v->content.number, w->f);
         break;
 
     case 3: //STRING CASE
-        fputc(ARGO_QUOTE,f);
-        int x = argo_write_string(&v->content.string, f);
-        fputc(ARGO_QUOTE,f);
+        fputc(ARGO_QUOTE,w->f);
+        int x = argo_write_string(&v->content.string, w->f);
+        fputc(ARGO_QUOTE,w->f);
         return x+n;
         break;
     
     case 4: //OBJECT CASE
-        indent_level++;
-        return argo_write_object(&v->content.object,f)+n;
+        w->indent++;
+        return argo_write_object(&v->content.object,w)+n;
         break;
     
     case 5: //ARRAY CASE
-        indent_level++;
-        return argo_write_array(&v->content.array, f)+n;
+        w->indent++;
+        return argo_write_array(&v->content.array, w)+n;
     default:
         break;
     }
     return -1;
 }
 
+/*
+ * Parallel pretty printing.
+ *
+ * A large tree is divided into an ordered list of segments.  The splitting
+ * thread walks the top of the tree and renders the brackets, separators and
+ * names between subtrees itself; runs of sibling subtrees adding up to about
+ * ARGO_PARALLEL_GRAIN values become tasks that are rendered by worker
+ * threads into their own buffers.  A sibling that is itself too big to be a
+ * single task is split recursively.  Once every segment has been rendered,
+ * the buffers are written out in order with writev().
+ *
+ * Splitting is only done when the indent size is nonzero: in that case a
+ * subtree always leaves the indent level as it found it, so the text of
+ * each task depends only on the indent level at which it starts.
+ */
+#define ARGO_PARALLEL_GRAIN 2048
+#define ARGO_PARALLEL_MIN (4 * ARGO_PARALLEL_GRAIN)
+
+#ifdef IOV_MAX
+#define ARGO_IOV_BATCH IOV_MAX
+#else
+#define ARGO_IOV_BATCH 16
+#endif
+
+/*
+ * A segment of output.  Segments with a NULL "list" hold text rendered by
+ * the splitting thread; the others are tasks that render the members of
+ * "list" from "first" up to "end", starting at indent level "indent".
+ */
+typedef struct argo_segment {
+    char *buf;
+    size_t len;
+    ARGO_VALUE *list;
+    ARGO_VALUE *first;
+    ARGO_VALUE *end;
+    int indent;
+    int status;
+} ARGO_SEGMENT;
+
+typedef struct argo_split {
+    ARGO_SEGMENT *segs;
+    int nsegs;
+    int capacity;
+    int next_task;              // Next segment to be claimed by a worker.
+    char *buf[2];               // Memory streams alternately used for the
+    size_t len[2];              // text rendered by the splitting thread.
+    int cur;                    // Which of the streams is currently open.
+    size_t *sizes;              // Subtree sizes, see argo_size_values().
+} ARGO_SPLIT;
+
+/*
+ * Number of threads used for parallel pretty printing; zero means one per
+ * online processor.
+ */
+int argo_write_threads;
+
+static int argo_is_container(ARGO_VALUE *v){
+    return v->type == ARGO_OBJECT_TYPE || v->type == ARGO_ARRAY_TYPE;
+}
+
+static int argo_is_stored(ARGO_VALUE *v){
+    return v >= argo_value_storage && v < argo_value_storage + argo_next_value;
+}
+
+/*
+ * Count the values in the subtree rooted at "v", recording the size of
+ * every subtree in "sizes" (indexed by position in argo_value_storage) on
+ * the way back up, so that the splitter can look sizes up instead of
+ * counting each subtree again at every level above it.
+ */
+static size_t argo_size_values(ARGO_VALUE *v, size_t *sizes){
+    size_t n = 1;
+    if(argo_is_container(v)){
+        ARGO_VALUE *list = v->type == ARGO_OBJECT_TYPE ?
+            v->content.object.member_list : v->content.array.element_list;
+        for(ARGO_VALUE *m = list->next; m != list; m = m->next)
+            n += argo_size_values(m, sizes);
+    }
+    if(sizes && argo_is_stored(v))
+        sizes[v - argo_value_storage] = n;
+    return n;
+}
+
+static size_t argo_subtree_size(ARGO_SPLIT *s, ARGO_VALUE *v){
+    if(argo_is_stored(v))
+        return s->sizes[v - argo_value_storage];
+    return argo_size_values(v, NULL);
+}
+
+static ARGO_SEGMENT *argo_split_add(ARGO_SPLIT *s){
+    if(s->nsegs == s->capacity){
+        int capacity = s->capacity ? 2 * s->capacity : 16;
+        ARGO_SEGMENT *segs = realloc(s->segs, capacity * sizeof(ARGO_SEGMENT));
+        if(!segs)
+            return NULL;
+        s->segs = segs;
+        s->capacity = capacity;
+    }
+    ARGO_SEGMENT *seg = s->segs + s->nsegs++;
+    seg->buf = NULL;
+    seg->len = 0;
+    seg->list = seg->first = seg->end = NULL;
+    seg->indent = 0;
+    seg->status = 0;
+    return seg;
+}
+
+/*
+ * Finish the segment being rendered by the splitting thread.
+ */
+static int argo_split_close(ARGO_SPLIT *s, FILE *f){
+    fclose(f);
+    ARGO_SEGMENT *seg = argo_split_add(s);
+    if(!seg){
+        free(s->buf[s->cur]);
+        return -1;
+    }
+    seg->buf = s->buf[s->cur];
+    seg->len = s->len[s->cur];
+    return 0;
+}
+
+/*
+ * Hand the members of "list" from "first" up to "end" to the worker threads.
+ * If no more segments can be created, they are rendered in place instead.
+ */
+static void argo_split_task(ARGO_WRITER *w, ARGO_VALUE *list, ARGO_VALUE *first, ARGO_VALUE *end){
+    ARGO_SPLIT *s = w->split;
+    if(first == end)
+        return;
+    int other = !s->cur;
+    FILE *next = open_memstream(&s->buf[other], &s->len[other]);
+    if(next && s->nsegs + 2 > s->capacity){
+        int capacity = 2 * (s->nsegs + 2);
+        ARGO_SEGMENT *segs = realloc(s->segs, capacity * sizeof(ARGO_SEGMENT));
+        if(segs){
+            s->segs = segs;
+            s->capacity = capacity;
+        }
+    }
+    if(!next || s->nsegs + 2 > s->capacity){
+        if(next){
+            fclose(next);
+            free(s->buf[other]);
+        }
+        argo_write_members(w, list, first, end);
+        return;
+    }
+    argo_split_close(s, w->f);
+    ARGO_SEGMENT *seg = argo_split_add(s);
+    seg->list = list;
+    seg->first = first;
+    seg->end = end;
+    seg->indent = w->indent;
+    w->f = next;
+    s->cur = other;
+}
+
+static void argo_split_members(ARGO_WRITER *w, ARGO_VALUE *list){
+    if(w->indent <= 0 || !(global_options & 0x000000FF)){
+        argo_write_members(w, list, list->next, list);
+        return;
+    }
+    ARGO_VALUE *first = list->next;
+    size_t weight = 0;
+    for(ARGO_VALUE *v = list->next; v != list; v = v->next){
+        size_t n = argo_subtree_size(w->split, v);
+        if(n >= ARGO_PARALLEL_MIN && argo_is_container(v)){
+            argo_split_task(w, list, first, v);
+            argo_write_members(w, list, v, v->next);
+            first = v->next;
+            weight = 0;
+            continue;
+        }
+        weight += n;
+        if(weight >= ARGO_PARALLEL_GRAIN){
+            argo_split_task(w, list, first, v->next);
+            first = v->next;
+            weight = 0;
+        }
+    }
+    argo_split_task(w, list, first, list);
+}
+
+static void *argo_split_worker(void *arg){
+    ARGO_SPLIT *s = arg;
+    int i;
+    while((i = __atomic_fetch_add(&s->next_task, 1, __ATOMIC_RELAXED)) < s->nsegs){
+        ARGO_SEGMENT *seg = s->segs + i;
+        if(!seg->list)
+            continue;
+        FILE *f = open_memstream(&seg->buf, &seg->len);
+        if(!f){
+            seg->status = -1;
+            continue;
+        }
+        ARGO_WRITER w = { f, seg->indent, NULL };
+        argo_write_members(&w, seg->list, seg->first, seg->end);
+        if(fclose(f) || w.indent != seg->indent)
+            seg->status = -1;
+    }
+    return NULL;
+}
+
+/*
+ * Write the rendered segments to the file descriptor underlying the output
+ * stream, batching them into as few writev() calls as possible.
+ */
+static int argo_split_flush(ARGO_SPLIT *s, FILE *f){
+    if(fflush(f))
+        return -1;
+    int fd = fileno(f);
+    if(fd < 0){
+        for(int i = 0; i < s->nsegs; i++){
+            if(fwrite(s->segs[i].buf, 1, s->segs[i].len, f) != s->segs[i].len)
+                return -1;
+        }
+        return 0;
+    }
+    struct iovec iov[ARGO_IOV_BATCH];
+    int i = 0;
+    while(i < s->nsegs){
+        int n = 0;
+        for(; i < s->nsegs && n < ARGO_IOV_BATCH; i++){
+            if(!s->segs[i].len)
+                continue;
+            iov[n].iov_base = s->segs[i].buf;
+            iov[n].iov_len = s->segs[i].len;
+            n++;
+        }
+        struct iovec *p = iov;
+        while(n > 0){
+            ssize_t r = writev(fd, p, n);
+            if(r < 0){
+                if(errno == EINTR)
+                    continue;
+                return -1;
+            }
+            while(n > 0 && (size_t)r >= p->iov_len){
+                r -= p->iov_len;
+                p++;
+                n--;
+            }
+            if(n > 0){
+                p->iov_base = (char *)p->iov_base + r;
+                p->iov_len -= r;
+            }
+        }
+    }
+    return 0;
+}
+
+static int argo_write_parallel(ARGO_VALUE *v, FILE *f, long nthreads, size_t *sizes){
+    ARGO_SPLIT s = { 0 };
+    s.sizes = sizes;
+    FILE *mf = open_memstream(&s.buf[0], &s.len[0]);
+    if(!mf)
+        return -1;
+    ARGO_WRITER w = { mf, indent_level, &s };
+    int ret = argo_write_node(&w, v);
+    indent_level = w.indent;
+    if(argo_split_close(&s, w.f))
+        ret = -1;
+
+    pthread_t workers[nthreads];
+    int started = 0;
+    if(!ret){
+        while(started < nthreads - 1 &&
+              !pthread_create(workers + started, NULL, argo_split_worker, &s))
+            started++;
+        argo_split_worker(&s);
+    }
+    for(int i = 0; i < started; i++)
+        pthread_join(workers[i], NULL);
+
+    if(!ret){
+        for(int i = 0; i < s.nsegs; i++)
+            ret |= s.segs[i].status;
+    }
+    if(!ret)
+        ret = argo_split_flush(&s, f);
+    for(int i = 0; i < s.nsegs; i++)
+        free(s.segs[i].buf);
+    free(s.segs);
+    return ret;
+}
+
+int argo_write_value(ARGO_VALUE *v, FILE *f) {
+    if((global_options & PRETTY_PRINT_OPTION) && (global_options & 0x000000FF) &&
+       argo_is_container(v)){
+        long nthreads = argo_write_threads > 0 ? argo_write_threads :
+            sysconf(_SC_NPROCESSORS_ONLN);
+        size_t *sizes = NULL;
+        if(nthreads > 1 && argo_next_value > 0)
+            sizes = malloc(argo_next_value * sizeof(size_t));
+        if(sizes && argo_size_values(v, sizes) >= ARGO_PARALLEL_MIN){
+            int ret = argo_write_parallel(v, f, nthreads, sizes);
+            free(sizes);
+            return ret;
+        }
+        free(sizes);
+    }
+    ARGO_WRITER w = { f, indent_level, NULL };
+    int ret = argo_write_node(&w, v);
+    indent_level = w.indent;
+    return ret;
+}
+
 /**
  * @brief  Write canonical JSON representing a specified string
  * to a specified output stream.
@@ -1,5 +1,6 @@
 #include <criterion/criterion.h>
 #include <criterion/logging.h>
+#include <string.h>
 
 #include "argo.h"
 #include "global.h"
@@ -93,3 +94,57 @@ Test(basecode_suite, argo_basic_test) {
     cr_assert_eq(return_code, EXIT_SUCCESS,
                  "Program output did not match reference output.");
 }
+
+extern int argo_write_threads;
+
+/*
+ * Render "v" pretty printed with the given number of writer threads
+ * (0 means one per processor) and return the text.
+ */
+static char *write_with_threads(ARGO_VALUE *v, int threads, size_t *lenp) {
+    char *buf = NULL;
+    FILE *f = open_memstream(&buf, lenp);
+    argo_write_threads = threads;
+    indent_level = 0;
+    int ret = argo_write_value(v, f);
+    cr_assert_eq(ret, 0, "argo_write_value failed with %d threads", threads);
+    fclose(f);
+    return buf;
+}
+
+Test(basecode_suite, argo_parallel_pretty_print_test) {
+    // Two wide arrays (each big enough to be split further) and a deep chain
+    // of nested arrays, well over ARGO_PARALLEL_MIN values in all.
+    char *json = NULL;
+    size_t json_len = 0;
+    FILE *f = open_memstream(&json, &json_len);
+    fprintf(f, "[");
+    for (int w = 0; w < 2; w++) {
+        fprintf(f, "[");
+        for (int i = 0; i < 2000; i++)
+            fprintf(f, "%s{\"a\":[%d,2.5,{\"b\":\"x\\ty\"}],\"c\":{}}", i ? "," : "", i);
+        fprintf(f, "],");
+    }
+    for (int d = 0; d < 1000; d++)
+        fprintf(f, "[%d,", d);
+    fprintf(f, "true");
+    for (int d = 0; d < 1000; d++)
+        fprintf(f, "]");
+    fprintf(f, "]");
+    fclose(f);
+
+    f = fmemopen(json, json_len, "r");
+    ARGO_VALUE *v = argo_read_value(f);
+    fclose(f);
+    cr_assert_not_null(v, "Failed to read test input");
+    cr_assert_geq(argo_next_value, 4 * 2048, "Test input too small to be split");
+
+    global_options = CANONICALIZE_OPTION | PRETTY_PRINT_OPTION | 2;
+    size_t seq_len, par_len;
+    char *seq = write_with_threads(v, 1, &seq_len);
+    char *par = write_with_threads(v, 4, &par_len);
+    cr_assert_eq(par_len, seq_len, "Parallel output length %zu differs from sequential %zu",
+		 par_len, seq_len);
+    cr_assert(memcmp(par, seq, seq_len) == 0,
+              "Parallel output differs from sequential output");
+}
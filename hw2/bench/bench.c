@@ -0,0 +1,399 @@
+/*********************/
+/* bench.c           */
+/* for Par 3.20      */
+/*********************/
+
+/* This is ANSI C code, except for the POSIX calls which run par. */
+
+/* Generates corpora at scale from the files in rsrc, runs a build of */
+/* par made with -DBENCH (see "prof.h") on each of them several times, */
+/* and reports the fastest run of each, with the time par spent in    */
+/* each phase, as a table on stdout and as JSON in a file. Usage:     */
+/*                                                                     */
+/*   bench [-r RUNS] [-s SCALE] [-o JSON] [-d RSRC] PAR                */
+/*                                                                     */
+/* RUNS (3 by default) is the number of runs of each corpus. Each      */
+/* corpus is about SCALE (8 by default) megabytes. JSON, if given, is  */
+/* where the results are written. RSRC is the directory holding the    */
+/* source texts, "rsrc" by default. PAR is the build of par to time.   */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+
+#undef NULL
+#define NULL ((void *)0)
+
+#define NPHASES 4
+
+static const char *const phases[NPHASES] =
+    {"readlines", "setdefaults", "choosebreaks", "output"};
+
+struct corpus
+{
+  const char *name, *options, *about;
+  void (*make)(FILE *f, size_t bytes);
+  char path[64];
+  size_t bytes, paragraphs;
+  double wall, ms[NPHASES]; /* Of the fastest run, in milliseconds. */
+  int failed;
+};
+
+static char *gettysburg, *lorem, *banner; /* The source texts. */
+static size_t written, paragraphs;        /* By the generator. */
+
+static void die(const char *what)
+{
+  fprintf(stderr, "bench: %s: %s\n", what, strerror(errno));
+  exit(EXIT_FAILURE);
+}
+
+static char *slurp(const char *dir, const char *name)
+
+/* Returns the contents of the file name in dir, with '\0' after them. */
+{
+  char path[1024];
+  FILE *f;
+  char *s = NULL;
+  size_t n = 0, got;
+
+  snprintf(path, sizeof path, "%s/%s", dir, name);
+  f = fopen(path, "r");
+  if (!f)
+    die(path);
+  do
+  {
+    s = realloc(s, n + 4096 + 1);
+    if (!s)
+      die("malloc");
+    got = fread(s + n, 1, 4096, f);
+    n += got;
+  } while (got);
+  s[n] = '\0';
+  fclose(f);
+  return s;
+}
+
+static void put(FILE *f, const char *s, size_t n)
+{
+  fwrite(s, 1, n, f);
+  written += n;
+}
+
+static void puttext(FILE *f, const char *s)
+{
+  put(f, s, strlen(s));
+}
+
+/* The generators, each of which writes at least bytes characters */
+/* to f, and counts the paragraphs it writes in paragraphs:        */
+
+static void makeshort(FILE *f, size_t bytes)
+
+/* Many short paragraphs: the Gettysburg address, a line at a time. */
+{
+  const char *p, *nl;
+
+  while (written < bytes)
+    for (p = gettysburg; *p; p = nl + 1)
+    {
+      nl = strchr(p, '\n');
+      if (!nl)
+        break;
+      if (nl == p)
+        continue;
+      put(f, p, nl + 1 - p);
+      puttext(f, "\n");
+      ++paragraphs;
+    }
+}
+
+static void makegiant(FILE *f, size_t bytes)
+
+/* One giant paragraph: the lorem ipsum text, over and over. */
+{
+  const char *p;
+
+  while (written < bytes)
+    for (p = lorem; *p; ++p)
+      if (*p != '\n' || p[1] != '\n')
+        put(f, p, 1);
+  puttext(f, "\n");
+  paragraphs = 1;
+}
+
+static void makeaffix(FILE *f, size_t bytes)
+
+/* Heavy prefixes and suffixes: the comment boxes of the banner, */
+/* quoted several levels deep, each box a paragraph.             */
+{
+  const char *p, *nl;
+  int inbox = 0;
+
+  while (written < bytes)
+    for (p = banner; *p; p = nl + 1)
+    {
+      nl = strchr(p, '\n');
+      if (!nl)
+        break;
+      if (nl == p)
+      {
+        if (inbox)
+        {
+          puttext(f, "\n");
+          ++paragraphs;
+        }
+        inbox = 0;
+        continue;
+      }
+      puttext(f, "> > > > | ");
+      put(f, p, nl - p);
+      puttext(f, " | < < < <\n");
+      inbox = 1;
+    }
+  if (inbox)
+    ++paragraphs;
+}
+
+static void makewide(FILE *f, size_t bytes)
+
+/* Paragraphs of about 5000 words, for a huge width. */
+{
+  const char *p;
+  size_t start;
+
+  while (written < bytes)
+  {
+    start = written;
+    while (written - start < 30000)
+      for (p = lorem; *p; ++p)
+        put(f, *p == '\n' ? " " : p, 1);
+    puttext(f, "\n\n");
+    ++paragraphs;
+  }
+}
+
+static struct corpus corpora[] = {
+    {"short", "", "many short paragraphs", makeshort},
+    {"giant", "", "one giant paragraph", makegiant},
+    {"affix", "", "heavy prefixes and suffixes", makeaffix},
+    {"wide", "-w 5000", "paragraphs at a huge width", makewide},
+};
+
+#define NCORPORA (sizeof corpora / sizeof *corpora)
+
+static double now(void)
+{
+  struct timespec t;
+
+  clock_gettime(CLOCK_MONOTONIC, &t);
+  return t.tv_sec + t.tv_nsec / 1e9;
+}
+
+static int runpar(const char *par, struct corpus *c, double *pwall,
+                  double *ms)
+
+/* Runs par on corpus *c, putting how long it took in *pwall, and */
+/* the times of its phases in ms. Returns 0 on success.           */
+{
+  char errpath[] = "/tmp/parbenchXXXXXX", line[512], *argv[16], *opts, *p;
+  FILE *err;
+  pid_t pid;
+  int fd, status, argc = 0, found = 0, i;
+  double start;
+
+  fd = mkstemp(errpath);
+  if (fd < 0)
+    die("mkstemp");
+  opts = strdup(c->options);
+  argv[argc++] = (char *)par;
+  for (p = strtok(opts, " "); p && argc < 15; p = strtok(NULL, " "))
+    argv[argc++] = p;
+  argv[argc] = NULL;
+
+  start = now();
+  pid = fork();
+  if (pid < 0)
+    die("fork");
+  if (!pid)
+  {
+    int in = open(c->path, O_RDONLY), out = open("/dev/null", O_WRONLY);
+    if (in < 0 || out < 0)
+      _exit(127);
+    dup2(in, 0);
+    dup2(out, 1);
+    dup2(fd, 2);
+    execv(par, argv);
+    _exit(127);
+  }
+  waitpid(pid, &status, 0);
+  *pwall = (now() - start) * 1e3;
+  free(opts);
+
+  err = fdopen(fd, "r");
+  rewind(err);
+  while (fgets(line, sizeof line, err))
+    if (!strncmp(line, "par: prof:", 10))
+    {
+      found = 1;
+      for (i = 0, p = line + 10; i < NPHASES; ++i)
+      {
+        p = strstr(p, phases[i]);
+        if (!p)
+          break;
+        p += strlen(phases[i]);
+        ms[i] = strtod(p, &p);
+      }
+      found = i == NPHASES;
+    }
+    else
+      fputs(line, stderr);
+  fclose(err);
+  unlink(errpath);
+
+  if (!WIFEXITED(status) || WEXITSTATUS(status))
+    return -1;
+  if (!found)
+  {
+    fprintf(stderr, "bench: %s was not built with -DBENCH\n", par);
+    return -1;
+  }
+  return 0;
+}
+
+static void writejson(FILE *f, const char *par, int runs, int scale)
+{
+  size_t i;
+  int j;
+  struct corpus *c;
+
+  fprintf(f, "{\n  \"par\": \"%s\",\n  \"runs\": %d,\n  \"scale_mb\": %d,\n",
+          par, runs, scale);
+  fprintf(f, "  \"corpora\": [\n");
+  for (i = 0; i < NCORPORA; ++i)
+  {
+    c = &corpora[i];
+    fprintf(f, "    {\"name\": \"%s\", \"options\": \"%s\", \"bytes\": %lu, "
+               "\"paragraphs\": %lu, \"failed\": %s,\n",
+            c->name, c->options, (unsigned long)c->bytes,
+            (unsigned long)c->paragraphs, c->failed ? "true" : "false");
+    fprintf(f, "     \"wall_ms\": %.3f, \"mb_per_s\": %.3f, "
+               "\"us_per_paragraph\": %.3f,\n     \"phases_ms\": {",
+            c->wall, c->bytes / 1e6 / (c->wall / 1e3),
+            c->wall * 1e3 / c->paragraphs);
+    for (j = 0; j < NPHASES; ++j)
+      fprintf(f, "%s\"%s\": %.3f", j ? ", " : "", phases[j], c->ms[j]);
+    fprintf(f, "}}%s\n", i + 1 < NCORPORA ? "," : "");
+  }
+  fprintf(f, "  ]\n}\n");
+}
+
+int main(int argc, char *argv[])
+{
+  const char *rsrc = "rsrc", *json = NULL, *par;
+  char dir[] = "/tmp/parbenchXXXXXX";
+  int runs = 3, scale = 8, opt, r, j, status = EXIT_SUCCESS;
+  size_t i;
+  double wall, ms[NPHASES];
+  struct corpus *c;
+  FILE *f;
+
+  while ((opt = getopt(argc, argv, "r:s:o:d:")) != -1)
+    switch (opt)
+    {
+    case 'r':
+      runs = atoi(optarg);
+      break;
+    case 's':
+      scale = atoi(optarg);
+      break;
+    case 'o':
+      json = optarg;
+      break;
+    case 'd':
+      rsrc = optarg;
+      break;
+    default:
+      goto usage;
+    }
+  if (optind != argc - 1 || runs < 1 || scale < 1)
+    goto usage;
+  par = argv[optind];
+
+  gettysburg = slurp(rsrc, "gettysburg.txt");
+  lorem = slurp(rsrc, "loremipsum.txt");
+  banner = slurp(rsrc, "banner.txt");
+  if (!mkdtemp(dir))
+    die("mkdtemp");
+
+  printf("%-6s %9s %8s %9s %9s %8s %9s %9s %9s %9s\n", "corpus", "MB",
+         "paras", "wall ms", "MB/s", "us/para", phases[0], phases[1],
+         phases[2], phases[3]);
+
+  for (i = 0; i < NCORPORA; ++i)
+  {
+    c = &corpora[i];
+    snprintf(c->path, sizeof c->path, "%s/%s.txt", dir, c->name);
+    f = fopen(c->path, "w");
+    if (!f)
+      die(c->path);
+    written = paragraphs = 0;
+    c->make(f, (size_t)scale << 20);
+    if (fclose(f))
+      die(c->path);
+    c->bytes = written;
+    c->paragraphs = paragraphs;
+
+    for (r = 0; r < runs; ++r)
+    {
+      if (runpar(par, c, &wall, ms))
+      {
+        c->failed = 1;
+        status = EXIT_FAILURE;
+        break;
+      }
+      if (!r || wall < c->wall)
+      {
+        c->wall = wall;
+        memcpy(c->ms, ms, sizeof ms);
+      }
+    }
+    unlink(c->path);
+
+    printf("%-6s %9.2f %8lu %9.1f %9.2f %8.2f", c->name, c->bytes / 1e6,
+           (unsigned long)c->paragraphs, c->wall,
+           c->bytes / 1e6 / (c->wall / 1e3), c->wall * 1e3 / c->paragraphs);
+    for (j = 0; j < NPHASES; ++j)
+      printf(" %9.1f", c->ms[j]);
+    printf("%s\n", c->failed ? "  FAILED" : "");
+  }
+  rmdir(dir);
+
+  if (json)
+  {
+    f = fopen(json, "w");
+    if (!f)
+      die(json);
+    writejson(f, par, runs, scale);
+    if (fclose(f))
+      die(json);
+  }
+
+  free(gettysburg);
+  free(lorem);
+  free(banner);
+  return status;
+
+usage:
+
+  fprintf(stderr, "usage: %s [-r RUNS] [-s SCALE] [-o JSON] [-d RSRC] PAR\n",
+          argv[0]);
+  return EXIT_FAILURE;
+}
@@ -0,0 +1,45 @@
+/*********************/
+/* arena.h           */
+/* for Par 3.20      */
+/*********************/
+
+/* This is ANSI C code. */
+
+
+/* Note: Those functions declared here which do not use errmsg    */
+/* always succeed, provided that they are passed valid arguments. */
+
+
+#include <stddef.h>
+
+
+struct arena;
+
+
+struct arena *newarena(void);
+
+  /* newarena() returns a pointer to a new empty struct arena. Any struct */
+  /* arena *a passed to any function declared in this header must have    */
+  /* been obtained from this function. newarena() uses errmsg, and        */
+  /* returns NULL on failure.                                             */
+
+
+void freearena(struct arena *a);
+
+  /* freearena(a) frees all the memory associated with *a, including */
+  /* every object allocated from it. a may not be used after this call. */
+
+
+void *arenaalloc(struct arena *a, size_t size);
+
+  /* arenaalloc(a,size) returns a pointer to size bytes of zeroed storage, */
+  /* suitably aligned for any object, which remains valid until *a is     */
+  /* reset or freed. The storage may not be passed to free(). arenaalloc() */
+  /* uses errmsg, and returns NULL on failure.                            */
+
+
+void resetarena(struct arena *a);
+
+  /* resetarena(a) releases every object allocated from *a at once, but */
+  /* keeps the memory, so that later calls to arenaalloc() can reuse it */
+  /* without going back to malloc().                                    */
@@ -59,6 +59,13 @@ void *copyitems(struct buffer *buf);
   /* with free(). copyitems() uses errmsg, and returns NULL on failure.   */
 
 
+void *bufferitems(struct buffer *buf);
+
+  /* bufferitems(buf) returns a pointer to the items in *buf, which are */
+  /* stored contiguously and in order. The pointer remains valid until  */
+  /* the next call to additem() or freebuffer() for buf.               */
+
+
 void *nextitem(struct buffer *buf);
 
   /* When buf was created by newbuffer, a pointer associated with buf  */
@@ -0,0 +1,88 @@
+/*********************/
+/* cache.h           */
+/* for Par 3.20      */
+/*********************/
+
+/* This is ANSI C code. */
+
+
+/* Note: Those functions declared here which do not use errmsg    */
+/* always succeed, provided that they are passed valid arguments. */
+
+
+#include <stddef.h>
+
+
+/* A cache remembers the output of reformatting paragraphs, keyed on */
+/* the text of the paragraph and the NSETTINGS integer parameters    */
+/* which reformatting it depended on.                                */
+
+#define NSETTINGS 6
+
+
+struct cache;
+
+
+struct cache *newcache(size_t limit);
+
+  /* newcache(limit) returns a pointer to a new empty struct cache, which */
+  /* trimcache() keeps to about limit bytes. Any struct cache *c passed   */
+  /* to any function declared in this header must have been obtained      */
+  /* from this function. newcache() uses errmsg, and returns NULL on      */
+  /* failure.                                                             */
+
+
+void freecache(struct cache *c);
+
+  /* freecache(c) frees all the memory associated with *c, including */
+  /* any output returned by findcache(). c may not be used afterward. */
+
+
+unsigned long hashtext(const char *s, size_t n);
+
+  /* hashtext(s,n) returns the hash of the n characters at s, which need */
+  /* not be terminated by '\0', by the same method as hashparagraph().   */
+
+
+unsigned long hashparagraph(const char * const *lines, const int *settings);
+
+  /* hashparagraph(lines,settings) returns the hash of the paragraph made */
+  /* of the NULL-terminated array of lines, reformatted with settings,   */
+  /* for use with findcache() and addcache().                            */
+
+
+const char *findcache(struct cache *c, unsigned long hash,
+                      const char * const *lines, const int *settings,
+                      size_t *plen);
+
+  /* findcache(c,hash,lines,settings,plen) looks up the paragraph whose */
+  /* hash is hash. If it is in *c, it becomes the most recently used,   */
+  /* its output length is put in *plen, and a pointer to its output     */
+  /* (not terminated by '\0') is returned, which remains valid until    */
+  /* the next call to trimcache(). Otherwise NULL is returned.          */
+
+
+void addcache(struct cache *c, unsigned long hash,
+              const char * const *lines, const int *settings,
+              const char *out, size_t len);
+
+  /* addcache(c,hash,lines,settings,out,len) adds the paragraph, which  */
+  /* must not be in *c, with the len characters at out as its output,   */
+  /* as the most recently used. Nothing is evicted; *c may exceed its  */
+  /* limit until the next call to trimcache(). A paragraph bigger than  */
+  /* the limit is not added. addcache() uses errmsg.                    */
+
+
+void trimcache(struct cache *c);
+
+  /* trimcache(c) evicts the least recently used paragraphs from *c */
+  /* until it is within its limit.                                  */
+
+
+void cachestats(const struct cache *c, unsigned long *phits,
+                unsigned long *pmisses, unsigned long *pevictions);
+
+  /* cachestats(c,phits,pmisses,pevictions) puts the numbers of calls */
+  /* to findcache() which found and did not find their paragraph,     */
+  /* and the number of paragraphs evicted, in *phits, *pmisses, and   */
+  /* *pevictions.                                                     */
@@ -50,3 +50,12 @@ int report_error(FILE *file);
  * any existing error message.
  */
 void clear_error();
+
+/**
+ * @brief  Clear any existing error indication, without freeing the message.
+ * The indication belongs to the calling thread, so this is how a message is
+ * handed to another thread for reporting.
+ * @return The existing error message, which the caller must free, or NULL
+ * if there was no existing error indication.
+ */
+char *take_error();
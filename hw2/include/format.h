@@ -0,0 +1,159 @@
+/*********************/
+/* format.h          */
+/* for Par 3.20      */
+/*********************/
+
+/* This is ANSI C code. */
+
+
+/* What par and the library interface declared in "libpar.h" share:   */
+/* the settings and how they are parsed, and the reformatting of input */
+/* held in a block into output gathered as spans. None of this is     */
+/* part of "libpar.h", nor exported by libpar.a.                       */
+
+
+#include "reformat.h" /* Also includes <stddef.h>. */
+#include "cache.h"
+
+#include <stdio.h>
+#include <sys/uio.h>
+
+
+extern const char *const progname, *const version;
+
+
+/* Input is read from stdin in large blocks rather than one character at */
+/* a time. The lines of a paragraph are left in place in the block, with */
+/* their newlines replaced by '\0', so readlines() needs no per-line     */
+/* copies. Consumed input is discarded from the front of the block       */
+/* whenever more must be read, so a paragraph always lies in a single    */
+/* contiguous span of the block. A block can also hold input which has   */
+/* already been read, in which case it is never refilled.                */
+
+#define INBLOCK 65536
+
+/* Output is gathered as a list of spans of characters, which mostly    */
+/* point into the input block (see reformatspans() in "reformat.h"),    */
+/* and adjacent spans are merged. The list is written with one call to */
+/* writev() when it fills, and before the block is moved or freed.     */
+
+#define OUTSPANS 1024 /* No more than IOV_MAX. */
+
+struct output
+{
+  int fd;        /* Descriptor the spans are written to, or -1. */
+  FILE *file;    /* Where they are written if fd is -1.         */
+  struct iovec span[OUTSPANS];
+  int n;         /* The number of spans.                        */
+  struct cache *cache; /* A cache the spans may point into, which */
+                       /* is trimmed only once they are written.  */
+  int err;       /* errno of the first failed write, or 0.      */
+};
+
+struct input
+{
+  int fd;      /* Descriptor to read from, or -1 for none.              */
+  char *buf;   /* The block. One byte beyond size is reserved for '\0'. */
+  size_t size, /* Capacity of buf, not counting the reserved byte.      */
+      start,   /* Offset of the first unconsumed character.             */
+      end;     /* Offset just past the last character read.             */
+  int eof;     /* Nonzero once read() has reported end of file.         */
+  struct output *pending; /* Output which may point into the block.   */
+};
+
+/* The settings given by PARINIT and the command line, which setdefaults() */
+/* completes separately for each paragraph. Negative values are unset.     */
+
+struct settings
+{
+  int width, prefix, suffix, hang, last, min,
+      window,     /* The most lines of a paragraph held at once, or 0. */
+      cache,      /* Kilobytes of reformatted paragraphs kept, or 0.   */
+      cachestats, /* Nonzero to report how well the cache did.         */
+      files,      /* Nonzero to reformat files in place (see par.c).   */
+      npaths;     /* The number of operands naming them.               */
+  char *const *paths; /* The operands, if files is nonzero.            */
+  const char *serve;  /* The socket to serve requests on, or NULL.     */
+};
+
+
+void flushoutput(struct output *out);
+
+  /* flushoutput(out) writes the spans of *out, empties it, and trims its */
+  /* cache. Write errors are only recorded in out->err, as most callers   */
+  /* ignore them, as puts() does. Does not use errmsg.                    */
+
+
+size_t fillinput(struct input *in);
+
+  /* fillinput(in) discards the consumed part of the block of *in, then   */
+  /* reads more into it, first growing the block if it is full. Returns  */
+  /* the number of characters added, which is 0 at end of file or on an  */
+  /* error. Offsets relative to in->start remain valid. Uses errmsg.     */
+
+
+int getoption(int argc, char *argv[], struct settings *set);
+
+  /* getoption(argc,argv,set) parses the options in argv[1..argc-1],   */
+  /* setting the members of *set as appropriate. Returns 1 as soon as  */
+  /* it finds --version, and 0 otherwise. Uses errmsg.                 */
+
+
+int parseoptions(const char *options, char *argv0, struct settings *set);
+
+  /* parseoptions(options,argv0,set) splits options at white space, as    */
+  /* PARINIT is split, and passes the pieces to getoption(), preceded by  */
+  /* argv0 if it is not NULL, which getoption() skips as the program      */
+  /* name. Returns what getoption() returns. --files and --serve are      */
+  /* allowed only on the command line, since the pieces are freed on      */
+  /* return. Uses errmsg.                                                 */
+
+
+void parsesettings(const char *options, struct settings *set);
+
+  /* parsesettings(options,set) changes *set by options, as given to     */
+  /* par_setoptions() or in a request to par --serve, where --version is */
+  /* an error. Unlike parseoptions(), it may be called from any number   */
+  /* of threads at once. Uses errmsg.                                    */
+
+
+void formatinput(struct input *in, const struct settings *set,
+                 struct rfstore *store, struct cache *cache,
+                 struct output *out);
+
+  /* formatinput(in,set,store,cache,out) reformats the paragraphs in *in  */
+  /* according to *set until end of input, writing them to out, along    */
+  /* with the newlines between them. Storage for reformatting is taken   */
+  /* from *store, or from the calling thread if store is NULL.           */
+  /* Paragraphs are looked up in *cache, and added to it, unless cache   */
+  /* is NULL. The output may still point into the input block or the     */
+  /* cache, so it must be flushed before the block is freed. Uses errmsg. */
+  /*                                                                      */
+  /* If set->window is not 0, a paragraph longer than that many lines     */
+  /* is reformatted in pieces, so that only about that much of it is      */
+  /* held at once: the first half of the output lines of each piece is    */
+  /* written, and the rest are reformatted again along with the next      */
+  /* set->window lines of input. The first piece alone determines the     */
+  /* defaults chosen by setdefaults(). The result is the same as          */
+  /* without a window only for paragraphs that fit in it.                 */
+
+
+/* Defined in libpar.c, for par --serve, which reformats the text of each */
+/* request with a context of its own:                                      */
+
+struct parctx;
+
+
+struct settings *ctxsettings(struct parctx *ctx);
+
+  /* ctxsettings(ctx) returns the settings of *ctx, which may be changed */
+  /* between calls to formatcopy().                                       */
+
+
+char *formatcopy(struct parctx *ctx, const char *in, size_t len, size_t *plen);
+
+  /* formatcopy(ctx,in,len,plen) reformats a copy of the len characters  */
+  /* at in with the settings of *ctx, and returns the output, *plen       */
+  /* characters, which must be freed. On failure the output is what par  */
+  /* would have written before failing, or NULL if there is none. Uses   */
+  /* errmsg.                                                              */
@@ -0,0 +1,91 @@
+/*********************/
+/* libpar.h          */
+/* for Par 3.20      */
+/*********************/
+
+/* This is ANSI C code. */
+
+
+/* The functions declared here let a program reformat text the way par  */
+/* does without running it. They never write to stdout or stderr, and    */
+/* never exit; failures are reported through the context. Any number of  */
+/* contexts may be used at once, each by one thread at a time.           */
+
+
+#include <stddef.h>
+
+
+struct parctx;
+
+
+typedef int (*par_writer)(void *arg, const char *s, size_t n);
+
+  /* A par_writer is called by par_format() or par_reflow() to deliver */
+  /* output: the n characters at s, which are not terminated by '\0'.  */
+  /* arg is what was passed to par_format() or par_reflow(). It        */
+  /* returns 0 on success.                                             */
+
+
+struct parctx *par_newctx(void);
+
+  /* par_newctx() returns a new context, with no options set, or NULL */
+  /* if there is not enough memory.                                   */
+
+
+void par_freectx(struct parctx *ctx);
+
+  /* par_freectx(ctx) frees *ctx, which may not be used afterwards. */
+
+
+int par_setoptions(struct parctx *ctx, const char *options);
+
+  /* par_setoptions(ctx,options) replaces the options of *ctx with those */
+  /* in options, which are written as in PARINIT (see "par.doc"). It     */
+  /* returns 0 on success. Otherwise it returns -1, and leaves the       */
+  /* options of *ctx unchanged.                                          */
+
+
+int par_format(struct parctx *ctx, const char *in, size_t len,
+               par_writer out, void *arg);
+
+  /* par_format(ctx,in,len,out,arg) reformats the len characters at in, */
+  /* as par would with the options of *ctx, and passes the result to    */
+  /* out. It returns 0 on success. Otherwise it returns -1, after       */
+  /* passing out whatever par would have written before failing.        */
+
+
+int par_reflow(struct parctx *ctx, const char *in, size_t len,
+               par_writer out, void *arg);
+
+  /* par_reflow(ctx,in,len,out,arg) does the same as par_format(), but is */
+  /* meant to be called again each time the text is edited, as by an     */
+  /* editor. *ctx remembers the text and the output of each of its       */
+  /* paragraphs, so that only the paragraphs whose characters changed    */
+  /* since the last call are reformatted. out may be called once for     */
+  /* each paragraph. Changing the options of *ctx, or a failure, makes  */
+  /* it forget, so the next call reformats the whole text.               */
+
+
+void par_reflowstats(const struct parctx *ctx, unsigned long *preused,
+                     unsigned long *preformatted);
+
+  /* par_reflowstats(ctx,preused,preformatted) puts the numbers of       */
+  /* paragraphs whose output the last call to par_reflow() with *ctx     */
+  /* kept, and of those it reformatted, in *preused and *preformatted.  */
+
+
+const char *par_error(const struct parctx *ctx);
+
+  /* par_error(ctx) returns the message describing why the last call to */
+  /* par_setoptions(), par_format(), or par_reflow() with *ctx failed,  */
+  /* or NULL if it succeeded. The message remains valid until the next  */
+  /* such call.                                                         */
+
+
+void par_cachestats(const struct parctx *ctx, unsigned long *phits,
+                    unsigned long *pmisses, unsigned long *pevictions);
+
+  /* par_cachestats(ctx,phits,pmisses,pevictions) puts the numbers of    */
+  /* paragraphs found and not found in the cache of *ctx, which it has  */
+  /* if its options include --cache, and the number evicted from it, in */
+  /* *phits, *pmisses, and *pevictions. They are 0 if there is none.    */
@@ -0,0 +1,55 @@
+/*********************/
+/* prof.h            */
+/* for Par 3.20      */
+/*********************/
+
+/* This is ANSI C code. */
+
+
+/* When Par is built with -DBENCH (see "make bench"), the time spent in   */
+/* each of the phases below is added up, over all threads, and reported  */
+/* on stderr at exit. Otherwise the macros expand to nothing, and cost   */
+/* nothing.                                                              */
+
+
+#include <stdio.h>
+
+
+#define PROF_READLINES    0 /* Splitting the input into paragraphs.  */
+#define PROF_SETDEFAULTS  1 /* Choosing the defaults for each one.   */
+#define PROF_CHOOSEBREAKS 2 /* Choosing where its lines break.       */
+#define PROF_OUTPUT       3 /* Writing the output.                   */
+#define NPHASES 4
+
+
+#ifdef BENCH
+
+extern unsigned long long proftotals[NPHASES];
+
+  /* proftotals[phase] is the number of nanoseconds spent in phase. */
+
+
+unsigned long long profclock(void);
+
+  /* profclock() returns the time in nanoseconds from some fixed point. */
+
+
+void profreport(FILE *f);
+
+  /* profreport(f) writes proftotals to f, in milliseconds, on one line */
+  /* of the form "par: prof: readlines 1.234 setdefaults ..." in the   */
+  /* order of the phases.                                              */
+
+
+#define PROFSTART(t) unsigned long long t = profclock()
+#define PROFEND(phase, t) \
+  __atomic_fetch_add(&proftotals[phase], profclock() - (t), __ATOMIC_RELAXED)
+#define PROFREPORT(f) profreport(f)
+
+#else
+
+#define PROFSTART(t)
+#define PROFEND(phase, t)
+#define PROFREPORT(f)
+
+#endif
@@ -8,6 +8,9 @@
 /* This is ANSI C code. */
 
 
+#include <stddef.h>
+
+
 char **reformat(const char * const *inlines, int width,
                 int prefix, int suffix, int hang, int last, int min);
 
@@ -16,5 +19,53 @@ char **reformat(const char * const *inlines, int width,
   /* "par.doc". reformat(inlines,width,prefix,suffix,hang,last,min) returns */
   /* a NULL-terminated array of pointers to output lines containing the     */
   /* reformatted paragraph, according to the specification in "par.doc".    */
-  /* None of the integer parameters may be negative. reformat() uses errmsg */
-  /* (see "errmsg.h"), and returns NULL on failure.                         */
+  /* None of the integer parameters may be negative. The array and the     */
+  /* lines are allocated from storage owned by reformat(); they remain     */
+  /* valid until the next call to reformat() in the same thread, and must  */
+  /* not be freed.                                                          */
+  /* reformat() uses errmsg (see "errmsg.h"), and returns NULL on failure.  */
+
+
+void freereformat(void);
+
+  /* Frees the storage reformat() keeps for the calling thread. The lines */
+  /* it last returned in this thread become invalid. Does not use errmsg. */
+
+
+struct rfstore;
+
+struct rfstore *newrfstore(void);
+
+  /* Returns new, empty storage for reformatwith(). Uses errmsg, */
+  /* and returns NULL on failure.                                */
+
+
+void freerfstore(struct rfstore *store);
+
+  /* Frees *store. The lines last returned by reformatwith() */
+  /* with it become invalid. Does not use errmsg.            */
+
+
+char **reformatwith(struct rfstore *store, const char * const *inlines,
+                    int width, int prefix, int suffix, int hang, int last, int min);
+
+  /* Does the same as reformat(), but keeps the output and its working */
+  /* storage in *store rather than in storage owned by the calling     */
+  /* thread, so the lines remain valid until the next call with the    */
+  /* same store, from whichever thread. Uses errmsg.                   */
+
+
+typedef void (*rfemit)(void *arg, const char *s, size_t n);
+
+int reformatspans(struct rfstore *store, const char * const *inlines,
+                  int width, int prefix, int suffix, int hang, int last, int min,
+                  rfemit emit, void *arg);
+
+  /* Does the same as reformatwith(), except that rather than building   */
+  /* the output lines, it passes them to emit(arg,s,n) as a series of    */
+  /* spans of n characters at s, each line followed by a newline. Spans  */
+  /* of prefixes, suffixes and words point into the input lines, and     */
+  /* the rest into constant strings of spaces and newlines, so nothing   */
+  /* is copied; they remain valid as long as the input lines do. If      */
+  /* store is NULL, the calling thread's storage is used, as reformat()  */
+  /* uses it. Uses errmsg, and returns 0 on success, -1 on failure.      */
@@ -0,0 +1,64 @@
+/*********************/
+/* scan.h            */
+/* for Par 3.20      */
+/*********************/
+
+/* This is ANSI C code. */
+
+
+/* Note: None of the functions declared here use errmsg. They all */
+/* succeed, provided that they are passed valid arguments. In the */
+/* functions below, a space is any character for which isspace()  */
+/* is true in the "C" locale, which is the only one Par uses.     */
+
+
+#include <stddef.h>
+
+
+struct scan
+{
+  const char *block, /* The block of text classified by mask. */
+             *end;   /* The end of the text being scanned.    */
+  unsigned long long mask; /* Bit i is set if block[i] is a space, */
+                           /* or lies at or beyond end.            */
+};
+
+  /* A struct scan walks through text a block of 64 characters at  */
+  /* a time, using SIMD instructions where the machine has them to */
+  /* classify each block as a whole, so that finding the next word */
+  /* boundary takes a few bit operations instead of a test of each */
+  /* character.                                                    */
+
+
+void startscan(struct scan *s, const char *p, const char *end);
+
+  /* startscan(s,p,end) prepares *s for scanning the text from p up to */
+  /* (but not including) end. The text need not end with '\0'.         */
+
+
+const char *scanspaces(struct scan *s, const char *p);
+
+  /* scanspaces(s,p) returns the first non-space at or after p, or */
+  /* the end of the text if there is none. p must lie within the   */
+  /* text passed to startscan(). Scanning is fastest when each call */
+  /* starts where the one before it stopped.                        */
+
+
+const char *scanword(struct scan *s, const char *p);
+
+  /* scanword(s,p) is like scanspaces(s,p), but returns the first */
+  /* space at or after p, or the end of the text.                  */
+
+
+size_t commonprefix(const char *a, const char *b, size_t n);
+
+  /* commonprefix(a,b,n) returns the number of characters at the */
+  /* start of a that match those at the start of b, up to n. At  */
+  /* least n characters must be readable at each of a and b.     */
+
+
+size_t commonsuffix(const char *aend, const char *bend, size_t n);
+
+  /* commonsuffix(aend,bend,n) is like commonprefix(), but compares */
+  /* the characters before aend with those before bend, working    */
+  /* backwards.                                                     */
@@ -0,0 +1,134 @@
+/*********************/
+/* arena.c           */
+/* for Par 3.20      */
+/*********************/
+
+/* This is ANSI C code. */
+
+#include "arena.h" /* Makes sure we're consistent with the */
+                   /* prototypes. Also includes <stddef.h> */
+#include "errmsg.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#undef NULL
+#define NULL ((void *)0)
+
+/* Objects are carved out of a list of chunks, each at least twice */
+/* the size of the one before it, so that even a huge paragraph    */
+/* needs only a handful of calls to malloc(). Resetting the arena  */
+/* keeps the chunks for reuse.                                     */
+
+#define MINCHUNK 65536
+
+union align
+{
+  long l;
+  double d;
+  void *p;
+};
+
+#define ALIGNED(n) (((n) + sizeof(union align) - 1) & ~(sizeof(union align) - 1))
+
+struct chunk
+{
+  struct chunk *next; /* The next chunk, or NULL if none.    */
+  size_t size,        /* Number of bytes of storage.         */
+      used;           /* The first used bytes are allocated. */
+  union align data[1];
+};
+
+struct arena
+{
+  struct chunk *first,  /* The first chunk, or NULL if none.   */
+      *current;         /* The chunk now being allocated from. */
+};
+
+struct arena *newarena(void)
+{
+  struct arena *a;
+
+  a = (struct arena *)calloc(1, sizeof(struct arena));
+  if (!a)
+  {
+    set_error(outofmem);
+    return NULL;
+  }
+
+  a->first = a->current = NULL;
+
+  clear_error();
+  return a;
+}
+
+void freearena(struct arena *a)
+{
+  struct chunk *c, *tmp;
+
+  c = a->first;
+  while (c)
+  {
+    tmp = c;
+    c = c->next;
+    free(tmp);
+  }
+
+  free(a);
+}
+
+void *arenaalloc(struct arena *a, size_t size)
+{
+  struct chunk *c, *new;
+  size_t chunksize;
+  void *r;
+
+  size = ALIGNED(size ? size : 1);
+
+  for (c = a->current; c; c = a->current = c->next)
+  {
+    if (c->size - c->used >= size)
+    {
+      r = (char *)c->data + c->used;
+      c->used += size;
+      memset(r, 0, size);
+      clear_error();
+      return r;
+    }
+    if (!c->next)
+      break;
+    c->next->used = 0;
+  }
+
+  chunksize = c ? 2 * c->size : MINCHUNK;
+  if (chunksize < size)
+    chunksize = size;
+
+  new = (struct chunk *)malloc(offsetof(struct chunk, data) + chunksize);
+  if (!new)
+  {
+    set_error(outofmem);
+    return NULL;
+  }
+  new->next = NULL;
+  new->size = chunksize;
+  new->used = size;
+
+  if (c)
+    c->next = new;
+  else
+    a->first = new;
+  a->current = new;
+
+  r = new->data;
+  memset(r, 0, size);
+  clear_error();
+  return r;
+}
+
+void resetarena(struct arena *a)
+{
+  a->current = a->first;
+  if (a->first)
+    a->first->used = 0;
+}
@@ -23,39 +23,39 @@
 
 struct buffer
 {
-  struct block *firstblk, /* The first block.                    */
-      *current,           /* The last non-empty block, or        */
-                          /* firstblk if all are empty.          */
-      *nextblk;           /* The block containing the item to be */
-                          /* returned by nextitem(), or NULL.    */
-  int nextindex;          /* Index of item in nextblock->items.  */
-  size_t itemsize;        /* The size of an item.                */
+  void *items;     /* Storage for the items.                    */
+  int numitems,    /* The first numitems slots are filled.      */
+      maxitems,    /* Number of items that fit in *items.       */
+      nextindex;   /* Index of item to be returned by nextitem. */
+  size_t itemsize; /* The size of an item.                      */
 };
 
-struct block
+/* The items are kept in a single array which doubles in size whenever */
+/* it fills up, so additem() takes amortized constant time and the     */
+/* items can be read in place through bufferitems().                   */
+
+static int initialitems(size_t itemsize)
 {
-  struct block *next; /* The next block, or NULL if none.              */
-  void *items;        /* Storage for the items in this block.          */
-  int maxhere,        /* Number of items that fit in *items.           */
-      numprevious,    /* Total of numhere for all previous blocks.     */
-      numhere;        /* The first numhere slots in *items are filled. */
-};
+  int maxitems;
+
+  maxitems = 124 / itemsize;
+  if (maxitems < 4)
+    maxitems = 4;
+
+  return maxitems;
+}
 
 struct buffer *newbuffer(size_t itemsize)
 {
   struct buffer *buf;
-  struct block *blk;
   void *items;
-  int maxhere;
+  int maxitems;
 
-  maxhere = 124 / itemsize;
-  if (maxhere < 4)
-    maxhere = 4;
+  maxitems = initialitems(itemsize);
 
   buf = (struct buffer *)calloc(1, sizeof(struct buffer));
-  blk = (struct block *)calloc(1, sizeof(struct block));
-  items = calloc(maxhere, itemsize);
-  if (!buf || !blk || !items)
+  items = calloc(maxitems, itemsize);
+  if (!buf || !items)
   {
     // strcpy(errmsg,outofmem);
     set_error(outofmem);
@@ -63,11 +63,9 @@ struct buffer *newbuffer(size_t itemsize)
   }
 
   buf->itemsize = itemsize;
-  buf->firstblk = buf->current = buf->nextblk = blk;
-  buf->nextindex = 0;
-  blk->numprevious = blk->numhere = 0;
-  blk->maxhere = maxhere;
-  blk->items = items;
+  buf->items = items;
+  buf->numitems = buf->nextindex = 0;
+  buf->maxitems = maxitems;
 
   // *errmsg = '\0';
   clear_error();
@@ -76,8 +74,6 @@ struct buffer *newbuffer(size_t itemsize)
 nberror:
   if (buf)
     free(buf);
-  if (blk)
-    free(blk);
   if (items)
     free(items);
   return NULL;
@@ -85,94 +81,55 @@ nberror:
 
 void freebuffer(struct buffer *buf)
 {
-  struct block *blk, *tmp;
-
-  blk = buf->firstblk;
-  while (blk)
-  {
-    tmp = blk;
-    blk = blk->next;
-    if (tmp->items)
-      free(tmp->items);
-    free(tmp);
-  }
-
+  free(buf->items);
   free(buf);
 }
 
 void clearbuffer(struct buffer *buf)
 {
-  struct block *blk;
-
-  for (blk = buf->firstblk; blk; blk = blk->next)
-    blk->numhere = 0;
-
-  buf->current = buf->firstblk;
+  buf->numitems = 0;
 }
 
 void additem(struct buffer *buf, const void *item)
 {
-  struct block *blk, *new;
   void *items;
-  int maxhere;
+  int maxitems;
   size_t itemsize = buf->itemsize;
 
-  blk = buf->current;
-
-  if (blk->numhere == blk->maxhere)
+  if (buf->numitems == buf->maxitems)
   {
-    new = blk->next;
-    if (!new)
+    maxitems = 2 * buf->maxitems;
+    items = realloc(buf->items, maxitems * itemsize);
+    if (!items)
     {
-      maxhere = 2 * blk->maxhere;
-      new = (struct block *)calloc(1, sizeof(struct block));
-      items = calloc(maxhere, itemsize);
-      if (!new || !items)
-      {
-        // strcpy(errmsg,outofmem);
-        set_error(outofmem);
-        goto aierror;
-      }
-      blk->next = new;
-      new->next = NULL;
-      new->maxhere = maxhere;
-      new->numprevious = blk->numprevious + blk->numhere;
-      new->numhere = 0;
-      new->items = items;
+      // strcpy(errmsg,outofmem);
+      set_error(outofmem);
+      return;
     }
-    blk = buf->current = new;
+    buf->items = items;
+    buf->maxitems = maxitems;
   }
 
-  memcpy(((char *)blk->items) + (blk->numhere * itemsize), item, itemsize);
+  memcpy(((char *)buf->items) + (buf->numitems * itemsize), item, itemsize);
 
-  ++blk->numhere;
+  ++buf->numitems;
 
   // *errmsg = '\0';
   clear_error();
-  return;
-
-aierror:
-  if (new)
-    free(new);
-  if (items)
-    free(items);
 }
 
 int numitems(struct buffer *buf)
 {
-  struct block *blk = buf->current;
-  return blk->numprevious + blk->numhere;
+  return buf->numitems;
 }
 
 void *copyitems(struct buffer *buf)
 {
   int n;
   void *r;
-  struct block *blk, *b;
   size_t itemsize = buf->itemsize;
 
-  b = buf->current;
-  n = b->numprevious + b->numhere;
+  n = buf->numitems;
   if (!n)
     return NULL;
 
@@ -184,37 +141,27 @@ void *copyitems(struct buffer *buf)
     return NULL;
   }
 
-  b = b->next;
-
-  for (blk = buf->firstblk; blk != b; blk = blk->next)
-    memcpy(((char *)r) + (blk->numprevious * itemsize),
-           blk->items, blk->numhere * itemsize);
+  memcpy(r, buf->items, n * itemsize);
 
   // *errmsg = '\0';
   clear_error();
   return r;
 }
 
+void *bufferitems(struct buffer *buf)
+{
+  return buf->items;
+}
+
 void rewindbuffer(struct buffer *buf)
 {
-  buf->nextblk = buf->firstblk;
   buf->nextindex = 0;
 }
 
 void *nextitem(struct buffer *buf)
 {
-  void *r;
-
-  if (!buf->nextblk || buf->nextindex >= buf->nextblk->numhere)
+  if (buf->nextindex >= buf->numitems)
     return NULL;
 
-  r = ((char *)buf->nextblk->items) + (buf->nextindex * buf->itemsize);
-
-  if (++buf->nextindex >= buf->nextblk->maxhere)
-  {
-    buf->nextblk = buf->nextblk->next;
-    buf->nextindex = 0;
-  }
-
-  return r;
+  return ((char *)buf->items) + (buf->nextindex++ * buf->itemsize);
 }
@@ -0,0 +1,292 @@
+/*********************/
+/* cache.c           */
+/* for Par 3.20      */
+/*********************/
+
+/* This is ANSI C code. */
+
+#include "cache.h" /* Makes sure we're consistent with the */
+                   /* prototypes. Also includes <stddef.h> */
+#include "errmsg.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#undef NULL
+#define NULL ((void *)0)
+
+/* Entries are found through a hash table with chaining, which doubles */
+/* in size whenever it holds more entries than buckets, and are also   */
+/* kept on a list from the most to the least recently used. Each entry */
+/* holds the text of its paragraph, with its lines joined by newlines, */
+/* so that a hit is never a mere collision, followed by its output.   */
+
+#define MINBUCKETS 64
+
+struct entry
+{
+  struct entry *next,   /* The next entry in the same bucket.       */
+      *newer, *older;   /* Neighbors on the list, or NULL if none.  */
+  unsigned long hash;
+  int settings[NSETTINGS];
+  size_t inlen, outlen; /* Lengths of the paragraph and its output. */
+  char text[1];         /* The paragraph, then its output.          */
+};
+
+struct cache
+{
+  size_t limit, used;   /* Bytes allowed and held by entries.        */
+  struct entry **bucket;
+  size_t nbuckets,      /* A power of 2.                             */
+      count;            /* Number of entries.                        */
+  struct entry *newest, *oldest;
+  unsigned long hits, misses, evictions;
+};
+
+/* 64-bit FNV-1a, which hashes a byte at a time: */
+
+#define FNVBASIS 14695981039346656037UL
+#define FNVPRIME 1099511628211UL
+
+struct cache *newcache(size_t limit)
+{
+  struct cache *c;
+
+  c = calloc(1, sizeof(struct cache));
+  if (!c)
+    goto nomem;
+  c->bucket = calloc(MINBUCKETS, sizeof(struct entry *));
+  if (!c->bucket)
+    goto nomem;
+  c->nbuckets = MINBUCKETS;
+  c->limit = limit;
+
+  clear_error();
+  return c;
+
+nomem:
+  free(c);
+  set_error(outofmem);
+  return NULL;
+}
+
+void freecache(struct cache *c)
+{
+  struct entry *e, *tmp;
+
+  for (e = c->newest; e; e = tmp)
+  {
+    tmp = e->older;
+    free(e);
+  }
+  free(c->bucket);
+  free(c);
+}
+
+unsigned long hashtext(const char *s, size_t n)
+{
+  unsigned long h = FNVBASIS;
+  const unsigned char *p = (const unsigned char *)s, *end = p + n;
+
+  for (; p < end; ++p)
+    h = (h ^ *p) * FNVPRIME;
+
+  return h;
+}
+
+unsigned long hashparagraph(const char *const *lines, const int *settings)
+{
+  unsigned long h = FNVBASIS;
+  const unsigned char *p, *end;
+  const char *const *line;
+
+  p = (const unsigned char *)settings;
+  for (end = p + NSETTINGS * sizeof(int); p < end; ++p)
+    h = (h ^ *p) * FNVPRIME;
+
+  for (line = lines; *line; ++line)
+  {
+    for (p = (const unsigned char *)*line; *p; ++p)
+      h = (h ^ *p) * FNVPRIME;
+    h = (h ^ '\n') * FNVPRIME;
+  }
+
+  return h;
+}
+
+static int sameparagraph(const struct entry *e, const char *const *lines,
+                         const int *settings)
+
+/* Returns 1 if *e holds the paragraph made of lines, */
+/* with settings, 0 otherwise.                        */
+{
+  const char *const *line, *p, *q, *end;
+
+  if (memcmp(e->settings, settings, sizeof e->settings))
+    return 0;
+
+  q = e->text;
+  end = q + e->inlen;
+  for (line = lines; *line; ++line)
+  {
+    for (p = *line; *p; ++p, ++q)
+      if (q == end || *q != *p)
+        return 0;
+    if (q == end || *q++ != '\n')
+      return 0;
+  }
+
+  return q == end;
+}
+
+static void unlinkentry(struct cache *c, struct entry *e)
+
+/* Takes *e off the list of *c. */
+{
+  if (e->newer)
+    e->newer->older = e->older;
+  else
+    c->newest = e->older;
+  if (e->older)
+    e->older->newer = e->newer;
+  else
+    c->oldest = e->newer;
+}
+
+static void pushnewest(struct cache *c, struct entry *e)
+
+/* Puts *e at the front of the list of *c. */
+{
+  e->newer = NULL;
+  e->older = c->newest;
+  if (c->newest)
+    c->newest->newer = e;
+  else
+    c->oldest = e;
+  c->newest = e;
+}
+
+const char *findcache(struct cache *c, unsigned long hash,
+                      const char *const *lines, const int *settings,
+                      size_t *plen)
+{
+  struct entry *e;
+
+  for (e = c->bucket[hash & (c->nbuckets - 1)]; e; e = e->next)
+    if (e->hash == hash && sameparagraph(e, lines, settings))
+      break;
+
+  if (!e)
+  {
+    ++c->misses;
+    return NULL;
+  }
+
+  ++c->hits;
+  unlinkentry(c, e);
+  pushnewest(c, e);
+  *plen = e->outlen;
+  return e->text + e->inlen;
+}
+
+static void growbuckets(struct cache *c)
+
+/* Doubles the number of buckets of *c, if there is */
+/* enough memory, and otherwise leaves them alone.  */
+{
+  struct entry **bucket, *e, *tmp;
+  size_t i, n = 2 * c->nbuckets;
+
+  bucket = calloc(n, sizeof(struct entry *));
+  if (!bucket)
+    return;
+
+  for (i = 0; i < c->nbuckets; ++i)
+    for (e = c->bucket[i]; e; e = tmp)
+    {
+      tmp = e->next;
+      e->next = bucket[e->hash & (n - 1)];
+      bucket[e->hash & (n - 1)] = e;
+    }
+
+  free(c->bucket);
+  c->bucket = bucket;
+  c->nbuckets = n;
+}
+
+void addcache(struct cache *c, unsigned long hash,
+              const char *const *lines, const int *settings,
+              const char *out, size_t len)
+{
+  struct entry *e, **b;
+  const char *const *line;
+  size_t inlen, size, n;
+  char *q;
+
+  for (inlen = 0, line = lines; *line; ++line)
+    inlen += strlen(*line) + 1;
+
+  size = sizeof(struct entry) + inlen + len;
+  if (size > c->limit)
+  {
+    clear_error();
+    return;
+  }
+
+  e = malloc(size);
+  if (!e)
+  {
+    set_error(outofmem);
+    return;
+  }
+
+  e->hash = hash;
+  memcpy(e->settings, settings, sizeof e->settings);
+  e->inlen = inlen;
+  e->outlen = len;
+  for (q = e->text, line = lines; *line; ++line)
+  {
+    n = strlen(*line);
+    memcpy(q, *line, n);
+    q += n;
+    *q++ = '\n';
+  }
+  if (len)
+    memcpy(q, out, len); /* out may be NULL when len is 0. */
+
+  if (c->count >= c->nbuckets)
+    growbuckets(c);
+  b = &c->bucket[hash & (c->nbuckets - 1)];
+  e->next = *b;
+  *b = e;
+  pushnewest(c, e);
+  ++c->count;
+  c->used += size;
+
+  clear_error();
+}
+
+void trimcache(struct cache *c)
+{
+  struct entry *e, **p;
+
+  while (c->used > c->limit && (e = c->oldest))
+  {
+    for (p = &c->bucket[e->hash & (c->nbuckets - 1)]; *p != e; p = &(*p)->next)
+      ;
+    *p = e->next;
+    unlinkentry(c, e);
+    --c->count;
+    c->used -= sizeof(struct entry) + e->inlen + e->outlen;
+    ++c->evictions;
+    free(e);
+  }
+}
+
+void cachestats(const struct cache *c, unsigned long *phits,
+                unsigned long *pmisses, unsigned long *pevictions)
+{
+  *phits = c->hits;
+  *pmisses = c->misses;
+  *pevictions = c->evictions;
+}
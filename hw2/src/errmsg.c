@@ -13,11 +13,14 @@
 
 char *outofmem = "Out of memory.\n";
 
-static char *errormsg;
-static int error = 0;
+/* The error indication is kept separately for each thread, so that */
+/* paragraphs can be reformatted concurrently (see "par.c").        */
+
+static __thread char *errormsg = NULL;
+static __thread int error = 0;
 void set_error(char *msg)
 {
-    errormsg = calloc(1, sizeof(msg));
+    errormsg = calloc(strlen(msg) + 1, sizeof(char));
     strcpy(errormsg, msg);
     error = 1;
 }
@@ -45,4 +48,14 @@ void clear_error()
 {
     error = 0;
     free(errormsg);
+    errormsg = NULL;
+}
+
+char *take_error()
+{
+    char *msg = errormsg;
+
+    error = 0;
+    errormsg = NULL;
+    return msg;
 }
@@ -0,0 +1,938 @@
+/*********************/
+/* format.c          */
+/* for Par 3.20      */
+/* Copyright 1993 by */
+/* Adam M. Costello  */
+/*********************/
+
+/* This is ANSI C code. */
+
+#include "format.h" /* Makes sure we're consistent with the prototypes. */
+                    /* Also includes "reformat.h" and "cache.h".        */
+#include "errmsg.h"
+#include "buffer.h"
+#include "scan.h"
+#include "prof.h"
+
+#include <string.h>
+#include <stdlib.h>
+#include <ctype.h>
+#include <getopt.h>
+#include <errno.h>
+#include <limits.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#undef NULL
+#define NULL ((void *)0)
+
+const char *const progname = "par";
+const char *const version = "3.20";
+
+static int digtoint(char c)
+
+/* Returns the value represented by the digit c,   */
+/* or -1 if c is not a digit. Does not use errmsg. */
+{
+  return c == '0' ? 0 : c == '1' ? 1
+                    : c == '2'   ? 2
+                    : c == '3'   ? 3
+                    : c == '4'   ? 4
+                    : c == '5'   ? 5
+                    : c == '6'   ? 6
+                    : c == '7'   ? 7
+                    : c == '8'   ? 8
+                    : c == '9'   ? 9
+                                 : -1;
+
+  /* We can't simply return c - '0' because this is ANSI  */
+  /* C code, so it has to work for any character set, not */
+  /* just ones which put the digits together in order.    */
+}
+
+static int strtoudec(const char *s, int *pn)
+
+/* Puts the decimal value of the string s into *pn, returning */
+/* 1 on success. If s is empty, or contains non-digits,       */
+/* or represents an integer greater than 9999, then *pn       */
+/* is not changed and 0 is returned. Does not use errmsg.     */
+{
+  int n = 0;
+
+  if (!*s)
+    return 0;
+
+  do
+  {
+    if (n >= 1000 || !isdigit(*s))
+      return 0;
+    n = 10 * n + digtoint(*s);
+  } while (*++s);
+
+  *pn = n;
+
+  return 1;
+}
+
+static int strtoucount(const char *s, int *pn)
+
+/* Like strtoudec(s, pn), except that s may represent any */
+/* integer up to INT_MAX. Does not use errmsg.            */
+{
+  int n = 0;
+
+  if (!*s)
+    return 0;
+
+  do
+  {
+    if (!isdigit(*s) || n > (INT_MAX - digtoint(*s)) / 10)
+      return 0;
+    n = 10 * n + digtoint(*s);
+  } while (*++s);
+
+  *pn = n;
+
+  return 1;
+}
+
+// static void parseopt(
+//   const char *opt, int *pwidth, int *pprefix,
+//   int *psuffix, int *phang, int *plast, int *pmin
+// )
+// /* Parses the single option in opt, setting *pwidth, *pprefix,     */
+// /* *psuffix, *phang, *plast, or *pmin as appropriate. Uses errmsg. */
+// {
+//   const char *saveopt = opt;
+//   char oc;
+//   int n, r;
+
+//   if (*opt == '-') ++opt;
+
+//   if (!strcmp(opt, "version")) {
+//     sprintf(errmsg,"%s %s\n", progname, version);
+//
+//     return;
+//   }
+
+//   oc = *opt;
+
+//   if (isdigit(oc)) {
+//     if (!strtoudec(opt, &n)) goto badopt;
+//     if (n <= 8) *pprefix = n;
+//     else *pwidth = n;
+//   }
+//   else {
+//     if (!oc) goto badopt;
+//     n = 1;
+//     r = strtoudec(opt + 1, &n);
+//     if (opt[1] && !r) goto badopt;
+
+//     if (oc == 'w' || oc == 'p' || oc == 's') {
+//       if (!r) goto badopt;
+//       if      (oc == 'w') *pwidth  = n;
+//       else if (oc == 'p') *pprefix = n;
+//       else                *psuffix = n;
+//     }
+//     else if (oc == 'h') *phang = n;
+//     else if (n <= 1) {
+//       if      (oc == 'l') *plast = n;
+//       else if (oc == 'm') *pmin = n;
+//     }
+//     else goto badopt;
+//   }
+
+//   // *errmsg = '\0';
+//
+//   return;
+
+// badopt:
+//   sprintf(errmsg, "Bad option: %.149s\n", saveopt);
+// }
+
+void flushoutput(struct output *out)
+{
+  struct iovec *v = out->span, *end = out->span + out->n;
+  ssize_t n;
+  int i;
+  PROFSTART(t);
+
+  if (out->fd < 0)
+  {
+    for (; v < end; ++v)
+      if (fwrite(v->iov_base, 1, v->iov_len, out->file) < v->iov_len && !out->err)
+        out->err = errno ? errno : EIO;
+  }
+  else
+    while (v < end)
+    {
+      n = writev(out->fd, v, end - v);
+      if (n < 0)
+      {
+        if (errno == EINTR)
+          continue;
+        if (!out->err)
+          out->err = errno;
+        break;
+      }
+      for (; v < end && (size_t)n >= v->iov_len; ++v)
+        n -= v->iov_len;
+      if (v < end)
+      {
+        v->iov_base = (char *)v->iov_base + n;
+        v->iov_len -= n;
+      }
+    }
+
+  out->n = 0;
+  if (out->cache)
+    trimcache(out->cache);
+  PROFEND(PROF_OUTPUT, t);
+}
+
+static void putspan(void *arg, const char *s, size_t n)
+
+/* Adds the n characters at s to the output *arg, which is a struct */
+/* output, merging them with the last span if they follow it. The   */
+/* characters must not change before the output is flushed. Does    */
+/* not use errmsg.                                                  */
+{
+  struct output *out = arg;
+  struct iovec *last = out->span + out->n - 1;
+
+  if (!n)
+    return;
+  if (out->n && (const char *)last->iov_base + last->iov_len == s)
+  {
+    last->iov_len += n;
+    return;
+  }
+  if (out->n == OUTSPANS)
+    flushoutput(out);
+  out->span[out->n].iov_base = (char *)s;
+  out->span[out->n++].iov_len = n;
+}
+
+size_t fillinput(struct input *in)
+{
+  char *buf;
+  size_t size;
+  ssize_t n;
+
+  if (in->eof)
+    return 0;
+
+  if (in->fd < 0)
+  {
+    in->eof = 1;
+    return 0;
+  }
+
+  if ((in->start || in->end == in->size) && in->pending)
+    flushoutput(in->pending);
+
+  if (in->start)
+  {
+    memmove(in->buf, in->buf + in->start, in->end - in->start);
+    in->end -= in->start;
+    in->start = 0;
+  }
+
+  if (in->end == in->size)
+  {
+    size = in->size ? 2 * in->size : INBLOCK;
+    buf = realloc(in->buf, size + 1);
+    if (!buf)
+    {
+      set_error(outofmem);
+      return 0;
+    }
+    in->buf = buf;
+    in->size = size;
+  }
+
+  do
+    n = read(in->fd, in->buf + in->end, in->size - in->end);
+  while (n < 0 && errno == EINTR);
+
+  if (n <= 0)
+  {
+    in->eof = 1;
+    return 0;
+  }
+
+  in->end += n;
+  return n;
+}
+
+static int skipnewlines(struct input *in, struct output *out)
+
+/* Copies the newlines at the front of the unconsumed input to out. */
+/* Returns 0 at end of input, 1 otherwise. Uses errmsg.             */
+{
+  char *p, *q;
+
+  for (;;)
+  {
+    if (in->start == in->end && !fillinput(in))
+      return 0;
+    p = in->buf + in->start;
+    q = in->buf + in->end;
+    while (p < q && *p == '\n')
+      ++p;
+    putspan(out, in->buf + in->start, p - (in->buf + in->start));
+    in->start = p - in->buf;
+    if (p < q)
+      return 1;
+  }
+}
+
+static char **readlines(struct input *in, int maxlines, int *pmore)
+
+/* Reads lines from *in until EOF, or until a blank line is encountered, */
+/* in which case the newline is left unconsumed in the input block, or,  */
+/* if maxlines is not 0, until maxlines lines have been read, in which   */
+/* case *pmore is set to 1 (otherwise 0), and the paragraph may go on.   */
+/* Returns a NULL-terminated array of pointers to individual lines,      */
+/* stripped of their newline characters. The lines themselves lie in the */
+/* input block and remain valid until the next call to readlines() or    */
+/* skipnewlines(), so only the array must be freed. Uses errmsg, and     */
+/* returns NULL on failure.                                              */
+{
+  struct buffer *obuf = NULL;
+  size_t pos, linestart, end, eol, *off;
+  char *p, *nl, **lines = NULL, **line;
+  int blank;
+
+  *pmore = 0;
+  obuf = newbuffer(sizeof(size_t));
+  // if (*errmsg) goto rlcleanup;
+  if (is_error())
+    goto rlcleanup;
+
+  /* Offsets are relative to in->start, which fillinput() may move. */
+
+  for (pos = linestart = 0, blank = 1;;)
+  {
+    end = in->end - in->start;
+    if (pos == end)
+    {
+      if (fillinput(in))
+        continue;
+      if (is_error())
+        goto rlcleanup;
+      break;
+    }
+    p = in->buf + in->start;
+    nl = memchr(p + pos, '\n', end - pos);
+    eol = nl ? (size_t)(nl - p) : end;
+    for (; blank && pos < eol; ++pos)
+      if (!isspace((unsigned char)p[pos]))
+        blank = 0;
+    pos = eol;
+    if (!nl)
+      continue;
+    if (blank)
+      break;
+    *nl = '\0';
+    additem(obuf, &linestart);
+    if (is_error())
+      goto rlcleanup;
+    pos = linestart = eol + 1;
+    blank = 1;
+    if (maxlines && numitems(obuf) == maxlines)
+    {
+      *pmore = 1;
+      break;
+    }
+  }
+
+  p = in->buf + in->start;
+  if (!blank)
+  {
+    p[pos] = '\0';
+    additem(obuf, &linestart);
+    if (is_error())
+      goto rlcleanup;
+  }
+  in->start += pos;
+
+  lines = calloc(numitems(obuf) + 1, sizeof(char *));
+  if (!lines)
+  {
+    set_error(outofmem);
+    goto rlcleanup;
+  }
+  for (line = lines; (off = nextitem(obuf)); ++line)
+    *line = p + *off;
+
+rlcleanup:
+
+  if (obuf)
+    freebuffer(obuf);
+
+  return lines;
+}
+
+static void setdefaults(
+    const char *const *inlines, int *pwidth, int *pprefix,
+    int *psuffix, int *phang, int *plast, int *pmin)
+/* If any of *pwidth, *pprefix, *psuffix, *phang, *plast, *pmin are     */
+/* less than 0, sets them to default values based on inlines, according */
+/* to "par.doc". Does not use errmsg because it always succeeds.        */
+{
+  int numlines;
+  size_t n;
+  const char *start, *end, *lineend, *const *line;
+
+  if (*pwidth < 0)
+    *pwidth = 72;
+  if (*phang < 0)
+    *phang = 0;
+  if (*plast < 0)
+    *plast = 0;
+  if (*pmin < 0)
+    *pmin = *plast;
+
+  for (line = inlines; *line; ++line)
+    ;
+  numlines = line - inlines;
+
+  if (*pprefix < 0)
+  {
+    if (numlines <= *phang + 1)
+      *pprefix = 0;
+    else
+    {
+      start = inlines[*phang];
+      n = strlen(start);
+      for (line = inlines + *phang + 1; *line && n; ++line)
+        n = commonprefix(start, *line, strnlen(*line, n));
+      *pprefix = n;
+    }
+  }
+  if (*psuffix < 0)
+  {
+    if (numlines <= 1)
+      *psuffix = 0;
+    else
+    {
+      start = *inlines;
+      end = start + strlen(start);
+      for (line = inlines + 1; *line && start < end; ++line)
+      {
+        n = strlen(*line);
+        lineend = *line + n;
+        if (n > end - start)
+          n = end - start;
+        start = end - commonsuffix(end, lineend, n);
+      }
+      while (end - start >= 2 && isspace(*start) && isspace(start[1]))
+        ++start;
+      *psuffix = end - start;
+    }
+  }
+
+  // printf("w%d p%d s%d h%d l%d m%d\n", *pwidth, *pprefix, *psuffix, *phang, *plast, *pmin);
+}
+
+void bad_option_int(int n)
+{
+  char *s;
+  size_t x;
+  FILE *f = open_memstream(&s, &x);
+  fprintf(f, "Bad Option: '%d'\n", n);
+  fflush(f);
+  fclose(f);
+  set_error(s);
+  free(s);
+  return;
+}
+void bad_option_str(char *c)
+{
+  FILE *f;
+  char *s;
+  size_t x;
+  f = open_memstream(&s, &x);
+  fprintf(f, "Bad Option: '%s'\n", c);
+  fflush(f);
+  fclose(f);
+  set_error(s);
+  free(s);
+  return;
+}
+int getoption(int argc, char *argv[], struct settings *set)
+{
+  if (argc == 1)
+    return 0;
+  int option_char = 0;
+  int option_index = 0;
+  static struct option long_options[] = {
+      {"width", required_argument, 0, 'w'},
+      {"prefix", required_argument, 0, 'p'},
+      {"suffix", required_argument, 0, 's'},
+      {"hang", optional_argument, 0, 'h'},
+      {"", optional_argument, 0, 'l'},
+      {"last", 0, 0, 1},
+      {"no-last", 0, 0, 2},
+      {"", optional_argument, 0, 'm'},
+      {"min", 0, 0, 3},
+      {"no-min", 0, 0, 4},
+      {"window", required_argument, 0, 5},
+      {"cache", required_argument, 0, 6},
+      {"cache-stats", 0, 0, 7},
+      {"files", 0, 0, 8},
+      {"serve", required_argument, 0, 9},
+      {"version", 0, 0, 0},
+      {0, 0, 0, 0}};
+  // int lastindex = 0;
+  while ((option_char = getopt_long(argc, argv, "w:p:s:hlm", long_options, &option_index)) != EOF)
+  {
+    // printf("%c, %s, %d\n",option_char, argv[optind-1],optind-1);
+
+    // lastindex++;
+    int n = 1;
+    if (optarg)
+    {
+      // lastindex++;
+      strtoudec(optarg, &n);
+    }
+
+    switch (option_char)
+    {
+    case 0:
+      return 1;
+    case 'w':
+      set->width = n;
+      break;
+    case 'p':
+      set->prefix = n;
+      break;
+    case 's':
+      set->suffix = n;
+      break;
+    case 'h':
+      // printf("%s", argv[lastindex]);
+      if (optarg)
+      {
+        if (strtoudec(optarg, &n))
+        {
+          // lastindex++;
+          set->hang = n;
+        }
+      }
+      else
+        set->hang = 1;
+      break;
+    case 'l':
+      if (optarg)
+      {
+        if (strtoudec(optarg, &n))
+        {
+          // lastindex++;
+          if (n == 1 || n == 0)
+            set->last = n;
+          else
+          {
+            bad_option_int(n);
+            return 0;
+          }
+        }
+      }
+      else
+        set->hang = 1;
+      break;
+    case 1:
+      set->last = 1;
+      break;
+    case 2:
+      set->last = 0;
+      break;
+    case 'm':
+      if (optarg)
+      {
+        if (strtoudec(optarg, &n))
+        {
+          // lastindex++;
+          if (n == 1 || n == 0)
+            set->min = n;
+          else
+          {
+            bad_option_int(n);
+            return 0;
+          }
+        }
+      }
+      break;
+    case 3:
+      set->min = 1;
+      break;
+    case 4:
+      set->min = 0;
+      break;
+    case 5:
+      if (!strtoucount(optarg, &set->window))
+      {
+        bad_option_str(argv[optind - 1]);
+        return 0;
+      }
+      break;
+    case 6:
+      if (!strtoucount(optarg, &set->cache))
+      {
+        bad_option_str(argv[optind - 1]);
+        return 0;
+      }
+      break;
+    case 7:
+      set->cachestats = 1;
+      break;
+    case 8:
+      set->files = 1;
+      break;
+    case 9:
+      set->serve = optarg;
+      break;
+    default:
+      bad_option_str(argv[optind - 1]);
+      return 0;
+      break;
+    }
+  }
+  if (set->files)
+  {
+    set->paths = argv + optind;
+    set->npaths = argc - optind;
+    return 0;
+  }
+  for (int i = optind; i < argc; i++)
+  {
+    int n = 1;
+    if (strtoudec(argv[i], &n))
+    {
+      if (n > 9)
+      {
+        set->width = n;
+      }
+      else
+      {
+        set->prefix = n;
+      }
+    }
+    else
+    {
+      bad_option_str(argv[i]);
+      return 0;
+    }
+  }
+
+  // printf("w%d p%d s%d h%d l%d m%d\n", *pwidth, *pprefix, *psuffix, *phang, *plast, *pmin);
+  return 0;
+}
+
+
+int parseoptions(const char *options, char *argv0, struct settings *set)
+{
+  const char *const whitechars = " \f\n\r\t\v";
+  char *copy, *opt, **optarr;
+  int argc, i, gotversion;
+
+  copy = malloc(strlen(options) + 1);
+  if (!copy)
+  {
+    set_error(outofmem);
+    return 0;
+  }
+  strcpy(copy, options);
+  for (argc = 0, opt = strtok(copy, whitechars); opt; opt = strtok(NULL, whitechars))
+    ++argc;
+
+  optarr = calloc(argc + 2, sizeof(*optarr));
+  if (!optarr)
+  {
+    free(copy);
+    set_error(outofmem);
+    return 0;
+  }
+  strcpy(copy, options);
+  i = 0;
+  if (argv0)
+    optarr[i++] = argv0;
+  for (opt = strtok(copy, whitechars); opt; opt = strtok(NULL, whitechars))
+    optarr[i++] = opt;
+
+  gotversion = getoption(i, optarr, set);
+  if (set->files && !is_error())
+    bad_option_str("--files");
+  if (set->serve && !is_error())
+    bad_option_str("--serve");
+  set->files = set->npaths = 0;
+  set->paths = NULL;
+  set->serve = NULL;
+
+  free(optarr);
+  free(copy);
+  return gotversion;
+}
+
+/* getopt_long() keeps its state in globals: */
+
+static pthread_mutex_t optlock = PTHREAD_MUTEX_INITIALIZER;
+
+void parsesettings(const char *options, struct settings *set)
+{
+  int saveopterr;
+
+  pthread_mutex_lock(&optlock);
+  saveopterr = opterr;
+  opterr = 0;
+  optind = 0;
+  if (parseoptions(options, (char *)progname, set) && !is_error())
+    bad_option_str("--version");
+  opterr = saveopterr;
+  pthread_mutex_unlock(&optlock);
+}
+
+static char **carrylines(char *const *lines, char *const *inlines)
+
+/* Returns a NULL-terminated array of pointers to copies of the lines  */
+/* in the NULL-terminated array lines, followed by the lines of        */
+/* inlines themselves. The copies are allocated along with the array,  */
+/* so freeing the array frees them. Uses errmsg, and returns NULL on   */
+/* failure.                                                            */
+{
+  size_t n, size;
+  char *const *line, **all, **p;
+  char *q;
+
+  for (n = 0, size = 0, line = lines; *line; ++line, ++n)
+    size += strlen(*line) + 1;
+  for (line = inlines; *line; ++line)
+    ++n;
+
+  all = malloc((n + 1) * sizeof(char *) + size);
+  if (!all)
+  {
+    set_error(outofmem);
+    return NULL;
+  }
+
+  q = (char *)(all + n + 1);
+  for (p = all, line = lines; *line; ++line)
+  {
+    *p++ = q;
+    strcpy(q, *line);
+    q += strlen(q) + 1;
+  }
+  for (line = inlines; *line; ++line)
+    *p++ = *line;
+  *p = NULL;
+
+  return all;
+}
+
+/* When a paragraph is not found in the cache, its output is copied */
+/* as it is written, to be added to the cache afterward.             */
+
+struct tee
+{
+  struct output *out;
+  char *buf;      /* The copy, len characters long.           */
+  size_t len, size;
+  int failed;     /* Nonzero if there was no memory to copy.   */
+};
+
+static void teespan(void *arg, const char *s, size_t n)
+
+/* Does the same as putspan(), and also appends the n characters */
+/* at s to the copy in *arg, which is a struct tee. Does not use  */
+/* errmsg.                                                        */
+{
+  struct tee *t = arg;
+  size_t size;
+  char *buf;
+
+  putspan(t->out, s, n);
+  if (t->failed || !n)
+    return;
+  if (t->len + n > t->size)
+  {
+    for (size = t->size ? t->size : 4096; size < t->len + n; size *= 2)
+      ;
+    buf = realloc(t->buf, size);
+    if (!buf)
+    {
+      t->failed = 1;
+      return;
+    }
+    t->buf = buf;
+    t->size = size;
+  }
+  memcpy(t->buf + t->len, s, n);
+  t->len += n;
+}
+
+void formatinput(struct input *in, const struct settings *set,
+                 struct rfstore *store, struct cache *cache,
+                 struct output *out)
+{
+  int width, prefix, suffix, hang, last, min, more, numout, keep;
+  int key[NSETTINGS];
+  char **inlines = NULL, **carried = NULL, **outlines = NULL, **line;
+  const char *cached;
+  unsigned long hash;
+  size_t len;
+  struct tee tee = {NULL, NULL, 0, 0, 0};
+
+  in->pending = out;
+  tee.out = out;
+
+  for (;;)
+  {
+    if (!skipnewlines(in, out))
+      break;
+
+    PROFSTART(t0);
+    inlines = readlines(in, set->window, &more);
+    PROFEND(PROF_READLINES, t0);
+
+    // if (*errmsg) goto fmcleanup;
+    if (is_error())
+      goto fmcleanup;
+    if (!*inlines)
+    {
+      free(inlines);
+      inlines = NULL;
+      continue;
+    }
+
+    width = set->width;
+    prefix = set->prefix;
+    suffix = set->suffix;
+    hang = set->hang;
+    last = set->last;
+    min = set->min;
+    if (width == 0)
+    {
+      width = -1;
+    }
+    PROFSTART(t1);
+    setdefaults((const char *const *)inlines,
+                &width, &prefix, &suffix, &hang, &last, &min);
+    PROFEND(PROF_SETDEFAULTS, t1);
+    if (prefix + suffix >= width)
+    {
+      FILE *f;
+      char *s;
+      size_t x;
+      f = open_memstream(&s, &x);
+      fprintf(f, "<width> = %d shorter than <prefix> + <suffix> = %d + %d = %d\n",
+              width, prefix, suffix, prefix + suffix);
+      fflush(f);
+      fclose(f);
+      set_error(s);
+      free(s);
+
+      // snprintf(str, 200, "<width> = %d shorter than <prefix> + <suffix> = %d + %d = %d\n",
+      //          width, prefix, suffix, prefix + suffix);
+      // set_error(str);
+    }
+
+    if (is_error())
+      goto fmcleanup;
+
+    for (;;)
+    {
+      line = carried ? carried : inlines;
+      if (!more && cache && !carried)
+      {
+        key[0] = width;
+        key[1] = prefix;
+        key[2] = suffix;
+        key[3] = hang;
+        key[4] = last;
+        key[5] = min;
+        hash = hashparagraph((const char *const *)line, key);
+        cached = findcache(cache, hash, (const char *const *)line, key, &len);
+        if (cached)
+        {
+          putspan(out, cached, len);
+          break;
+        }
+        tee.len = 0;
+        tee.failed = 0;
+        reformatspans(store, (const char *const *)line,
+                      width, prefix, suffix, hang, last, min, teespan, &tee);
+        if (is_error())
+          goto fmcleanup;
+        if (!tee.failed)
+        {
+          addcache(cache, hash, (const char *const *)line, key, tee.buf, tee.len);
+          clear_error(); /* A paragraph left out of the cache is no error. */
+        }
+        break;
+      }
+      if (!more)
+      {
+        reformatspans(store, (const char *const *)line,
+                      width, prefix, suffix, hang, last, min, putspan, out);
+        if (is_error())
+          goto fmcleanup;
+        if (carried)
+          flushoutput(out); /* The spans point into the copies. */
+        break;
+      }
+
+      outlines = store ? reformatwith(store, (const char *const *)line,
+                                      width, prefix, suffix, hang, last, min)
+                       : reformat((const char *const *)line,
+                                  width, prefix, suffix, hang, last, min);
+      // if (*errmsg) goto fmcleanup;
+
+      if (is_error())
+        goto fmcleanup;
+
+      free(inlines);
+      inlines = NULL;
+      free(carried);
+      carried = NULL;
+
+      /* The output lines are overwritten by the next reformat(): */
+
+      for (numout = 0; outlines[numout]; ++numout)
+        ;
+      keep = numout / 2;
+      for (line = outlines; line < outlines + keep; ++line)
+      {
+        putspan(out, *line, strlen(*line));
+        putspan(out, "\n", 1);
+      }
+      flushoutput(out);
+
+      PROFSTART(t2);
+      inlines = readlines(in, set->window, &more);
+      PROFEND(PROF_READLINES, t2);
+      if (is_error())
+        goto fmcleanup;
+      carried = carrylines(outlines + keep, inlines);
+      if (is_error())
+        goto fmcleanup;
+      hang = 0;
+    }
+
+    free(inlines);
+    inlines = NULL;
+    free(carried);
+    carried = NULL;
+    outlines = NULL;
+  }
+
+fmcleanup:
+
+  if (inlines)
+    free(inlines);
+  if (carried)
+    free(carried);
+  if (tee.buf)
+    free(tee.buf);
+}
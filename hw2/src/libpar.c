@@ -0,0 +1,435 @@
+/*********************/
+/* libpar.c          */
+/* for Par 3.20      */
+/*********************/
+
+/* This is ANSI C code. */
+
+#include "libpar.h" /* Makes sure we're consistent with the prototypes. */
+                    /* Also includes <stddef.h>.                         */
+#include "format.h"
+#include "errmsg.h"
+#include "scan.h"
+
+#include <string.h>
+#include <stdlib.h>
+#include <ctype.h>
+
+#undef NULL
+#define NULL ((void *)0)
+
+/* libpar.a is built with -fvisibility=hidden, and its hidden symbols */
+/* are then made local, so that a program linked with it sees only    */
+/* the functions declared in "libpar.h".                              */
+
+#define PAREXPORT __attribute__((visibility("default")))
+
+/* The library interface declared in "libpar.h". A context holds what  */
+/* original_main() keeps in its own variables and in the calling thread: */
+/* the options, the storage for reformatting, a copy of the input (which */
+/* readlines() modifies), the output spans, and the error message. It    */
+/* also holds what par_reflow() remembers of the text it was last given: */
+/* a copy, split into paragraphs, each with its output.                  */
+
+struct para
+{
+  size_t start, len; /* Where the paragraph lies in the copy.             */
+  int cut;           /* Nonzero if it ends just after a blank line.       */
+  char *out;         /* Its output, outlen characters, or NULL if empty.  */
+  size_t outlen;
+};
+
+struct parctx
+{
+  struct settings set;
+  struct rfstore *store;
+  char *inbuf;      /* Holds the input, insize characters plus '\0'. */
+  size_t insize;
+  char *err;        /* The message of the last failure, or NULL.     */
+  struct cache *cache; /* Made when first needed, if set.cache is set. */
+  struct output out;
+  char *doc;        /* The text last given to par_reflow(), doclen    */
+  size_t doclen;    /* characters, or NULL if there is none.          */
+  struct para *paras; /* The paragraphs of doc, in order.             */
+  size_t nparas;
+  unsigned long reused, reformatted; /* Counts for the last call.     */
+};
+
+PAREXPORT struct parctx *par_newctx(void)
+{
+  struct parctx *ctx;
+
+  ctx = calloc(1, sizeof(struct parctx));
+  if (!ctx)
+    return NULL;
+  ctx->set.width = ctx->set.prefix = ctx->set.suffix = -1;
+  ctx->set.hang = ctx->set.last = ctx->set.min = -1;
+  ctx->set.window = ctx->set.cache = ctx->set.cachestats = 0;
+  ctx->store = newrfstore();
+  if (!ctx->store)
+  {
+    clear_error();
+    free(ctx);
+    return NULL;
+  }
+  return ctx;
+}
+
+static void forgetdoc(struct parctx *ctx)
+
+/* Makes par_reflow() forget what it remembers in *ctx. */
+{
+  size_t i;
+
+  for (i = 0; i < ctx->nparas; ++i)
+    free(ctx->paras[i].out);
+  free(ctx->paras);
+  free(ctx->doc);
+  ctx->paras = NULL;
+  ctx->nparas = 0;
+  ctx->doc = NULL;
+  ctx->doclen = 0;
+}
+
+PAREXPORT void par_freectx(struct parctx *ctx)
+{
+  forgetdoc(ctx);
+  if (ctx->cache)
+    freecache(ctx->cache);
+  freerfstore(ctx->store);
+  free(ctx->inbuf);
+  free(ctx->err);
+  free(ctx);
+}
+
+PAREXPORT int par_setoptions(struct parctx *ctx, const char *options)
+{
+  struct settings set = {-1, -1, -1, -1, -1, -1, 0, 0, 0};
+
+  free(ctx->err);
+  clear_error();
+
+  parsesettings(options, &set);
+
+  if (!is_error())
+  {
+    if (ctx->cache && set.cache != ctx->set.cache)
+    {
+      freecache(ctx->cache);
+      ctx->cache = NULL;
+    }
+    ctx->set = set;
+    forgetdoc(ctx);
+  }
+  ctx->err = take_error();
+  return ctx->err ? -1 : 0;
+}
+
+char *formatcopy(struct parctx *ctx, const char *in, size_t len, size_t *plen)
+{
+  struct input block = {-1, NULL, 0, 0, 0, 1, NULL};
+  char *obuf = NULL, *buf;
+  FILE *f;
+
+  *plen = 0;
+  if (len > ctx->insize || !ctx->inbuf)
+  {
+    buf = realloc(ctx->inbuf, len + 1);
+    if (!buf)
+    {
+      set_error(outofmem);
+      return NULL;
+    }
+    ctx->inbuf = buf;
+    ctx->insize = len;
+  }
+  memcpy(ctx->inbuf, in, len);
+  block.buf = ctx->inbuf;
+  block.size = block.end = len;
+
+  f = open_memstream(&obuf, plen);
+  if (!f)
+  {
+    set_error(outofmem);
+    return NULL;
+  }
+  if (ctx->set.cache && !ctx->cache)
+  {
+    ctx->cache = newcache((size_t)ctx->set.cache * 1024);
+    clear_error(); /* It can do without. */
+  }
+  ctx->out.fd = -1;
+  ctx->out.file = f;
+  ctx->out.n = 0;
+  ctx->out.cache = ctx->cache;
+  ctx->out.err = 0;
+  formatinput(&block, &ctx->set, ctx->store, ctx->cache, &ctx->out);
+  flushoutput(&ctx->out);
+  fclose(f);
+
+  return obuf;
+}
+
+struct settings *ctxsettings(struct parctx *ctx)
+{
+  return &ctx->set;
+}
+
+PAREXPORT int par_format(struct parctx *ctx, const char *in, size_t len,
+                         par_writer out, void *arg)
+{
+  char *obuf;
+  size_t olen;
+
+  free(ctx->err);
+  clear_error();
+
+  obuf = formatcopy(ctx, in, len, &olen);
+  if (olen && out(arg, obuf, olen) && !is_error())
+    set_error("Output error.\n");
+
+  free(obuf);
+  ctx->err = take_error();
+  return ctx->err ? -1 : 0;
+}
+
+/* par_reflow() splits the text just after each blank line. Reformatting */
+/* the pieces one after another is the same as reformatting the whole,  */
+/* as in the pipeline, so each piece, called a paragraph here, has an    */
+/* output of its own. Where the new text begins and ends as the old one  */
+/* did, so do the paragraphs there, and their outputs are kept. The rest */
+/* of the new text is split again, and its paragraphs are reformatted,   */
+/* unless they match one of the old paragraphs in between, as a moved    */
+/* paragraph does.                                                       */
+
+static size_t nextcut(const char *p, size_t from, size_t len, int *pcut)
+
+/* Returns the offset just past the first blank line in p[from..len-1], */
+/* where from is the start of a line, and sets *pcut to 1, or returns   */
+/* len and sets *pcut to 0 if there is none. Does not use errmsg.       */
+{
+  const char *nl, *q;
+
+  while ((nl = memchr(p + from, '\n', len - from)))
+  {
+    for (q = p + from; q < nl && isspace((unsigned char)*q); ++q)
+      ;
+    from = nl - p + 1;
+    if (q == nl)
+    {
+      *pcut = 1;
+      return from;
+    }
+  }
+
+  *pcut = 0;
+  return len;
+}
+
+static int suffixstarts(const char *doc, size_t at, size_t same)
+
+/* Returns 1 if the paragraph at offset at in doc, which follows a blank */
+/* line, still does so when only the characters from offset same on are */
+/* known to be unchanged: that is, if the newline before the blank line  */
+/* lies among them. Returns 0 otherwise. Does not use errmsg.            */
+{
+  size_t p = at - 1; /* The newline ending the blank line. */
+
+  if (!at)
+    return 0;
+  while (p > 0 && doc[p - 1] != '\n')
+    --p;
+  return p > 0 && p - 1 >= same;
+}
+
+static struct para **indexparas(struct para *first, struct para *last,
+                                const char *doc, size_t *pmask)
+
+/* Returns a hash table of the paragraphs [first, last) of doc, with  */
+/* *pmask + 1 slots, a power of 2, which are NULL if unused. Uses    */
+/* errmsg, and returns NULL on failure.                               */
+{
+  struct para **index, *para;
+  size_t size = 1, i;
+
+  while (size < 2 * (size_t)(last - first))
+    size *= 2;
+  index = calloc(size, sizeof(struct para *));
+  if (!index)
+  {
+    set_error(outofmem);
+    return NULL;
+  }
+  for (para = first; para < last; ++para)
+  {
+    i = hashtext(doc + para->start, para->len) & (size - 1);
+    while (index[i])
+      i = (i + 1) & (size - 1);
+    index[i] = para;
+  }
+
+  *pmask = size - 1;
+  return index;
+}
+
+PAREXPORT int par_reflow(struct parctx *ctx, const char *in, size_t len,
+                         par_writer out, void *arg)
+{
+  struct para *paras = NULL, *para = NULL, *old, *first, *last, **index = NULL;
+  char *doc;
+  size_t n, same, tail, from, end, mask = 0, i;
+  long shift;
+
+  free(ctx->err);
+  clear_error();
+  ctx->reused = ctx->reformatted = 0;
+  first = last = ctx->paras;
+
+  doc = malloc(len + 1);
+  if (!doc)
+  {
+    set_error(outofmem);
+    goto prcleanup;
+  }
+  memcpy(doc, in, len);
+
+  /* The paragraphs in the unchanged beginning, [ctx->paras, first), */
+  /* and in the unchanged end, [last, ctx->paras + ctx->nparas):     */
+
+  n = len < ctx->doclen ? len : ctx->doclen;
+  same = ctx->doc ? commonprefix(ctx->doc, in, n) : 0;
+  tail = ctx->doc ? commonsuffix(ctx->doc + ctx->doclen, in + len, n - same) : 0;
+  old = ctx->paras;
+  for (first = old; first < old + ctx->nparas; ++first)
+    if (!first->cut || first->start + first->len > same)
+      break;
+  for (last = old + ctx->nparas; last > first; --last)
+    if (!suffixstarts(ctx->doc, last[-1].start, ctx->doclen - tail))
+      break;
+  shift = (long)len - (long)ctx->doclen;
+
+  /* There is at most one new paragraph per line in between: */
+
+  from = first > old ? first[-1].start + first[-1].len : 0;
+  end = last < old + ctx->nparas ? last->start + shift : len;
+  for (n = 1, i = from; i < end; ++i)
+    if (doc[i] == '\n')
+      ++n;
+  paras = malloc((ctx->nparas + n) * sizeof(struct para));
+  if (!paras)
+  {
+    set_error(outofmem);
+    goto prcleanup;
+  }
+  if (first < last)
+  {
+    index = indexparas(first, last, ctx->doc, &mask);
+    if (!index)
+      goto prcleanup;
+  }
+
+  for (para = paras; old < first; ++old)
+    *para++ = *old;
+
+  while (from < end)
+  {
+    para->start = from;
+    from = nextcut(doc, from, end, &para->cut);
+    para->len = from - para->start;
+
+    /* A paragraph may be one of those in between moved elsewhere: */
+
+    old = NULL;
+    if (index)
+      for (i = hashtext(doc + para->start, para->len) & mask;
+           (old = index[i]); i = (i + 1) & mask)
+        if (old->out && old->len == para->len && old->cut == para->cut &&
+            !memcmp(ctx->doc + old->start, doc + para->start, para->len))
+          break;
+    if (old)
+    {
+      para->out = old->out;
+      para->outlen = old->outlen;
+      old->out = NULL;
+      ++ctx->reused;
+    }
+    else
+    {
+      para->out = formatcopy(ctx, doc + para->start, para->len, &para->outlen);
+      ++ctx->reformatted;
+    }
+    ++para;
+    if (is_error())
+      goto prcleanup;
+  }
+
+  for (old = last; old < ctx->paras + ctx->nparas; ++old)
+  {
+    *para = *old;
+    para->start += shift;
+    ++para;
+  }
+  ctx->reused += (first - ctx->paras) + (ctx->paras + ctx->nparas - last);
+
+  /* The outputs of the paragraphs in between which were not kept: */
+
+  for (old = first; old < last; ++old)
+    free(old->out);
+  free(ctx->paras);
+  free(ctx->doc);
+  ctx->paras = paras;
+  ctx->nparas = para - paras;
+  ctx->doc = doc;
+  ctx->doclen = len;
+  doc = NULL;
+
+prcleanup:
+
+  /* Whatever par would have written before any failure is written: */
+
+  for (old = paras; old < para; ++old)
+    if (old->outlen && out(arg, old->out, old->outlen))
+    {
+      if (!is_error())
+        set_error("Output error.\n");
+      break;
+    }
+
+  /* After a failure, all is forgotten, to be reformatted next time: */
+
+  if (is_error())
+  {
+    if (doc)
+    {
+      for (old = paras + (first - ctx->paras); old < para; ++old)
+        free(old->out);
+      free(paras);
+      free(doc);
+    }
+    forgetdoc(ctx);
+  }
+  free(index);
+
+  ctx->err = take_error();
+  return ctx->err ? -1 : 0;
+}
+
+PAREXPORT void par_reflowstats(const struct parctx *ctx, unsigned long *preused,
+                               unsigned long *preformatted)
+{
+  *preused = ctx->reused;
+  *preformatted = ctx->reformatted;
+}
+
+PAREXPORT const char *par_error(const struct parctx *ctx)
+{
+  return ctx->err;
+}
+
+PAREXPORT void par_cachestats(const struct parctx *ctx, unsigned long *phits,
+                              unsigned long *pmisses, unsigned long *pevictions)
+{
+  *phits = *pmisses = *pevictions = 0;
+  if (ctx->cache)
+    cachestats(ctx->cache, phits, pmisses, pevictions);
+}
@@ -9,608 +9,1305 @@
 
 #include "errmsg.h"
 #include "buffer.h" /* Also includes <stddef.h>. */
-#include "reformat.h"
+#include "format.h" /* Also includes "reformat.h" and "cache.h". */
+#include "libpar.h"
+#include "scan.h"
+#include "prof.h"
 
 #include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
 #include <ctype.h>
 #include <getopt.h>
+#include <errno.h>
+#include <limits.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/uio.h>
+#include <sys/time.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <time.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <arpa/inet.h>
+#include <poll.h>
 
 #undef NULL
 #define NULL ((void *)0)
 
-const char *const progname = "par";
-const char *const version = "3.20";
+static struct input stdinput = {STDIN_FILENO, NULL, 0, 0, 0, 0, NULL};
+static struct output stdoutput = {STDOUT_FILENO, NULL, {{NULL, 0}}, 0, NULL};
 
-static int digtoint(char c)
+/* With more than one processor, the input is reformatted by a pipeline. */
+/* The main thread reads it and splits it into batches of whole          */
+/* paragraphs, each ending just after a blank line, which a pool of      */
+/* worker threads reformat into memory. A writer thread copies their     */
+/* output to stdout in input order, so it is exactly what formatinput()  */
+/* alone would produce. Each worker keeps its own error indication; the  */
+/* first batch to fail stops the pipeline after everything before it has */
+/* been written, and its error is reported as if there were no pipeline. */
+/* At most WINDOW batches per worker are in flight, which bounds memory. */
 
-/* Returns the value represented by the digit c,   */
-/* or -1 if c is not a digit. Does not use errmsg. */
+#define BATCHBYTES 65536 /* Minimum size of a batch, unless input ends. */
+#define MAXWORKERS 64
+#define WINDOW 4
+
+struct batch
+{
+  struct input in; /* The paragraphs, read from a block in memory.   */
+  char *out;       /* The reformatted paragraphs, outlen characters. */
+  size_t outlen;
+  char *err;       /* The error message, or NULL if there was none.  */
+  int done;        /* Nonzero once reformatted.                      */
+};
+
+static struct
+{
+  pthread_mutex_t lock;
+  pthread_cond_t queued,   /* Signaled when a batch is read or input ends. */
+      finished,            /* Broadcast when a batch is reformatted.       */
+      written;             /* Signaled when a batch is written.            */
+  struct batch *ring[MAXWORKERS * WINDOW];
+  size_t window,           /* Batches allowed in flight.                   */
+      nread,               /* Batches read, which are numbered from 0.     */
+      ntaken,              /* Batches taken by workers.                    */
+      nwritten;            /* Batches written.                             */
+  int eof,                 /* Nonzero once all batches have been read.     */
+      stop;                /* Nonzero once a batch has failed.             */
+  char *err;               /* The error message of the failed batch.       */
+  unsigned long hits,      /* Totals of the workers' cache statistics.    */
+      misses, evictions;
+  const struct settings *set;
+} pipeline = {PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER,
+              PTHREAD_COND_INITIALIZER, PTHREAD_COND_INITIALIZER};
+
+#define RINGSIZE (sizeof pipeline.ring / sizeof *pipeline.ring)
+
+static void freebatch(struct batch *b)
+
+/* Frees *b and everything it owns. Does not use errmsg. */
 {
-  return c == '0' ? 0 : c == '1' ? 1
-                    : c == '2'   ? 2
-                    : c == '3'   ? 3
-                    : c == '4'   ? 4
-                    : c == '5'   ? 5
-                    : c == '6'   ? 6
-                    : c == '7'   ? 7
-                    : c == '8'   ? 8
-                    : c == '9'   ? 9
-                                 : -1;
-
-  /* We can't simply return c - '0' because this is ANSI  */
-  /* C code, so it has to work for any character set, not */
-  /* just ones which put the digits together in order.    */
+  free(b->in.buf);
+  free(b->out);
+  free(b->err);
+  free(b);
 }
 
-static int strtoudec(const char *s, int *pn)
+static size_t batchend(const char *p, size_t *pfrom, size_t len)
 
-/* Puts the decimal value of the string s into *pn, returning */
-/* 1 on success. If s is empty, or contains non-digits,       */
-/* or represents an integer greater than 9999, then *pn       */
-/* is not changed and 0 is returned. Does not use errmsg.     */
+/* Scans the complete lines of p[*pfrom..len-1], where *pfrom is the  */
+/* start of a line, and advances *pfrom past them. Returns the offset */
+/* just past the last blank line among them, or 0 if there is none.   */
+/* Does not use errmsg.                                               */
 {
-  int n = 0;
+  size_t cut = 0, from = *pfrom;
+  const char *nl, *q;
 
-  if (!*s)
-    return 0;
+  while ((nl = memchr(p + from, '\n', len - from)))
+  {
+    for (q = p + from; q < nl && isspace((unsigned char)*q); ++q)
+      ;
+    from = nl - p + 1;
+    if (q == nl)
+      cut = from;
+  }
 
-  do
+  *pfrom = from;
+  return cut;
+}
+
+static struct batch *readbatch(void)
+
+/* Reads the next batch from stdin. Reformatting the batches one after */
+/* another is the same as reformatting the input as a whole, because   */
+/* no paragraph continues past a blank line. Uses errmsg, and returns  */
+/* NULL on failure or at end of input.                                 */
+{
+  size_t len, from = 0, cut = 0, c;
+  struct batch *b;
+
+  for (;;)
   {
-    if (n >= 1000 || !isdigit(*s))
-      return 0;
-    n = 10 * n + digtoint(*s);
-  } while (*++s);
+    len = stdinput.end - stdinput.start;
+    c = batchend(stdinput.buf + stdinput.start, &from, len);
+    if (c)
+      cut = c;
+    if (cut && len >= BATCHBYTES)
+      break;
+    if (!fillinput(&stdinput))
+    {
+      if (is_error())
+        return NULL;
+      cut = len;
+      break;
+    }
+  }
 
-  *pn = n;
+  if (!cut)
+    return NULL;
 
-  return 1;
+  b = calloc(1, sizeof(struct batch));
+  if (!b || !(b->in.buf = malloc(cut + 1)))
+  {
+    free(b);
+    set_error(outofmem);
+    return NULL;
+  }
+  memcpy(b->in.buf, stdinput.buf + stdinput.start, cut);
+  b->in.fd = -1;
+  b->in.size = b->in.end = cut;
+  b->in.eof = 1;
+  stdinput.start += cut;
+
+  return b;
 }
 
-// static void parseopt(
-//   const char *opt, int *pwidth, int *pprefix,
-//   int *psuffix, int *phang, int *plast, int *pmin
-// )
-// /* Parses the single option in opt, setting *pwidth, *pprefix,     */
-// /* *psuffix, *phang, *plast, or *pmin as appropriate. Uses errmsg. */
-// {
-//   const char *saveopt = opt;
-//   char oc;
-//   int n, r;
-
-//   if (*opt == '-') ++opt;
-
-//   if (!strcmp(opt, "version")) {
-//     sprintf(errmsg,"%s %s\n", progname, version);
-//
-//     return;
-//   }
-
-//   oc = *opt;
-
-//   if (isdigit(oc)) {
-//     if (!strtoudec(opt, &n)) goto badopt;
-//     if (n <= 8) *pprefix = n;
-//     else *pwidth = n;
-//   }
-//   else {
-//     if (!oc) goto badopt;
-//     n = 1;
-//     r = strtoudec(opt + 1, &n);
-//     if (opt[1] && !r) goto badopt;
-
-//     if (oc == 'w' || oc == 'p' || oc == 's') {
-//       if (!r) goto badopt;
-//       if      (oc == 'w') *pwidth  = n;
-//       else if (oc == 'p') *pprefix = n;
-//       else                *psuffix = n;
-//     }
-//     else if (oc == 'h') *phang = n;
-//     else if (n <= 1) {
-//       if      (oc == 'l') *plast = n;
-//       else if (oc == 'm') *pmin = n;
-//     }
-//     else goto badopt;
-//   }
-
-//   // *errmsg = '\0';
-//
-//   return;
-
-// badopt:
-//   sprintf(errmsg, "Bad option: %.149s\n", saveopt);
-// }
-
-static char **readlines(void)
-
-/* Reads lines from stdin until EOF, or until a blank line is encountered, */
-/* in which case the newline is pushed back onto the input stream. Returns */
-/* a NULL-terminated array of pointers to individual lines, stripped of    */
-/* their newline characters. Uses errmsg, and returns NULL on failure.     */
+static void *formatbatches(void *arg)
+
+/* The body of a worker thread. Does not use errmsg, because */
+/* each error is kept with the batch that caused it.         */
 {
-  struct buffer *cbuf = NULL, *pbuf = NULL;
-  int c, blank;
-  char ch, *ln, *nullline = NULL, nullchar = '\0', **lines = NULL;
+  struct batch *b;
+  struct output out;
+  struct cache *cache = NULL;
+  unsigned long hits, misses, evictions;
+  FILE *f;
 
-  cbuf = newbuffer(sizeof(char));
-  // if (*errmsg) goto rlcleanup;
-  if (is_error())
-    goto rlcleanup;
-  pbuf = newbuffer(sizeof(char *));
-  // if (*errmsg) goto rlcleanup;
-  if (is_error())
-    goto rlcleanup;
+  out.fd = -1;
+  out.n = 0;
+  out.err = 0;
+
+  /* Each worker has a cache of its own, as big as the one the main */
+  /* thread would have had; without one, it just does without:     */
 
-  for (blank = 1;;)
+  if (pipeline.set->cache)
   {
-    c = getchar();
-    if (c == EOF)
-      break;
-    if (c == '\n')
+    cache = newcache((size_t)pipeline.set->cache * 1024);
+    clear_error();
+  }
+  out.cache = cache;
+
+  for (;;)
+  {
+    pthread_mutex_lock(&pipeline.lock);
+    while (pipeline.ntaken == pipeline.nread && !pipeline.eof && !pipeline.stop)
+      pthread_cond_wait(&pipeline.queued, &pipeline.lock);
+    if (pipeline.ntaken == pipeline.nread || pipeline.stop)
     {
-      if (blank)
-      {
-        ungetc(c, stdin);
-        break;
-      }
-      additem(cbuf, &nullchar);
-      // if (*errmsg) goto rlcleanup;
-      if (is_error())
-        goto rlcleanup;
-      ln = copyitems(cbuf);
-      // if (*errmsg) goto rlcleanup;
-      if (is_error())
-        goto rlcleanup;
-      additem(pbuf, &ln);
-      // if (*errmsg) goto rlcleanup;
-      if (is_error())
-        goto rlcleanup;
-      clearbuffer(cbuf);
-      blank = 1;
+      pthread_mutex_unlock(&pipeline.lock);
+      break;
     }
+    b = pipeline.ring[pipeline.ntaken++ % RINGSIZE];
+    pthread_mutex_unlock(&pipeline.lock);
+
+    f = open_memstream(&b->out, &b->outlen);
+    if (!f)
+      set_error(outofmem);
     else
     {
-      if (!isspace(c))
-        blank = 0;
-      ch = c;
-      additem(cbuf, &ch);
-      // if (*errmsg) goto rlcleanup;
-      if (is_error())
-        goto rlcleanup;
+      out.file = f;
+      formatinput(&b->in, pipeline.set, NULL, cache, &out);
+      flushoutput(&out);
+      fclose(f);
     }
+    b->err = take_error();
+    free(b->in.buf);
+    b->in.buf = NULL;
+
+    pthread_mutex_lock(&pipeline.lock);
+    b->done = 1;
+    pthread_cond_broadcast(&pipeline.finished);
+    pthread_mutex_unlock(&pipeline.lock);
   }
 
-  if (!blank)
+  if (cache)
   {
-    additem(cbuf, &nullchar);
-    // if (*errmsg) goto rlcleanup;
-    if (is_error())
-      goto rlcleanup;
-    ln = copyitems(cbuf);
-    // if (*errmsg) goto rlcleanup;
-    if (is_error())
-      goto rlcleanup;
-    additem(pbuf, &ln);
-    // if (*errmsg) goto rlcleanup;
-    if (is_error())
-      goto rlcleanup;
+    cachestats(cache, &hits, &misses, &evictions);
+    pthread_mutex_lock(&pipeline.lock);
+    pipeline.hits += hits;
+    pipeline.misses += misses;
+    pipeline.evictions += evictions;
+    pthread_mutex_unlock(&pipeline.lock);
+    freecache(cache);
   }
+  freereformat();
+  return NULL;
+}
 
-  additem(pbuf, &nullline);
-  // if (*errmsg) goto rlcleanup;
-  if (is_error())
-    goto rlcleanup;
-  lines = copyitems(pbuf);
+static void *writebatches(void *arg)
 
-rlcleanup:
+/* The body of the writer thread. Does not use errmsg. */
+{
+  struct batch *b;
 
-  if (cbuf)
-    freebuffer(cbuf);
-  if (pbuf)
+  for (;;)
   {
-    if (!lines)
-      for (;;)
-      {
-        lines = nextitem(pbuf);
-        if (!lines)
-          break;
-        free(*lines);
-      }
-    freebuffer(pbuf);
+    pthread_mutex_lock(&pipeline.lock);
+    while (pipeline.nwritten == pipeline.nread
+               ? !pipeline.eof
+               : !pipeline.ring[pipeline.nwritten % RINGSIZE]->done)
+      pthread_cond_wait(&pipeline.finished, &pipeline.lock);
+    if (pipeline.nwritten == pipeline.nread)
+    {
+      pthread_mutex_unlock(&pipeline.lock);
+      break;
+    }
+    b = pipeline.ring[pipeline.nwritten % RINGSIZE];
+    pthread_mutex_unlock(&pipeline.lock);
+
+    fwrite(b->out, 1, b->outlen, stdout);
+
+    pthread_mutex_lock(&pipeline.lock);
+    pipeline.ring[pipeline.nwritten++ % RINGSIZE] = NULL;
+    if (b->err)
+    {
+      pipeline.err = b->err;
+      b->err = NULL;
+      pipeline.stop = 1;
+      pthread_cond_broadcast(&pipeline.queued);
+    }
+    pthread_cond_signal(&pipeline.written);
+    pthread_mutex_unlock(&pipeline.lock);
+
+    freebatch(b);
+    if (pipeline.err)
+      break;
   }
 
-  return lines;
+  return NULL;
 }
 
-static void setdefaults(
-    const char *const *inlines, int *pwidth, int *pprefix,
-    int *psuffix, int *phang, int *plast, int *pmin)
-/* If any of *pwidth, *pprefix, *psuffix, *phang, *plast, *pmin are     */
-/* less than 0, sets them to default values based on inlines, according */
-/* to "par.doc". Does not use errmsg because it always succeeds.        */
+static void formatparallel(int nworkers, const struct settings *set,
+                           struct cache *cache)
+
+/* Does the same as formatinput(&stdinput, set, NULL, cache, &stdoutput), */
+/* with nworkers worker threads, if they can be started. The workers add */
+/* the statistics of their own caches to pipeline. Uses errmsg.          */
 {
-  int numlines;
-  const char *start, *end, *const *line, *p1, *p2;
-
-  if (*pwidth < 0)
-    *pwidth = 72;
-  if (*phang < 0)
-    *phang = 0;
-  if (*plast < 0)
-    *plast = 0;
-  if (*pmin < 0)
-    *pmin = *plast;
-
-  for (line = inlines; *line; ++line)
-    ;
-  numlines = line - inlines;
+  pthread_t workers[MAXWORKERS], writer;
+  struct batch *b;
+  int i, n;
 
-  if (*pprefix < 0)
-  {
-    if (numlines <= *phang + 1)
-      *pprefix = 0;
-    else
-    {
-      start = inlines[*phang];
-      for (end = start; *end; ++end)
-        ;
-      for (line = inlines + *phang + 1; *line; ++line)
-      {
-        for (p1 = start, p2 = *line; p1 < end && *p1 == *p2; ++p1, ++p2)
-          ;
+  if (nworkers > MAXWORKERS)
+    nworkers = MAXWORKERS;
+  pipeline.set = set;
+  pipeline.window = WINDOW * nworkers;
 
-        end = p1;
-      }
-      *pprefix = end - start;
-    }
+  for (n = 0; n < nworkers; ++n)
+    if (pthread_create(&workers[n], NULL, formatbatches, NULL))
+      break;
+  if (!n || pthread_create(&writer, NULL, writebatches, NULL))
+  {
+    pthread_mutex_lock(&pipeline.lock);
+    pipeline.eof = 1;
+    pthread_cond_broadcast(&pipeline.queued);
+    pthread_mutex_unlock(&pipeline.lock);
+    for (i = 0; i < n; ++i)
+      pthread_join(workers[i], NULL);
+    formatinput(&stdinput, set, NULL, cache, &stdoutput);
+    return;
   }
-  if (*psuffix < 0)
+
+  while ((b = readbatch()))
   {
-    if (numlines <= 1)
-      *psuffix = 0;
-    else
+    pthread_mutex_lock(&pipeline.lock);
+    while (pipeline.nread - pipeline.nwritten >= pipeline.window && !pipeline.stop)
+      pthread_cond_wait(&pipeline.written, &pipeline.lock);
+    if (pipeline.stop)
     {
-      start = *inlines;
-      for (end = start; *end; ++end)
-        ;
-      for (line = inlines + 1; *line; ++line)
-      {
-        for (p2 = *line; *p2; ++p2)
-          ;
-        for (p1 = end;
-             p1 > start && p2 > *line && p1[0] == p2[0];
-             --p1, --p2)
-          ;
-        if (p1[0] != p2[0])
-          p1++;
-        start = p1;
-      }
-      while (end - start >= 2 && isspace(*start) && isspace(start[1]))
-        ++start;
-      *psuffix = end - start;
+      pthread_mutex_unlock(&pipeline.lock);
+      freebatch(b);
+      break;
     }
+    pipeline.ring[pipeline.nread++ % RINGSIZE] = b;
+    pthread_cond_signal(&pipeline.queued);
+    pthread_mutex_unlock(&pipeline.lock);
   }
 
-  // printf("w%d p%d s%d h%d l%d m%d\n", *pwidth, *pprefix, *psuffix, *phang, *plast, *pmin);
+  pthread_mutex_lock(&pipeline.lock);
+  pipeline.eof = 1;
+  pthread_cond_broadcast(&pipeline.queued);
+  pthread_cond_broadcast(&pipeline.finished);
+  pthread_mutex_unlock(&pipeline.lock);
+
+  for (i = 0; i < n; ++i)
+    pthread_join(workers[i], NULL);
+  pthread_join(writer, NULL);
+
+  /* Batches after a failed one are never written: */
+
+  for (; pipeline.nwritten < pipeline.nread; ++pipeline.nwritten)
+    freebatch(pipeline.ring[pipeline.nwritten % RINGSIZE]);
+
+  /* An error in a batch came before any error in reading the rest: */
+
+  if (pipeline.err)
+  {
+    clear_error();
+    set_error(pipeline.err);
+    free(pipeline.err);
+    pipeline.err = NULL;
+  }
 }
 
-static void freelines(char **lines)
-/* Frees the strings pointed to in the NULL-terminated array lines, then */
-/* frees the array. Does not use errmsg because it always succeeds.      */
+/* With --files, the files named by the operands, and those in the   */
+/* directory trees they name, are each reformatted in place by a pool */
+/* of worker threads. A worker maps its file into memory, writes the  */
+/* output to a temporary file in the same directory, and renames that */
+/* over the original, so that no file is ever seen half reformatted.  */
+/* The settings are parsed once and only read by the workers.         */
+
+struct job
 {
-  char **line;
-  char **original_lines = lines;
-  for (line = lines; *line; line = ++lines)
-    free(*line);
+  char *path;
+  size_t bytes;   /* The size of the file before reformatting.     */
+  double seconds; /* How long reformatting it took.                */
+  char *err;      /* The error message, or NULL if there was none. */
+};
 
-  free(original_lines);
-}
-void bad_option_int(int n)
+static struct
 {
-  char *s;
-  size_t x;
-  FILE *f = open_memstream(&s, &x);
-  fprintf(f, "Bad Option: '%d'\n", n);
-  fflush(f);
-  fclose(f);
-  set_error(s);
-  return;
+  pthread_mutex_t lock;
+  struct job *jobs;
+  size_t njobs,       /* The number of jobs.                      */
+      ntaken,         /* Jobs taken by workers.                   */
+      nskipped;       /* Paths which could not be read.           */
+  unsigned long hits, /* Totals of the workers' cache statistics. */
+      misses, evictions;
+  const struct settings *set;
+} files = {PTHREAD_MUTEX_INITIALIZER};
+
+static double now(void)
+
+/* Returns the time in seconds from some fixed point. */
+{
+  struct timespec t;
+
+  clock_gettime(CLOCK_MONOTONIC, &t);
+  return t.tv_sec + t.tv_nsec / 1e9;
 }
-void bad_option_str(char *c)
+
+static void syserror(const char *what)
+
+/* Sets errmsg to what, followed by a description of errno. */
 {
   FILE *f;
   char *s;
   size_t x;
+  int e = errno;
+
   f = open_memstream(&s, &x);
-  fprintf(f, "Bad Option: '%s'\n", c);
+  fprintf(f, "%s: %s\n", what, strerror(e));
   fflush(f);
   fclose(f);
   set_error(s);
-  return;
+  free(s);
+}
+
+static int visible(const struct dirent *e)
+{
+  return e->d_name[0] != '.';
 }
-void getoption(int argc,
-               char *argv[], int *pwidth, int *pprefix,
-               int *psuffix, int *phang, int *plast, int *pmin)
+
+static void skippath(const char *path)
+
+/* Reports on stderr that path could not be read, with a description */
+/* of errno, and counts it in files.nskipped.                        */
+{
+  fprintf(stderr, "%s: %s: %s\n", progname, path, strerror(errno));
+  ++files.nskipped;
+}
+
+static void addpaths(struct buffer *paths, const char *path, int named)
+
+/* Adds a copy of path to paths if it names a regular file, or if it */
+/* names a directory, copies of the paths of the regular files in it */
+/* and its subdirectories, in order, leaving out those whose names   */
+/* begin with '.'. A symbolic link is replaced by the path it        */
+/* resolves to if named is nonzero, and skipped otherwise, so that   */
+/* renaming never replaces the link itself. A path which cannot be   */
+/* read is reported and skipped with skippath(). Uses errmsg, only   */
+/* for running out of memory.                                        */
 {
-  if (argc == 1)
+  struct stat st;
+  struct dirent **entries;
+  char *copy;
+  int n, i;
+
+  if (lstat(path, &st) < 0)
+  {
+    skippath(path);
     return;
-  int option_char = 0;
-  int option_index = 0;
-  static struct option long_options[] = {
-      {"width", required_argument, 0, 'w'},
-      {"prefix", required_argument, 0, 'p'},
-      {"suffix", required_argument, 0, 's'},
-      {"hang", optional_argument, 0, 'h'},
-      {"", optional_argument, 0, 'l'},
-      {"last", 0, 0, 1},
-      {"no-last", 0, 0, 2},
-      {"", optional_argument, 0, 'm'},
-      {"min", 0, 0, 3},
-      {"no-min", 0, 0, 4},
-      {"version", 0, 0, 0},
-      {0, 0, 0, 0}};
-  // int lastindex = 0;
-  while ((option_char = getopt_long(argc, argv, "w:p:s:hlm", long_options, &option_index)) != EOF)
-  {
-    // printf("%c, %s, %d\n",option_char, argv[optind-1],optind-1);
-
-    // lastindex++;
-    int n = 1;
-    if (optarg)
+  }
+
+  if (S_ISLNK(st.st_mode))
+  {
+    if (!named)
+      return;
+    copy = realpath(path, NULL);
+    if (!copy)
     {
-      // lastindex++;
-      strtoudec(optarg, &n);
+      skippath(path);
+      return;
     }
+    addpaths(paths, copy, 1);
+    free(copy);
+    return;
+  }
 
-    switch (option_char)
+  if (S_ISDIR(st.st_mode))
+  {
+    n = scandir(path, &entries, visible, alphasort);
+    if (n < 0)
+    {
+      skippath(path);
+      return;
+    }
+    for (i = 0; i < n; ++i)
     {
-    case 0:
-      printf("%s %s\n", progname, version);
-      clear_error();
-      exit(EXIT_SUCCESS);
+      copy = is_error() ? NULL
+                        : malloc(strlen(path) + strlen(entries[i]->d_name) + 2);
+      if (copy)
+      {
+        sprintf(copy, "%s/%s", path, entries[i]->d_name);
+        addpaths(paths, copy, 0);
+        free(copy);
+      }
+      else if (!is_error())
+        set_error(outofmem);
+      free(entries[i]);
+    }
+    free(entries);
+    return;
+  }
+
+  if (!S_ISREG(st.st_mode))
+  {
+    if (named)
+    {
+      errno = EINVAL;
+      skippath(path);
+    }
+    return;
+  }
+
+  copy = strdup(path);
+  if (!copy)
+  {
+    set_error(outofmem);
+    return;
+  }
+  additem(paths, &copy);
+  if (is_error())
+    free(copy);
+}
+
+static void formatfile(struct job *job, struct cache *cache)
+
+/* Reformats the file job->path in place according to files.set, */
+/* using cache as formatinput() does, and sets job->bytes. Uses  */
+/* errmsg, leaving the file as it was on failure.                */
+{
+  struct input in = {-1, NULL, 0, 0, 0, 1, NULL};
+  struct output out;
+  struct stat st;
+  char *map = NULL, *tmp = NULL;
+  size_t maplen = 0;
+  int fd, tmpfd = -1;
+
+  fd = open(job->path, O_RDONLY);
+  if (fd < 0)
+  {
+    syserror("Can't open");
+    return;
+  }
+  if (fstat(fd, &st) < 0)
+  {
+    syserror("Can't read");
+    goto ffcleanup;
+  }
+  job->bytes = st.st_size;
+
+  /* readlines() writes to the block, and one byte beyond it, so the */
+  /* file is mapped privately over a slightly larger anonymous map:  */
+
+  maplen = job->bytes + 1;
+  map = mmap(NULL, maplen, PROT_READ | PROT_WRITE,
+             MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (map == MAP_FAILED)
+  {
+    map = NULL;
+    set_error(outofmem);
+    goto ffcleanup;
+  }
+  if (job->bytes &&
+      mmap(map, job->bytes, PROT_READ | PROT_WRITE,
+           MAP_PRIVATE | MAP_FIXED, fd, 0) == MAP_FAILED)
+  {
+    syserror("Can't read");
+    goto ffcleanup;
+  }
+  in.buf = map;
+  in.size = in.end = job->bytes;
+
+  tmp = malloc(strlen(job->path) + sizeof ".parXXXXXX");
+  if (!tmp)
+  {
+    set_error(outofmem);
+    goto ffcleanup;
+  }
+  sprintf(tmp, "%s.parXXXXXX", job->path);
+  tmpfd = mkstemp(tmp);
+  if (tmpfd < 0)
+  {
+    free(tmp);
+    tmp = NULL;
+    syserror("Can't create a temporary file");
+    goto ffcleanup;
+  }
+  fchmod(tmpfd, st.st_mode & 07777);
+
+  out.fd = tmpfd;
+  out.file = NULL;
+  out.n = 0;
+  out.cache = cache;
+  out.err = 0;
+  formatinput(&in, files.set, NULL, cache, &out);
+  flushoutput(&out);
+  if (is_error())
+    goto ffcleanup;
+  if (out.err)
+  {
+    errno = out.err;
+    syserror("Can't write");
+    goto ffcleanup;
+  }
+  if (close(tmpfd) < 0)
+  {
+    tmpfd = -1;
+    syserror("Can't write");
+    goto ffcleanup;
+  }
+  tmpfd = -1;
+  if (rename(tmp, job->path) < 0)
+  {
+    syserror("Can't replace");
+    goto ffcleanup;
+  }
+  free(tmp);
+  tmp = NULL;
+
+ffcleanup:
+
+  if (tmpfd >= 0)
+    close(tmpfd);
+  if (tmp)
+  {
+    unlink(tmp);
+    free(tmp);
+  }
+  if (map)
+    munmap(map, maplen);
+  close(fd);
+}
+
+static void *formatfiles(void *arg)
+
+/* The body of a worker thread, which the main thread also runs. */
+/* Does not use errmsg, because each error is kept with the job  */
+/* that caused it.                                               */
+{
+  struct job *job;
+  struct cache *cache = NULL;
+  unsigned long hits, misses, evictions;
+  double start;
+
+  if (files.set->cache)
+  {
+    cache = newcache((size_t)files.set->cache * 1024);
+    clear_error();
+  }
+
+  for (;;)
+  {
+    pthread_mutex_lock(&files.lock);
+    job = files.ntaken < files.njobs ? &files.jobs[files.ntaken++] : NULL;
+    pthread_mutex_unlock(&files.lock);
+    if (!job)
       break;
-    case 'w':
-      *pwidth = n;
+
+    start = now();
+    formatfile(job, cache);
+    job->seconds = now() - start;
+    job->err = take_error();
+  }
+
+  if (cache)
+  {
+    cachestats(cache, &hits, &misses, &evictions);
+    pthread_mutex_lock(&files.lock);
+    files.hits += hits;
+    files.misses += misses;
+    files.evictions += evictions;
+    pthread_mutex_unlock(&files.lock);
+    freecache(cache);
+  }
+  freereformat();
+  return NULL;
+}
+
+static void formatpaths(int nworkers, const struct settings *set)
+
+/* Reformats the files given by set->paths in place, as described above, */
+/* with up to nworkers threads, then reports on stderr how long each    */
+/* file took and how long they all took. A path which cannot be read is */
+/* reported and skipped, and a file which fails is left as it was, and  */
+/* reported; the rest are still reformatted, and errmsg is set at the   */
+/* end if anything failed. Uses errmsg.                                 */
+{
+  pthread_t workers[MAXWORKERS];
+  struct buffer *paths;
+  struct job *job;
+  char **path;
+  size_t bytes = 0, failed = 0;
+  double start, work = 0;
+  int i, n;
+
+  files.nskipped = 0;
+  if (!set->npaths)
+  {
+    set_error("--files needs at least one path.\n");
+    return;
+  }
+
+  paths = newbuffer(sizeof(char *));
+  if (is_error())
+    return;
+  for (i = 0; i < set->npaths && !is_error(); ++i)
+    addpaths(paths, set->paths[i], 1);
+  if (!is_error())
+  {
+    files.jobs = calloc(numitems(paths) + 1, sizeof(struct job));
+    if (!files.jobs)
+      set_error(outofmem);
+  }
+  if (is_error())
+  {
+    while ((path = nextitem(paths)))
+      free(*path);
+    freebuffer(paths);
+    return;
+  }
+  for (job = files.jobs; (path = nextitem(paths)); ++job)
+    job->path = *path;
+  files.njobs = job - files.jobs;
+  freebuffer(paths);
+
+  files.set = set;
+  if (nworkers > MAXWORKERS)
+    nworkers = MAXWORKERS;
+  if ((size_t)nworkers > files.njobs)
+    nworkers = files.njobs;
+
+  start = now();
+  for (n = 0; n < nworkers - 1; ++n)
+    if (pthread_create(&workers[n], NULL, formatfiles, NULL))
       break;
-    case 'p':
-      *pprefix = n;
+  formatfiles(NULL);
+  for (i = 0; i < n; ++i)
+    pthread_join(workers[i], NULL);
+
+  for (job = files.jobs; job < files.jobs + files.njobs; ++job)
+  {
+    if (job->err)
+    {
+      fprintf(stderr, "%s: %s: %s", progname, job->path, job->err);
+      ++failed;
+    }
+    else
+      fprintf(stderr, "%s: %s: %lu bytes in %.3f ms\n", progname, job->path,
+              (unsigned long)job->bytes, job->seconds * 1e3);
+    bytes += job->bytes;
+    work += job->seconds;
+    free(job->path);
+    free(job->err);
+  }
+  fprintf(stderr, "%s: %lu file%s, %lu bytes in %.3f s with %d thread%s "
+                  "(%.3f s of work)\n",
+          progname, (unsigned long)files.njobs, files.njobs == 1 ? "" : "s",
+          (unsigned long)bytes, now() - start, n + 1, n ? "s" : "", work);
+  free(files.jobs);
+  files.jobs = NULL;
+
+  failed += files.nskipped;
+  if (failed)
+  {
+    FILE *f;
+    char *s;
+    size_t x;
+    f = open_memstream(&s, &x);
+    fprintf(f, "%lu of %lu files could not be reformatted.\n",
+            (unsigned long)failed,
+            (unsigned long)(files.njobs + files.nskipped));
+    fflush(f);
+    fclose(f);
+    set_error(s);
+    free(s);
+  }
+}
+
+/* With --serve, par is a daemon which reformats text for clients    */
+/* connecting to a Unix domain socket, so that they need not start a  */
+/* process for each piece of text. A client sends any number of       */
+/* requests on a connection, each made of a 4-byte length in network  */
+/* byte order followed by that many characters of options, written as */
+/* in PARINIT, and then a 4-byte length followed by the text. For     */
+/* each it gets a 4-byte status, 0 for success and 1 for failure, and */
+/* a 4-byte length followed by the reformatted text, or by the error  */
+/* message. The options of a request apply on top of those par was    */
+/* started with. The main thread reads from all of the connections at */
+/* once, without blocking, into a buffer for each, and hands each     */
+/* connection whose buffer holds a whole request to a pool of         */
+/* threads, each with a context of its own whose storage for          */
+/* reformatting is reused from request to request. So neither idle    */
+/* connections nor clients which are slow to send a request tie up a  */
+/* thread, and a client which does not read its replies is dropped    */
+/* after REPLYTIMEOUT seconds. Parsed options are cached by their     */
+/* text.                                                              */
+
+#define MAXCONNS 1024          /* Open connections at most.             */
+#define MAXREQOPTIONS 4096     /* Longest options of a request.         */
+#define MAXREQTEXT (64 << 20)  /* Longest text of a request.            */
+#define READSIZE 65536         /* Smallest buffer for a connection.     */
+#define REPLYTIMEOUT 10        /* Seconds a reply may take to be sent.  */
+#define OPTSLOTS 256           /* Option sets cached, a power of 2.     */
+
+struct conn
+{
+  int fd;
+  char *buf;   /* What has been read of the requests not yet     */
+  size_t len,  /* answered, len characters, in storage for size. */
+      size;
+};
+
+static struct
+{
+  pthread_mutex_t lock;
+  pthread_cond_t ready;    /* Signaled when a request is ready.         */
+  struct conn *readyconn[MAXCONNS]; /* Connections holding a request, */
+  size_t nready, ntaken;   /* in a ring of which nready - ntaken are    */
+                           /* in use.                                   */
+  struct conn *idleconn[MAXCONNS];  /* Connections handed back by the */
+  size_t nidle;            /* pool, NULL for those it closed.           */
+  int wake[2];             /* A pipe, written when one is handed back.  */
+  struct
+  {
+    char *options;
+    struct settings set;
+  } slot[OPTSLOTS];        /* The cache of parsed options.              */
+  const struct settings *base;
+} server = {PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER};
+
+static size_t requestsize(const struct conn *c)
+
+/* Returns how much of the request at the start of c->buf must be read */
+/* before it can be handed to the pool: all of it, or, if one of its   */
+/* lengths is too big, as much as includes that length. Does not use  */
+/* errmsg.                                                             */
+{
+  uint32_t n;
+  size_t need = sizeof n;
+
+  if (c->len < need)
+    return need;
+  memcpy(&n, c->buf, sizeof n);
+  n = ntohl(n);
+  if (n > MAXREQOPTIONS)
+    return need;
+  need += n + sizeof n;
+  if (c->len < need)
+    return need;
+  memcpy(&n, c->buf + need - sizeof n, sizeof n);
+  n = ntohl(n);
+  if (n > MAXREQTEXT)
+    return need;
+  return need + n;
+}
+
+static int fillconn(struct conn *c)
+
+/* Reads what has arrived on c->fd into c->buf without blocking, first */
+/* growing c->buf towards the size of the request being read. Returns  */
+/* 0 if the connection is still open, and -1 at end of file, on an     */
+/* error, or if there is no memory. Does not use errmsg.               */
+{
+  size_t need = requestsize(c), size;
+  ssize_t got;
+  char *buf;
+
+  if (c->len == c->size)
+  {
+    size = 2 * c->size;
+    if (size < READSIZE)
+      size = READSIZE;
+    if (size > need && need > READSIZE)
+      size = need;
+    buf = realloc(c->buf, size);
+    if (!buf)
+      return -1;
+    c->buf = buf;
+    c->size = size;
+  }
+
+  do
+    got = recv(c->fd, c->buf + c->len, c->size - c->len, MSG_DONTWAIT);
+  while (got < 0 && errno == EINTR);
+  if (got < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+    return 0;
+  if (got <= 0)
+    return -1;
+  c->len += got;
+  return 0;
+}
+
+static void closeconn(struct conn *c)
+{
+  close(c->fd);
+  free(c->buf);
+  free(c);
+}
+
+static int reply(int fd, unsigned status, const char *s, size_t n)
+
+/* Sends a reply with status and the n characters at s to fd. Returns */
+/* 0 on success, and -1 on an error. Does not use errmsg.             */
+{
+  uint32_t head[2];
+  struct iovec v[2];
+  ssize_t sent;
+  int i = 0;
+
+  head[0] = htonl(status);
+  head[1] = htonl(n);
+  v[0].iov_base = head;
+  v[0].iov_len = sizeof head;
+  v[1].iov_base = (char *)s;
+  v[1].iov_len = n;
+  while (i < 2)
+  {
+    sent = writev(fd, v + i, 2 - i);
+    if (sent < 0 && errno == EINTR)
+      continue;
+    if (sent < 0)
+      return -1;
+    for (; i < 2 && (size_t)sent >= v[i].iov_len; ++i)
+      sent -= v[i].iov_len;
+    if (i < 2)
+    {
+      v[i].iov_base = (char *)v[i].iov_base + sent;
+      v[i].iov_len -= sent;
+    }
+  }
+  return 0;
+}
+
+static void getsettings(const char *options, struct settings *set)
+
+/* Sets *set to the settings par was started with, changed by options, */
+/* which are looked up in the cache, and parsed and added to it if    */
+/* they are not there. Uses errmsg.                                    */
+{
+  size_t i = hashtext(options, strlen(options)) & (OPTSLOTS - 1);
+  char *copy;
+
+  pthread_mutex_lock(&server.lock);
+  if (server.slot[i].options && !strcmp(server.slot[i].options, options))
+  {
+    *set = server.slot[i].set;
+    pthread_mutex_unlock(&server.lock);
+    return;
+  }
+  pthread_mutex_unlock(&server.lock);
+
+  *set = *server.base;
+  set->serve = NULL;
+  parsesettings(options, set);
+  if (is_error())
+    return;
+
+  copy = strdup(options);
+  if (!copy)
+    return; /* It can do without. */
+  pthread_mutex_lock(&server.lock);
+  free(server.slot[i].options);
+  server.slot[i].options = copy;
+  server.slot[i].set = *set;
+  pthread_mutex_unlock(&server.lock);
+}
+
+static int serverequest(struct conn *c, struct parctx *ctx)
+
+/* Answers the request at the start of c->buf, of requestsize(c)      */
+/* characters, using ctx, and takes it out of c->buf. Returns 0 if the */
+/* connection can carry more requests, and -1 if it failed, or if the  */
+/* request was too big to read. Does not use errmsg.                   */
+{
+  char options[MAXREQOPTIONS + 1], *out = NULL, *err;
+  size_t olen = 0, used;
+  uint32_t n, tlen;
+  int failed;
+
+  memcpy(&n, c->buf, sizeof n);
+  n = ntohl(n);
+  if (n > MAXREQOPTIONS)
+  {
+    reply(c->fd, 1, "Options too long.\n", 18);
+    return -1;
+  }
+  memcpy(options, c->buf + sizeof n, n);
+  options[n] = '\0';
+  memcpy(&tlen, c->buf + sizeof n + n, sizeof tlen);
+  tlen = ntohl(tlen);
+  if (tlen > MAXREQTEXT)
+  {
+    reply(c->fd, 1, "Text too long.\n", 15);
+    return -1;
+  }
+
+  getsettings(options, ctxsettings(ctx));
+  if (!is_error())
+    out = formatcopy(ctx, c->buf + sizeof n + n + sizeof tlen, tlen, &olen);
+  err = take_error();
+  if (err)
+    failed = reply(c->fd, 1, err, strlen(err));
+  else
+    failed = reply(c->fd, 0, out, olen);
+  free(err);
+  free(out);
+
+  /* Keep what has been read of the next requests, but give back a */
+  /* buffer grown for a big request once it is empty:               */
+
+  used = sizeof n + n + sizeof tlen + tlen;
+  c->len -= used;
+  memmove(c->buf, c->buf + used, c->len);
+  if (!c->len && c->size > READSIZE)
+  {
+    free(c->buf);
+    c->buf = NULL;
+    c->size = 0;
+  }
+  return failed;
+}
+
+static void *serverequests(void *arg)
+
+/* The body of a thread of the pool. Does not use errmsg. */
+{
+  struct parctx *ctx;
+  struct conn *c;
+
+  ctx = par_newctx();
+  if (!ctx)
+    return NULL;
+
+  for (;;)
+  {
+    pthread_mutex_lock(&server.lock);
+    while (server.ntaken == server.nready)
+      pthread_cond_wait(&server.ready, &server.lock);
+    c = server.readyconn[server.ntaken++ % MAXCONNS];
+    pthread_mutex_unlock(&server.lock);
+
+    if (serverequest(c, ctx))
+    {
+      closeconn(c);
+      c = NULL;
+    }
+    pthread_mutex_lock(&server.lock);
+    server.idleconn[server.nidle++] = c;
+    pthread_mutex_unlock(&server.lock);
+    while (write(server.wake[1], "", 1) < 0 && errno == EINTR)
+      ; /* If the pipe is full, it will be read anyway. */
+  }
+
+  return NULL;
+}
+
+static void handover(struct conn *c)
+
+/* Hands c, which holds a whole request, to the pool, with server.lock */
+/* held. Does not use errmsg.                                          */
+{
+  server.readyconn[server.nready++ % MAXCONNS] = c;
+  pthread_cond_signal(&server.ready);
+}
+
+static void serve(int nworkers, const struct settings *set)
+
+/* Serves requests on the socket set->serve, as described above, with */
+/* a pool of about nworkers threads, until it fails. Uses errmsg.     */
+{
+  struct sockaddr_un addr;
+  struct stat st;
+  struct pollfd fds[2 + MAXCONNS];
+  struct conn *conns[2 + MAXCONNS], *c;
+  struct timeval timeout = {REPLYTIMEOUT, 0};
+  pthread_t thread;
+  char drain[64];
+  size_t nfds, nconns = 0, i;
+  int fd, conn, n;
+
+  if (strlen(set->serve) >= sizeof addr.sun_path)
+  {
+    errno = ENAMETOOLONG;
+    syserror(set->serve);
+    return;
+  }
+  memset(&addr, 0, sizeof addr);
+  addr.sun_family = AF_UNIX;
+  strcpy(addr.sun_path, set->serve);
+
+  /* A socket left behind by an earlier server is replaced: */
+
+  if (!lstat(set->serve, &st) && S_ISSOCK(st.st_mode))
+    unlink(set->serve);
+
+  fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (fd < 0 || bind(fd, (struct sockaddr *)&addr, sizeof addr) < 0 ||
+      listen(fd, SOMAXCONN) < 0)
+  {
+    syserror(set->serve);
+    if (fd >= 0)
+      close(fd);
+    return;
+  }
+  if (pipe(server.wake) < 0 ||
+      fcntl(server.wake[0], F_SETFL, O_NONBLOCK) < 0 ||
+      fcntl(server.wake[1], F_SETFL, O_NONBLOCK) < 0)
+  {
+    syserror("pipe");
+    close(fd);
+    return;
+  }
+  signal(SIGPIPE, SIG_IGN);
+
+  server.base = set;
+  if (nworkers < 4)
+    nworkers = 4;
+  if (nworkers > MAXWORKERS)
+    nworkers = MAXWORKERS;
+  for (n = 0; n < nworkers; ++n)
+    if (pthread_create(&thread, NULL, serverequests, NULL))
       break;
-    case 's':
-      *psuffix = n;
+    else
+      pthread_detach(thread);
+  if (!n)
+  {
+    set_error("Can't start any threads.\n");
+    goto servecleanup;
+  }
+
+  /* fds holds the socket, the pipe, and then the connections which are */
+  /* not with the pool, of which there are nfds - 2, each polled for    */
+  /* the connection at the same index of conns:                         */
+
+  fds[0].fd = fd;
+  fds[1].fd = server.wake[0];
+  fds[0].events = fds[1].events = POLLIN;
+  nfds = 2;
+
+  for (;;)
+  {
+    if (poll(fds, nfds, -1) < 0)
+    {
+      if (errno == EINTR)
+        continue;
+      syserror("poll");
       break;
-    case 'h':
-      // printf("%s", argv[lastindex]);
-      if (optarg)
+    }
+
+    /* Read what has arrived, and hand connections which now hold a */
+    /* whole request to the pool:                                    */
+
+    for (i = 2; i < nfds;)
+    {
+      c = conns[i];
+      if (!fds[i].revents)
+        ++i;
+      else if (fillconn(c) < 0)
       {
-        if (strtoudec(optarg, &n))
-        {
-          // lastindex++;
-          *phang = n;
-        }
+        closeconn(c);
+        --nconns;
+        fds[i] = fds[--nfds];
+        conns[i] = conns[nfds];
       }
-      else
-        *phang = 1;
-      break;
-    case 'l':
-      if (optarg)
+      else if (c->len >= requestsize(c))
       {
-        if (strtoudec(optarg, &n))
-        {
-          // lastindex++;
-          if (n == 1 || n == 0)
-            *plast = n;
-          else
-          {
-            bad_option_int(n);
-            return;
-          }
-        }
+        pthread_mutex_lock(&server.lock);
+        handover(c);
+        pthread_mutex_unlock(&server.lock);
+        fds[i] = fds[--nfds];
+        conns[i] = conns[nfds];
       }
       else
-        *phang = 1;
-      break;
-    case 1:
-      *plast = 1;
-      break;
-    case 2:
-      *plast = 0;
-      break;
-    case 'm':
-      if (optarg)
+        ++i;
+    }
+
+    /* Take back the ones the pool is done with, unless they already */
+    /* hold another request:                                          */
+
+    if (fds[1].revents)
+    {
+      while (read(server.wake[0], drain, sizeof drain) > 0)
+        ;
+      pthread_mutex_lock(&server.lock);
+      for (i = 0; i < server.nidle; ++i)
       {
-        if (strtoudec(optarg, &n))
+        c = server.idleconn[i];
+        if (!c)
+          --nconns;
+        else if (c->len >= requestsize(c))
+          handover(c);
+        else
         {
-          // lastindex++;
-          if (n == 1 || n == 0)
-            *pmin = n;
-          else
-          {
-            bad_option_int(n);
-            return;
-          }
+          conns[nfds] = c;
+          fds[nfds].fd = c->fd;
+          fds[nfds++].events = POLLIN;
         }
       }
-      break;
-    case 3:
-      *pmin = 1;
-      break;
-    case 4:
-      *pmin = 0;
-      break;
-    default:
-      bad_option_str(argv[optind - 1]);
-      return;
-      break;
+      server.nidle = 0;
+      pthread_mutex_unlock(&server.lock);
     }
-  }
-  for (int i = optind; i < argc; i++)
-  {
-    int n = 1;
-    if (strtoudec(argv[i], &n))
+
+    if (fds[0].revents)
     {
-      if (n > 9)
+      conn = accept(fd, NULL, NULL);
+      if (conn < 0)
       {
-        *pwidth = n;
+        if (errno == EINTR || errno == ECONNABORTED)
+          continue;
+        syserror("accept");
+        break;
       }
+      c = nconns < MAXCONNS ? calloc(1, sizeof(struct conn)) : NULL;
+      if (!c)
+        close(conn);
       else
       {
-        *pprefix = n;
+        setsockopt(conn, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof timeout);
+        c->fd = conn;
+        ++nconns;
+        conns[nfds] = c;
+        fds[nfds].fd = conn;
+        fds[nfds++].events = POLLIN;
       }
     }
-    else
-    {
-      bad_option_str(argv[i]);
-      return;
-    }
   }
 
-  // printf("w%d p%d s%d h%d l%d m%d\n", *pwidth, *pprefix, *psuffix, *phang, *plast, *pmin);
+servecleanup:
+
+  close(server.wake[0]);
+  close(server.wake[1]);
+  close(fd);
 }
+
 int original_main(int argc, char *argv[])
 {
-  int width, widthbak = -1, prefix, prefixbak = -1, suffix, suffixbak = -1,
-             hang, hangbak = -1, last, lastbak = -1, min, minbak = -1, c;
-  char *parinit, *picopy = NULL, *opt, **inlines = NULL, **outlines = NULL,
-                 **line;
-  const char *const whitechars = " \f\n\r\t\v";
+  struct settings set = {-1, -1, -1, -1, -1, -1, 0, 0, 0};
+  struct cache *cache = NULL;
+  unsigned long hits = 0, misses = 0, evictions = 0;
+  long nprocs;
+  char *parinit;
 
   parinit = getenv("PARINIT");
   if (parinit)
   {
-    picopy = calloc((strlen(parinit) + 1), sizeof(char));
-    if (!picopy)
-    {
-      //  strcpy(errmsg,outofmem);
-      set_error(outofmem);
-      goto parcleanup;
-    }
-    strcpy(picopy, parinit);
-    size_t arglen;
-    for (arglen = 0, opt = strtok(picopy, whitechars);
-         opt; arglen++, opt = strtok(NULL, whitechars))
-      ;
-    char **optarr = calloc(arglen, sizeof(*optarr));
-    strcpy(picopy, parinit);
-    opt = strtok(picopy, whitechars);
-    for (int i = 0; opt != NULL; i++)
-    {
-      optarr[i] = opt;
-      opt = strtok(NULL, whitechars);
-    }
-    getoption(arglen, optarr, &widthbak, &prefixbak, &suffixbak, &hangbak, &lastbak, &minbak);
-    free(optarr);
+    if (parseoptions(parinit, NULL, &set))
+      goto version;
     // if(*errmsg) goto parcleanup;
     if (is_error())
       goto parcleanup;
   }
 
-  //   while (opt) {
-  //     parseopt(opt, &widthbak, &prefixbak,
-  //              &suffixbak, &hangbak, &lastbak, &minbak);
-  //     if (*errmsg) goto parcleanup;
-  //     opt = strtok(NULL,whitechars);
-  //   }
-  //   free(picopy);
-  //   picopy = NULL;
-  // }
-
   // while (*++argv) {
   //   parseopt(*argv, &widthbak, &prefixbak,
   //            &suffixbak, &hangbak, &lastbak, &minbak);
   //   if (*errmsg) goto parcleanup;
   //  }
-  getoption(argc, argv, &widthbak, &prefixbak, &suffixbak, &hangbak, &lastbak, &minbak);
+  if (getoption(argc, argv, &set))
+    goto version;
   // if(*errmsg) goto parcleanup;
   if (is_error())
     goto parcleanup;
-  for (;;)
-  {
-    for (;;)
-    {
-      c = getchar();
-      if (c != '\n' || c == EOF)
-        break;
-      putchar(c);
-    }
-    if (c == EOF)
-      break;
-    ungetc(c, stdin);
 
-    inlines = readlines();
+  nprocs = sysconf(_SC_NPROCESSORS_ONLN);
 
-    // if (*errmsg) goto parcleanup;
-    if (is_error())
-      goto parcleanup;
-    if (!*inlines)
-    {
-      free(inlines);
-      inlines = NULL;
-      continue;
-    }
+  if (set.files)
+  {
+    formatpaths(nprocs, &set);
+    goto parcleanup;
+  }
 
-    width = widthbak;
-    prefix = prefixbak;
-    suffix = suffixbak;
-    hang = hangbak;
-    last = lastbak;
-    min = minbak;
-    if (width == 0)
-    {
-      width = -1;
-    }
-    setdefaults((const char *const *)inlines,
-                &width, &prefix, &suffix, &hang, &last, &min);
-    char str[200];
-    if (prefix + suffix >= width)
-    {
-      FILE *f;
-      char *s;
-      size_t x;
-      f = open_memstream(&s, &x);
-      fprintf(f, "<width> = %d shorter than <prefix> + <suffix> = %d + %d = %d\n",
-              width, prefix, suffix, prefix + suffix);
-      fflush(f);
-      fclose(f);
-      set_error(s);
+  if (set.serve)
+  {
+    serve(2 * nprocs, &set);
+    goto parcleanup;
+  }
 
-      // snprintf(str, 200, "<width> = %d shorter than <prefix> + <suffix> = %d + %d = %d\n",
-      //          width, prefix, suffix, prefix + suffix);
-      // set_error(str);
-    }
+  /* Input which fits in one batch is not worth a pipeline, and a */
+  /* window would be no use if whole paragraphs made up batches:  */
 
-    if (is_error())
-      goto parcleanup;
-    outlines = reformat((const char *const *)inlines,
-                        width, prefix, suffix, hang, last, min);
-    // if (*errmsg) goto parcleanup;
+  while (stdinput.end - stdinput.start < BATCHBYTES && fillinput(&stdinput))
+    ;
+  if (is_error())
+    goto parcleanup;
 
+  if (set.cache)
+  {
+    cache = newcache((size_t)set.cache * 1024);
     if (is_error())
       goto parcleanup;
-
-    freelines(inlines);
-    inlines = NULL;
-
-    for (line = outlines; *line; ++line)
-      puts(*line);
-
-    freelines(outlines);
-    outlines = NULL;
+    stdoutput.cache = cache;
   }
 
+  if (stdinput.eof || nprocs < 2 || set.window)
+    formatinput(&stdinput, &set, NULL, cache, &stdoutput);
+  else
+    formatparallel(nprocs, &set, cache);
+
 parcleanup:
 
-  if (picopy)
-    free(picopy);
-  if (inlines)
-    freelines(inlines);
-  if (outlines)
-    freelines(outlines);
+  flushoutput(&stdoutput);
+  if (stdinput.buf)
+    free(stdinput.buf);
+  freereformat();
+  if (cache)
+  {
+    cachestats(cache, &hits, &misses, &evictions);
+    freecache(cache);
+  }
+  if (set.cachestats)
+    fprintf(stderr, "%s: cache: %lu hits, %lu misses, %lu evictions\n", progname,
+            hits + pipeline.hits + files.hits,
+            misses + pipeline.misses + files.misses,
+            evictions + pipeline.evictions + files.evictions);
   // if (*errmsg) {
   //   fprintf(stderr, "%.163s", errmsg);
   //   exit(EXIT_FAILURE);
   // }
+  PROFREPORT(stderr);
   report_error(stderr);
 
   exit(EXIT_SUCCESS);
+
+version:
+
+  printf("%s %s\n", progname, version);
+  clear_error();
+  exit(EXIT_SUCCESS);
 }
@@ -0,0 +1,36 @@
+/*********************/
+/* prof.c            */
+/* for Par 3.20      */
+/*********************/
+
+/* This is ANSI C code. */
+
+#include "prof.h" /* Makes sure we're consistent with the declarations. */
+
+#ifdef BENCH
+
+#include <time.h>
+
+unsigned long long proftotals[NPHASES];
+
+unsigned long long profclock(void)
+{
+  struct timespec t;
+
+  clock_gettime(CLOCK_MONOTONIC, &t);
+  return t.tv_sec * 1000000000ULL + t.tv_nsec;
+}
+
+void profreport(FILE *f)
+{
+  static const char *const names[NPHASES] =
+      {"readlines", "setdefaults", "choosebreaks", "output"};
+  int i;
+
+  fprintf(f, "par: prof:");
+  for (i = 0; i < NPHASES; ++i)
+    fprintf(f, " %s %.3f", names[i], proftotals[i] / 1e6);
+  fprintf(f, "\n");
+}
+
+#endif
@@ -8,71 +8,272 @@
 /* This is ANSI C code. */
 
 #include "reformat.h" /* Makes sure we're consistent with the prototype. */
-#include "buffer.h"   /* Also includes <stddef.h>.                       */
+#include "arena.h"    /* Also includes <stddef.h>.                       */
+#include "buffer.h"
 #include "errmsg.h"
+#include "scan.h"
+#include "prof.h"
 
 #include <stdlib.h>
 #include <stdio.h>
 #include <ctype.h>
 #include <string.h>
+#include <pthread.h>
+#include <unistd.h>
 
 #undef NULL
 #define NULL ((void *)0)
 
-struct word
+/* The words of a paragraph are kept in parallel arrays indexed by word */
+/* number, rather than in a linked list of structures, so that each pass */
+/* of choosebreaks() walks only the arrays it needs. Index n stands for  */
+/* the end of the paragraph.                                             */
+
+struct words
 {
-  const char *chrs;  /* Pointer to the characters in the word */
-                     /* (NOT terminated by '\0').             */
-  struct word *prev, /* Pointer to previous word.             */
-      *next,         /* Pointer to next word.                 */
-                     /* Supposing this word were the first... */
-      *nextline;     /*   Pointer to first word in next line. */
-  int linelen,       /*   Length of the first line.           */
-      score,         /*   Value of objective function.        */
-      length;        /* Length of this word.                  */
+  int n;             /* The number of words.                         */
+  const char **chrs; /* Pointers to the characters in each word      */
+                     /* (NOT terminated by '\0').                    */
+  int *length,       /* Length of each word.                         */
+      *pos,          /* pos[i] is the sum of length[j] + 1 for j < i, */
+                     /* so words i..j-1 make a line pos[j]-pos[i]-1  */
+                     /* characters long.                             */
+                     /* Supposing word i were the first...           */
+      *nextline,     /*   Index of first word in next line.          */
+      *linelen,      /*   Length of the first line.                  */
+      *score;        /*   Value of objective function.               */
+  struct arena *scratch; /* The arena they are allocated from.       */
 };
 
-static int choosebreaks(
-    struct word *head, struct word *tail, int L, int last, int min)
-/* Chooses linebreaks in a list of struct words according to */
-/* the policy in "par.doc" (L is <L>, last is <last>, and    */
-/* min is <min>). head must point to a dummy word, and tail  */
-/* must point to the last word. Returns <newL>. Uses errmsg. */
+/* The suffix pointers, the word arrays and the output lines of a       */
+/* paragraph are allocated from a scratch arena, which is reset at the  */
+/* start of each call to reformatwith(), so the memory is reused from   */
+/* paragraph to paragraph instead of being returned to malloc() piece   */
+/* by piece. The words are first collected in two buffers, which are    */
+/* likewise kept from one call to the next. reformat() uses a store     */
+/* belonging to the calling thread.                                     */
+
+struct rfstore
 {
-  struct word *w1, *w2;
-  int linelen, shortest, newL, score, minlen, diff, sumsqdiff;
-  const char *const impossibility =
-      "Impossibility #%d has occurred. Please report it.\n";
+  struct arena *scratch;
+  struct buffer *wordchrs, *wordlens;
+};
+
+static __thread struct rfstore threadstore = {NULL, NULL, NULL};
+
+/* The last pass of choosebreaks() minimizes a sum of costs which are */
+/* convex in the length of each line, so the cost matrix is Monge and  */
+/* the best choice of next line never moves left as the first word of  */
+/* the line does. For paragraphs with many words per line, it is found */
+/* with a queue of candidate break points (in the manner of Galil and  */
+/* Park, or Hirschberg and Larmore) in O(n log n) time instead of      */
+/* trying every break point that fits, which is O(n * words per line). */
+/* Both methods make exactly the same choices.                         */
+
+#define QUEUEWORDS 1024 /* Minimum number of words in the paragraph. */
+#define QUEUELINE 16    /* Minimum number of words per line.         */
+
+static void sumsquares(struct words *words, int newL, int shortest, int last)
+
+/* Sets score[i] to the least sum of the squares of the differences  */
+/* between newL and the lengths of the lines, for the words from i   */
+/* on, or to -1 if they cannot be broken into lines between shortest */
+/* and newL long (except the last line, if last is 0). Sets          */
+/* nextline[i] and linelen[i] accordingly. Does not use errmsg.      */
+{
+  int n = words->n, i, j, linelen, score, minlen, diff, sumsqdiff;
+  const int *pos = words->pos;
+  int *nextline = words->nextline, *lens = words->linelen, *scores = words->score;
+
+  for (i = n - 1; i >= 0; --i)
+  {
+    scores[i] = -1;
+    for (j = i + 1; (linelen = pos[j] - pos[i] - 1) <= newL; ++j)
+    {
+      diff = newL - linelen;
+      minlen = shortest;
+      if (j < n)
+        score = scores[j];
+      else
+      {
+        score = 0;
+        if (!last)
+          diff = minlen = 0;
+      }
+      if (linelen >= minlen && score >= 0)
+      {
+        sumsqdiff = score + diff * diff;
+        if (scores[i] < 0 || sumsqdiff <= scores[i])
+        {
+          nextline[i] = j;
+          scores[i] = sumsqdiff;
+          lens[i] = linelen;
+        }
+      }
+      if (j == n)
+        break;
+    }
+  }
+}
+
+static int linefits(const struct words *words, int i, int j,
+                    int newL, int shortest, int last)
+
+/* Returns 1 if a line made of words i..j-1 is no longer than newL and */
+/* no shorter than shortest (a final line need not be if last is 0),   */
+/* 2 if it is too long, and 0 if it is too short.                      */
+{
+  int linelen = words->pos[j] - words->pos[i] - 1;
+
+  if (linelen > newL)
+    return 2;
+  if (linelen < shortest && (j < words->n || last))
+    return 0;
+  return 1;
+}
 
-  /* Determine maximum length of the shortest line: */
+static int linecost(const struct words *words, int i, int j, int newL, int last)
+
+/* Returns the score of breaking words i.. into lines with the first */
+/* line made of words i..j-1, which must fit.                        */
+{
+  int diff = newL - (words->pos[j] - words->pos[i] - 1);
+
+  if (j == words->n)
+    return last ? diff * diff : 0;
+  return words->score[j] + diff * diff;
+}
+
+static int beats(const struct words *words, int i, int a, int b,
+                 int newL, int shortest, int last)
+
+/* Returns 1 if, as the next line break after word i, a is strictly */
+/* better than b, where a < b. If neither fits, the answer does not */
+/* matter, but is chosen so that for fixed a and b it is 1 for all  */
+/* i up to some point and 0 above it.                               */
+{
+  int fa, fb;
+
+  fb = linefits(words, i, b, newL, shortest, last);
+  if (fb == 2)
+    return 1;
+  fa = linefits(words, i, a, newL, shortest, last);
+  if (fa != 1)
+    return 0;
+  if (fb != 1)
+    return 1;
+  return linecost(words, i, a, newL, last) < linecost(words, i, b, newL, last);
+}
+
+static void sumsquaresqueue(struct words *words, int newL, int shortest, int last)
+
+/* Does the same as sumsquares(), in O(n log n) time. The candidates */
+/* for the next line break are kept in a queue in decreasing order,  */
+/* each with the highest word number, top, for which it is the best  */
+/* choice. A new candidate is always the leftmost, and is the best   */
+/* choice for every word up to some point, which is found by binary  */
+/* search. Uses errmsg.                                              */
+{
+  int n = words->n, i, j, head, tail, lo, hi, mid, top;
+  int *nextline = words->nextline, *lens = words->linelen, *scores = words->score;
+  int *cand, *tops;
+
+  cand = arenaalloc(words->scratch, (n + 1) * sizeof(int));
+  if (is_error())
+    return;
+  tops = arenaalloc(words->scratch, (n + 1) * sizeof(int));
+  if (is_error())
+    return;
+
+  head = 0;
+  tail = -1;
+
+  for (i = n - 1; i >= 0; --i)
+  {
+
+    /* Add the break after word i as a candidate, unless the words */
+    /* which would follow it cannot be broken into lines at all:   */
+
+    j = i + 1;
+    if (j == n || scores[j] >= 0)
+    {
+      while (tail >= head &&
+             beats(words, tops[tail] < i ? tops[tail] : i, j, cand[tail],
+                   newL, shortest, last))
+        --tail;
+      if (tail < head)
+        top = i;
+      else
+      {
+        lo = -1;
+        hi = tops[tail] < i ? tops[tail] : i;
+        while (hi - lo > 1)
+        {
+          mid = lo + (hi - lo) / 2;
+          if (beats(words, mid, j, cand[tail], newL, shortest, last))
+            lo = mid;
+          else
+            hi = mid;
+        }
+        top = lo;
+      }
+      if (top >= 0)
+      {
+        cand[++tail] = j;
+        tops[tail] = top;
+      }
+    }
+
+    /* Drop candidates which are only best for later words: */
+
+    while (head < tail && tops[head + 1] >= i)
+      ++head;
+
+    scores[i] = -1;
+    if (tail >= head && linefits(words, i, cand[head], newL, shortest, last) == 1)
+    {
+      nextline[i] = cand[head];
+      scores[i] = linecost(words, i, cand[head], newL, last);
+      lens[i] = words->pos[cand[head]] - words->pos[i] - 1;
+    }
+  }
+}
+
+static int maxshortest(struct words *words, int L, int last)
+
+/* The first pass of choosebreaks(): sets score[i] to the greatest    */
+/* length the shortest line can have when the words from i on are     */
+/* broken into lines no longer than L (not counting the last line if  */
+/* last is 0), and returns score[0], or L if there are no words. Uses */
+/* errmsg.                                                            */
+{
+  int n = words->n, i, j, linelen, shortest;
+  const int *pos = words->pos;
+  int *nextline = words->nextline, *scores = words->score;
 
   /* Initialize words that could fit on the last line: */
 
-  for (w1 = tail, linelen = w1->length;
-       w1 != head && linelen <= L;
-       w1 = w1->prev, linelen += 1 + w1->length)
+  for (i = n - 1; i >= 0 && (linelen = pos[n] - pos[i] - 1) <= L; --i)
   {
-    w1->nextline = NULL;
-    w1->score = last ? linelen : L;
+    nextline[i] = n;
+    scores[i] = last ? linelen : L;
   }
 
   /* Then choose line breaks: */
 
-  for (; w1 != head; w1 = w1->prev)
+  for (; i >= 0; --i)
   {
-    w1->score = -1;
-    for (linelen = w1->length, w2 = w1->next;
-         linelen <= L;
-         linelen += 1 + w2->length, w2 = w2->next)
+    scores[i] = -1;
+    for (j = i + 1; (linelen = pos[j] - pos[i] - 1) <= L; ++j)
     {
-      shortest = linelen <= w2->score ? linelen : w2->score;
-      if (shortest > w1->score)
+      shortest = linelen <= scores[j] ? linelen : scores[j];
+      if (shortest > scores[i])
       {
-        w1->nextline = w2;
-        w1->score = shortest;
+        nextline[i] = j;
+        scores[i] = shortest;
       }
     }
-    if (w1->score < 0)
+    if (scores[i] < 0)
     {
       // sprintf(errmsg,impossibility,1);
       set_error("Impossibility #1 has occurred. Please report it.\n");
@@ -80,47 +281,264 @@ static int choosebreaks(
     }
   }
 
-  shortest = head->next ? head->next->score : L;
+  return n ? scores[0] : L;
+}
 
-  if (!min)
-    newL = L;
-  else
-  {
+static int minlongest(struct words *words, int L, int shortest, int last)
 
-    /* Determine the minimum possible longest line: */
+/* The second pass of choosebreaks() if <min> is 1: sets score[i] to    */
+/* the least length the longest line can have when the words from i on */
+/* are broken into lines no shorter than shortest (not counting the    */
+/* last line if last is 0), or to L + 1 if there is none no longer     */
+/* than L, and returns score[0], or 0 if there are no words. Does not   */
+/* use errmsg.                                                          */
+{
+  int n = words->n, i, j, linelen, newL, score, minlen;
+  const int *pos = words->pos;
+  int *nextline = words->nextline, *scores = words->score;
 
-    for (w1 = tail; w1 != head; w1 = w1->prev)
+  for (i = n - 1; i >= 0; --i)
+  {
+    scores[i] = L + 1;
+    for (j = i + 1; (linelen = pos[j] - pos[i] - 1) < scores[i]; ++j)
     {
-      w1->score = L + 1;
-      for (linelen = w1->length, w2 = w1->next;
-           linelen < w1->score;
-           linelen += 1 + w2->length, w2 = w2->next)
+      if (j < n)
       {
-        if (w2)
-        {
-          score = w2->score;
-          minlen = shortest;
-        }
-        else
-        {
-          score = 0;
-          minlen = last ? shortest : 0;
-        }
-        if (linelen >= minlen)
+        score = scores[j];
+        minlen = shortest;
+      }
+      else
+      {
+        score = 0;
+        minlen = last ? shortest : 0;
+      }
+      if (linelen >= minlen)
+      {
+        newL = linelen >= score ? linelen : score;
+        if (newL < scores[i])
         {
-          newL = linelen >= score ? linelen : score;
-          if (newL < w1->score)
-          {
-            w1->nextline = w2;
-            w1->score = newL;
-          }
+          nextline[i] = j;
+          scores[i] = newL;
         }
-        if (!w2)
-          break;
       }
+      if (j == n)
+        break;
+    }
+  }
+
+  return n ? scores[0] : 0;
+}
+
+static void sumsquaresany(struct words *words, int newL, int shortest, int last)
+
+/* The last pass of choosebreaks(), done by whichever of sumsquares() */
+/* and sumsquaresqueue() should be faster. Uses errmsg.               */
+{
+  int n = words->n;
+
+  if (n >= QUEUEWORDS &&
+      (long)newL * n >= (long)QUEUELINE * (words->pos[n] - words->pos[0]))
+    sumsquaresqueue(words, newL, shortest, last);
+  else
+    sumsquares(words, newL, shortest, last);
+}
+
+/* A paragraph of very many words, such as one long line of minified   */
+/* text, may be split into parts at forced breaks: between two words   */
+/* which do not fit on one line together, and so are never on the same */
+/* line. Every way of breaking the words before a forced break into     */
+/* lines ends with a line just before it, so each pass of               */
+/* choosebreaks() can be done on each part separately, treating the     */
+/* part as a paragraph whose last line is like any other. Only one      */
+/* number for each part matters to the rest: for the first pass, the    */
+/* shortest line of the whole is that of the part whose shortest line  */
+/* is shortest; for the second, the longest line is the longest of      */
+/* those of the parts; and the third adds the same score to every way  */
+/* of breaking the words before a forced break, so it makes the same    */
+/* choices within each part. The parts are done by threads, one pass   */
+/* at a time, and the result is exactly that of doing the whole at     */
+/* once.                                                                */
+
+#define PARTWORDS 65536 /* Minimum number of words in each part.  */
+#define MAXPARTS 64
+
+struct part
+{
+  struct words words; /* The words of the part, which share the arrays */
+                      /* of the paragraph, starting at word first.     */
+  int first, last, L, min, shortest, newL, pass, result;
+  char *err;          /* The error message, or NULL if none.          */
+};
+
+static void *dopart(void *arg)
+
+/* Does pass part->pass of choosebreaks() on *part, putting the number */
+/* it yields in part->result. Does not use errmsg, because the error   */
+/* is kept with the part.                                              */
+{
+  struct part *part = arg;
+  struct words *words = &part->words;
+  int i;
+
+  clear_error();
+  if (part->pass == 1)
+    part->result = maxshortest(words, part->L, part->last);
+  else if (part->pass == 2)
+    part->result = minlongest(words, part->L, part->shortest, part->last);
+  else
+  {
+    words->scratch = newarena();
+    if (!is_error())
+    {
+      sumsquaresany(words, part->newL, part->shortest, part->last);
+      freearena(words->scratch);
     }
+    words->scratch = NULL;
+    part->result = words->n ? words->score[0] : 0;
+    for (i = 0; i < words->n; ++i)
+      words->nextline[i] += part->first;
+  }
+  part->err = take_error();
+  return NULL;
+}
+
+static int dopass(struct part *parts, int nparts, int pass)
+
+/* Does pass pass on each of the nparts parts, with a thread for */
+/* each but the first. Returns 0 on success, or sets errmsg to  */
+/* the error of the first part which failed and returns -1.      */
+{
+  pthread_t threads[MAXPARTS];
+  int started[MAXPARTS], i;
+
+  for (i = 0; i < nparts; ++i)
+  {
+    parts[i].pass = pass;
+    started[i] = i && !pthread_create(&threads[i], NULL, dopart, &parts[i]);
+  }
+  dopart(&parts[0]);
+  for (i = 1; i < nparts; ++i)
+    if (started[i])
+      pthread_join(threads[i], NULL);
+    else
+      dopart(&parts[i]);
+
+  for (i = 0; i < nparts; ++i)
+    if (parts[i].err)
+      break;
+  if (i < nparts)
+    set_error(parts[i].err);
+  for (i = 0; i < nparts; ++i)
+  {
+    free(parts[i].err);
+    parts[i].err = NULL;
+  }
+  return is_error() ? -1 : 0;
+}
 
-    newL = head->next ? head->next->score : 0;
+static int splitparts(const struct words *words, int L, int last,
+                      struct part *parts)
+
+/* Splits *words into parts at forced breaks, putting them in parts, */
+/* and returns how many there are, which is 1 if it is not worth it. */
+/* Does not use errmsg.                                              */
+{
+  int n = words->n, nparts, target, k, start;
+  long nprocs;
+  const int *pos = words->pos;
+  struct part *part;
+
+  nprocs = sysconf(_SC_NPROCESSORS_ONLN);
+  if (nprocs > MAXPARTS)
+    nprocs = MAXPARTS;
+  target = n / (nprocs > 1 ? nprocs : 1);
+  if (target < PARTWORDS)
+    target = PARTWORDS;
+
+  for (nparts = 0, start = 0; start < n; ++nparts)
+  {
+    part = &parts[nparts];
+    part->words = *words;
+    part->first = start;
+    part->last = 1;
+    for (k = start + target; k < n && pos[k + 1] - pos[k - 1] - 1 <= L; ++k)
+      ;
+    if (nparts == MAXPARTS - 1 || k >= n)
+    {
+      k = n;
+      part->last = last;
+    }
+    part->words.n = k - start;
+    part->words.chrs += start;
+    part->words.length += start;
+    part->words.pos += start;
+    part->words.nextline += start;
+    part->words.linelen += start;
+    part->words.score += start;
+    part->err = NULL;
+    start = k;
+  }
+
+  return nparts;
+}
+
+static int choosebreaks(struct words *words, int L, int last, int min)
+
+/* Chooses linebreaks in *words according to the policy in  */
+/* "par.doc" (L is <L>, last is <last>, and min is <min>).   */
+/* Fills in the nextline, linelen and score arrays, though  */
+/* if the words are split into parts, score[i] is only that */
+/* of the part word i is in. Returns <newL>. Uses errmsg.   */
+{
+  int n = words->n, i, shortest, newL, nparts = 1;
+  int *scores = words->score;
+  struct part parts[MAXPARTS];
+  const char *const impossibility =
+      "Impossibility #%d has occurred. Please report it.\n";
+
+  if (n >= 2 * PARTWORDS)
+    nparts = splitparts(words, L, last, parts);
+
+  if (nparts > 1)
+  {
+    for (i = 0; i < nparts; ++i)
+      parts[i].L = L;
+    if (dopass(parts, nparts, 1))
+      return 0;
+    shortest = L;
+    for (i = 0; i < nparts; ++i)
+      if (parts[i].result < shortest)
+        shortest = parts[i].result;
+  }
+  else
+  {
+
+    /* Determine maximum length of the shortest line: */
+
+    shortest = maxshortest(words, L, last);
+    if (is_error())
+      return 0;
+  }
+
+  if (!min)
+    newL = L;
+  else
+  {
+
+    /* Determine the minimum possible longest line: */
+
+    if (nparts > 1)
+    {
+      for (i = 0; i < nparts; ++i)
+        parts[i].shortest = shortest;
+      dopass(parts, nparts, 2);
+      newL = 0;
+      for (i = 0; i < nparts; ++i)
+        if (parts[i].result > newL)
+          newL = parts[i].result;
+    }
+    else
+      newL = minlongest(words, L, shortest, last);
     if (newL > L)
     {
       // sprintf(errmsg,impossibility,2);
@@ -132,39 +550,27 @@ static int choosebreaks(
   /* Minimize the sum of the squares of the differences */
   /* between newL and the lengths of the lines:         */
 
-  for (w1 = tail; w1 != head; w1 = w1->prev)
+  if (nparts > 1)
   {
-    w1->score = -1;
-    for (linelen = w1->length, w2 = w1->next;
-         linelen <= newL;
-         linelen += 1 + w2->length, w2 = w2->next)
+    for (i = 0; i < nparts; ++i)
     {
-      diff = newL - linelen;
-      minlen = shortest;
-      if (w2)
-        score = w2->score;
-      else
-      {
-        score = 0;
-        if (!last)
-          diff = minlen = 0;
-      }
-      if (linelen >= minlen && score >= 0)
-      {
-        sumsqdiff = score + diff * diff;
-        if (w1->score < 0 || sumsqdiff <= w1->score)
-        {
-          w1->nextline = w2;
-          w1->score = sumsqdiff;
-          w1->linelen = linelen;
-        }
-      }
-      if (!w2)
-        break;
+      parts[i].shortest = shortest;
+      parts[i].newL = newL;
     }
+    if (dopass(parts, nparts, 3))
+      return 0;
+    for (i = 0; i < nparts; ++i)
+      if (parts[i].result < 0)
+        scores[0] = -1;
+  }
+  else
+  {
+    sumsquaresany(words, newL, shortest, last);
+    if (is_error())
+      return 0;
   }
 
-  if (head->next && head->next->score < 0)
+  if (n && scores[0] < 0)
   {
     // sprintf(errmsg,impossibility,3);
     set_error("Impossibility #3 has occurred. Please report it.\n");
@@ -176,21 +582,88 @@ static int choosebreaks(
   return newL;
 }
 
+static void emptyrfstore(struct rfstore *store)
+
+/* Frees the contents of *store. Does not use errmsg. */
+{
+  if (store->scratch)
+    freearena(store->scratch);
+  if (store->wordchrs)
+    freebuffer(store->wordchrs);
+  if (store->wordlens)
+    freebuffer(store->wordlens);
+  store->scratch = NULL;
+  store->wordchrs = store->wordlens = NULL;
+}
+
+struct rfstore *newrfstore(void)
+{
+  struct rfstore *store;
+
+  store = calloc(1, sizeof(struct rfstore));
+  if (!store)
+    set_error(outofmem);
+  return store;
+}
+
+void freerfstore(struct rfstore *store)
+{
+  emptyrfstore(store);
+  free(store);
+}
+
 char **reformat(const char *const *inlines, int width,
                 int prefix, int suffix, int hang, int last, int min)
 {
-  int numin, numout, affix, L, linelen, newL;
+  return reformatwith(&threadstore, inlines,
+                      width, prefix, suffix, hang, last, min);
+}
+
+static int layout(struct rfstore *store, const char *const *inlines,
+                  int width, int prefix, int suffix, int last, int min,
+                  struct words *pwords, const char ***psuffixes)
+
+/* Does the work common to reformatwith() and reformatspans(): finds   */
+/* the words of inlines and the suffixes of its lines, which it puts   */
+/* in *pwords and *psuffixes (using the storage in *store), and        */
+/* chooses the line breaks. Returns <newL>. Uses errmsg.               */
+{
+  int numin, affix, L, newL, i, length;
   const char *const *line, **suffixes = NULL, **suf, *end, *p1, *p2;
-  char *q1, *q2, **outlines = NULL;
-  struct word dummy, *head, *tail, *w1, *w2;
-  struct buffer *pbuf = NULL;
+  struct arena *scratch;
+  struct buffer *wordchrs, *wordlens;
+  struct words words;
+  struct scan scan;
 
   /* Initialization: */
 
   // *errmsg = '\0';
   clear_error();
-  dummy.next = dummy.prev = NULL;
-  head = tail = &dummy;
+
+  if (!store->scratch)
+  {
+    store->scratch = newarena();
+    if (is_error())
+      return 0;
+  }
+  if (!store->wordchrs)
+  {
+    store->wordchrs = newbuffer(sizeof(const char *));
+    if (is_error())
+      return 0;
+  }
+  if (!store->wordlens)
+  {
+    store->wordlens = newbuffer(sizeof(int));
+    if (is_error())
+      return 0;
+  }
+  scratch = store->scratch;
+  wordchrs = store->wordchrs;
+  wordlens = store->wordlens;
+  resetarena(scratch);
+  clearbuffer(wordchrs);
+  clearbuffer(wordlens);
 
   /* Count the input lines: */
 
@@ -202,13 +675,9 @@ char **reformat(const char *const *inlines, int width,
 
   if (numin)
   {
-    suffixes = calloc(numin, sizeof(const char *));
-    if (!suffixes)
-    {
-      // strcpy(errmsg,outofmem);
-      set_error(outofmem);
-      goto rfcleanup;
-    }
+    suffixes = arenaalloc(scratch, numin * sizeof(const char *));
+    if (is_error())
+      return 0;
   }
 
   /* Set the pointers to the suffixes, and create the words: */
@@ -232,90 +701,126 @@ char **reformat(const char *const *inlines, int width,
       fflush(f);
       fclose(f);
       set_error(s);
+      free(s);
       // snprintf(str, 200, "Line %ld shorter than <prefix> + <suffix> = %d + %d = %d\n",
       //          line - inlines + 1, prefix, suffix, affix);
       // set_error(str);
       // sprintf(errmsg,
       //         "Line %ld shorter than <prefix> + <suffix> = %d + %d = %d\n",
       //         line - inlines + 1, prefix, suffix, affix);
-      goto rfcleanup;
+      return 0;
     }
     end -= suffix;
     *suf = end;
     p1 = *line + prefix;
+    startscan(&scan, p1, end);
     for (;;)
     {
-      while (p1 < end && isspace(*p1))
-        ++p1;
+      p1 = scanspaces(&scan, p1);
       if (p1 == end)
         break;
-      p2 = p1;
-      while (p2 < end && !isspace(*p2))
-        ++p2;
+      p2 = scanword(&scan, p1);
       if (p2 - p1 > L)
         p2 = p1 + L;
-      w1 = calloc(1, sizeof(struct word));
-      if (!w1)
-      {
-        // strcpy(errmsg,outofmem);
-        set_error(outofmem);
-        goto rfcleanup;
-      }
-      w1->next = NULL;
-      w1->prev = tail;
-      tail = tail->next = w1;
-      w1->chrs = p1;
-      w1->length = p2 - p1;
+      additem(wordchrs, &p1);
+      if (is_error())
+        return 0;
+      length = p2 - p1;
+      additem(wordlens, &length);
+      if (is_error())
+        return 0;
       p1 = p2;
     }
   }
 
+  words.n = numitems(wordchrs);
+  words.scratch = scratch;
+  words.chrs = bufferitems(wordchrs);
+  words.length = bufferitems(wordlens);
+
   /* Expand first word if preceeded only by spaces: */
 
-  w1 = head->next;
-  if (w1)
+  if (words.n)
   {
     p1 = *inlines + prefix;
     for (p2 = p1; isspace(*p2); ++p2)
       ;
-    if (w1->chrs == p2)
+    if (words.chrs[0] == p2)
     {
-      w1->chrs = p1;
-      w1->length += p2 - p1;
+      words.chrs[0] = p1;
+      words.length[0] += p2 - p1;
     }
   }
 
+  /* Lay out the arrays used to choose the line breaks: */
+
+  words.pos = arenaalloc(scratch, (words.n + 1) * sizeof(int));
+  if (is_error())
+    return 0;
+  words.nextline = arenaalloc(scratch, (words.n + 1) * sizeof(int));
+  if (is_error())
+    return 0;
+  words.linelen = arenaalloc(scratch, (words.n + 1) * sizeof(int));
+  if (is_error())
+    return 0;
+  words.score = arenaalloc(scratch, (words.n + 1) * sizeof(int));
+  if (is_error())
+    return 0;
+
+  for (i = 0; i < words.n; ++i)
+    words.pos[i + 1] = words.pos[i] + words.length[i] + 1;
+
   /* Choose line breaks according to policy in "par.doc": */
 
-  newL = choosebreaks(head, tail, L, last, min);
+  PROFSTART(t);
+  newL = choosebreaks(&words, L, last, min);
+  PROFEND(PROF_CHOOSEBREAKS, t);
+
+  *pwords = words;
+  *psuffixes = suffixes;
+  return newL;
+}
+
+
+char **reformatwith(struct rfstore *store, const char *const *inlines,
+                    int width, int prefix, int suffix, int hang, int last, int min)
+{
+  int numin, numout, affix, linelen, newL, i, j;
+  const char *const *line, **suffixes;
+  char *q1, *q2, **outlines = NULL;
+  struct words words;
+
+  newL = layout(store, inlines, width, prefix, suffix, last, min,
+                &words, &suffixes);
   if (is_error())
     goto rfcleanup;
   // if (*errmsg) goto rfcleanup;
 
+  for (line = inlines; *line; ++line)
+    ;
+  numin = line - inlines;
+  affix = prefix + suffix;
+
   /* Construct the lines: */
 
-  pbuf = newbuffer(sizeof(char *));
-  // if (*errmsg) goto rfcleanup;
+  for (numout = 0, i = 0; numout < hang || i < words.n; ++numout)
+    if (i < words.n)
+      i = words.nextline[i];
+
+  outlines = arenaalloc(words.scratch, (numout + 1) * sizeof(char *));
   if (is_error())
     goto rfcleanup;
 
   numout = 0;
-  w1 = head->next;
-  while (numout < hang || w1)
+  i = 0;
+  while (numout < hang || i < words.n)
   {
-    linelen = suffix ? newL + affix : w1 ? w1->linelen + prefix
-                                         : prefix;
-    q1 = calloc((linelen + 1), sizeof(char));
-    if (!q1)
-    {
-      // strcpy(errmsg,outofmem);
-      set_error(outofmem);
-      goto rfcleanup;
-    }
-    additem(pbuf, &q1);
-    // if (*errmsg) goto rfcleanup;
+    linelen = suffix ? newL + affix : i < words.n ? words.linelen[i] + prefix
+                                                  : prefix;
+    q1 = arenaalloc(words.scratch, linelen + 1);
     if (is_error())
       goto rfcleanup;
+    outlines[numout] = q1;
     ++numout;
     q2 = q1 + prefix;
     if (numout <= numin)
@@ -326,13 +831,12 @@ char **reformat(const char *const *inlines, int width,
       while (q1 < q2)
         *q1++ = ' ';
     q1 = q2;
-    if (w1)
-      for (w2 = w1;;)
+    if (i < words.n)
+      for (j = i;;)
       {
-        memcpy(q1, w2->chrs, w2->length);
-        q1 += w2->length;
-        w2 = w2->next;
-        if (w2 == w1->nextline)
+        memcpy(q1, words.chrs[j], words.length[j]);
+        q1 += words.length[j];
+        if (++j == words.nextline[i])
           break;
         *q1++ = ' ';
       }
@@ -348,41 +852,98 @@ char **reformat(const char *const *inlines, int width,
       while (q1 < q2)
         *q1++ = ' ';
     *q2 = '\0';
-    if (w1)
-      w1 = w1->nextline;
+    if (i < words.n)
+      i = words.nextline[i];
   }
 
-  q1 = NULL;
-  additem(pbuf, &q1);
-  // if (*errmsg) goto rfcleanup;
-  if (is_error())
-    goto rfcleanup;
-
-  outlines = copyitems(pbuf);
+  outlines[numout] = NULL;
+  return outlines;
 
 rfcleanup:
 
-  if (suffixes)
-    free(suffixes);
+  return NULL;
+}
 
-  while (tail != head)
-  {
-    tail = tail->prev;
-    free(tail->next);
-  }
+/* A run of spaces longer than this is passed to emit in pieces: */
+
+static const char spaces[] = "                                ";
+#define NSPACES ((int)sizeof spaces - 1)
+
+static void emitspaces(int n, rfemit emit, void *arg)
+
+/* Passes n spaces to emit. Does not use errmsg. */
+{
+  for (; n > NSPACES; n -= NSPACES)
+    emit(arg, spaces, NSPACES);
+  if (n > 0)
+    emit(arg, spaces, n);
+}
+
+int reformatspans(struct rfstore *store, const char *const *inlines,
+                  int width, int prefix, int suffix, int hang, int last, int min,
+                  rfemit emit, void *arg)
+{
+  int numin, numout, newL, pad, i, j, k;
+  const char *const *line, **suffixes, *p;
+  struct words words;
+
+  if (!store)
+    store = &threadstore;
+
+  newL = layout(store, inlines, width, prefix, suffix, last, min,
+                &words, &suffixes);
+  if (is_error())
+    return -1;
+
+  for (line = inlines; *line; ++line)
+    ;
+  numin = line - inlines;
 
-  if (pbuf)
+  for (numout = 0, i = 0; numout < hang || i < words.n; )
   {
-    if (!outlines)
-      for (;;)
+    ++numout;
+    if (numout <= numin)
+      emit(arg, inlines[numout - 1], prefix);
+    else if (numin > hang)
+      emit(arg, inlines[numin - 1], prefix);
+    else
+      emitspaces(prefix, emit, arg);
+
+    /* Words which are separated by a single space in the input */
+    /* as well are passed together:                             */
+
+    pad = suffix ? newL : 0;
+    if (i < words.n)
+    {
+      for (j = i; j < words.nextline[i]; j = k)
       {
-        outlines = nextitem(pbuf);
-        if (!outlines)
-          break;
-        free(*outlines);
+        p = words.chrs[j] + words.length[j];
+        for (k = j + 1; k < words.nextline[i] && *p == ' ' && words.chrs[k] == p + 1; ++k)
+          p = words.chrs[k] + words.length[k];
+        if (j > i)
+          emit(arg, spaces, 1);
+        emit(arg, words.chrs[j], p - words.chrs[j]);
       }
-    freebuffer(pbuf);
+      pad -= suffix ? words.linelen[i] : 0;
+    }
+    emitspaces(pad, emit, arg);
+
+    if (numout <= numin)
+      emit(arg, suffixes[numout - 1], suffix);
+    else if (numin)
+      emit(arg, suffixes[numin - 1], suffix);
+    else
+      emitspaces(suffix, emit, arg);
+    emit(arg, "\n", 1);
+
+    if (i < words.n)
+      i = words.nextline[i];
   }
 
-  return outlines;
+  return 0;
+}
+
+void freereformat(void)
+{
+  emptyrfstore(&threadstore);
 }
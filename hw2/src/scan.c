@@ -0,0 +1,270 @@
+/*********************/
+/* scan.c            */
+/* for Par 3.20      */
+/*********************/
+
+/* This is ANSI C code, except that where the compiler is GCC or one */
+/* compatible with it on x86, it uses SSE2 intrinsics, and AVX2 ones */
+/* when the processor it runs on turns out to support them. Define   */
+/* NOSIMD to use the plain C versions everywhere.                    */
+
+#include "scan.h" /* Makes sure we're consistent with the prototypes. */
+
+#include <string.h>
+
+#undef NULL
+#define NULL ((void *)0)
+
+#if defined(__GNUC__) && defined(__SSE2__) && !defined(NOSIMD)
+#define SCANSSE2
+#include <immintrin.h>
+#define avx2() __builtin_cpu_supports("avx2")
+#define AVX2 __attribute__((target("avx2")))
+#endif
+
+#define BLOCK 64 /* The number of characters classified at once. */
+
+typedef unsigned long long mask;
+
+
+static int isspacec(char c)
+
+/* Returns isspace(c) in the "C" locale: true for ' ' and '\t' through */
+/* '\r', and for nothing else, even characters with the high bit set.   */
+{
+  return c == ' ' || (unsigned char)(c - '\t') <= '\r' - '\t';
+}
+
+
+static mask scalarmask(const char *p)
+{
+  mask m = 0;
+  int i;
+
+  for (i = 0; i < BLOCK; ++i)
+    if (isspacec(p[i]))
+      m |= (mask)1 << i;
+
+  return m;
+}
+
+#ifdef SCANSSE2
+
+/* The SIMD versions use the same test as isspacec(): a character c is */
+/* a space if it equals ' ', or if c - '\t' is at most '\r' - '\t' as  */
+/* an unsigned byte, which holds when min(c - '\t', 4) equals itself.  */
+
+static mask sse2mask(const char *p)
+{
+  const __m128i blank = _mm_set1_epi8(' '), tab = _mm_set1_epi8('\t'),
+                range = _mm_set1_epi8('\r' - '\t');
+  __m128i c, d;
+  mask m = 0;
+  int i;
+
+  for (i = 0; i < BLOCK; i += 16)
+  {
+    c = _mm_loadu_si128((const __m128i *)(p + i));
+    d = _mm_sub_epi8(c, tab);
+    c = _mm_or_si128(_mm_cmpeq_epi8(c, blank),
+                     _mm_cmpeq_epi8(_mm_min_epu8(d, range), d));
+    m |= (mask)(unsigned)_mm_movemask_epi8(c) << i;
+  }
+
+  return m;
+}
+
+AVX2 static mask avx2mask(const char *p)
+{
+  const __m256i blank = _mm256_set1_epi8(' '), tab = _mm256_set1_epi8('\t'),
+                range = _mm256_set1_epi8('\r' - '\t');
+  __m256i c, d;
+  mask m = 0;
+  int i;
+
+  for (i = 0; i < BLOCK; i += 32)
+  {
+    c = _mm256_loadu_si256((const __m256i *)(p + i));
+    d = _mm256_sub_epi8(c, tab);
+    c = _mm256_or_si256(_mm256_cmpeq_epi8(c, blank),
+                        _mm256_cmpeq_epi8(_mm256_min_epu8(d, range), d));
+    m |= (mask)(unsigned)_mm256_movemask_epi8(c) << i;
+  }
+
+  return m;
+}
+
+#endif
+
+
+static mask spacemask(const char *p, const char *end)
+
+/* Returns a mask with bit i set if p[i] is a space or p + i >= end. */
+/* Only the characters before end are read.                          */
+{
+  char pad[BLOCK];
+
+  if (end - p < BLOCK)
+  {
+    memset(pad, ' ', BLOCK);
+    memcpy(pad, p, end - p);
+    p = pad;
+  }
+
+#ifdef SCANSSE2
+  if (avx2())
+    return avx2mask(p);
+  return sse2mask(p);
+#else
+  return scalarmask(p);
+#endif
+}
+
+
+void startscan(struct scan *s, const char *p, const char *end)
+{
+  s->block = p;
+  s->end = end;
+  s->mask = p < end ? spacemask(p, end) : ~(mask)0;
+}
+
+
+static const char *scanfor(struct scan *s, const char *p, mask flip)
+
+/* Does the work of scanspaces() (with flip all ones, so that the bits */
+/* set are those of non-spaces) and scanword() (with flip zero).       */
+{
+  mask m;
+
+  for (;;)
+  {
+    if (p >= s->end)
+      return s->end;
+    if (p < s->block || p - s->block >= BLOCK)
+    {
+      s->block = p;
+      s->mask = spacemask(p, s->end);
+    }
+    m = (s->mask ^ flip) >> (p - s->block);
+    if (m)
+    {
+      p += __builtin_ctzll(m);
+      return p < s->end ? p : s->end;
+    }
+    p = s->block + BLOCK;
+  }
+}
+
+
+const char *scanspaces(struct scan *s, const char *p)
+{
+  return scanfor(s, p, ~(mask)0);
+}
+
+
+const char *scanword(struct scan *s, const char *p)
+{
+  return scanfor(s, p, 0);
+}
+
+
+#ifdef SCANSSE2
+
+static size_t sse2prefix(const char *a, const char *b, size_t n)
+{
+  size_t i;
+  unsigned eq;
+
+  for (i = 0; i + 16 <= n; i += 16)
+  {
+    eq = _mm_movemask_epi8(
+        _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)(a + i)),
+                       _mm_loadu_si128((const __m128i *)(b + i))));
+    if (eq != 0xffff)
+      return i + __builtin_ctz(~eq);
+  }
+
+  return i;
+}
+
+AVX2 static size_t avx2prefix(const char *a, const char *b, size_t n)
+{
+  size_t i;
+  unsigned eq;
+
+  for (i = 0; i + 32 <= n; i += 32)
+  {
+    eq = _mm256_movemask_epi8(
+        _mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i *)(a + i)),
+                          _mm256_loadu_si256((const __m256i *)(b + i))));
+    if (eq != 0xffffffff)
+      return i + __builtin_ctz(~eq);
+  }
+
+  return i;
+}
+
+static size_t sse2suffix(const char *aend, const char *bend, size_t n)
+{
+  size_t i;
+  unsigned ne;
+
+  for (i = 0; i + 16 <= n; i += 16)
+  {
+    ne = ~_mm_movemask_epi8(
+        _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)(aend - i - 16)),
+                       _mm_loadu_si128((const __m128i *)(bend - i - 16))));
+    ne &= 0xffff;
+    if (ne)
+      return i + __builtin_clz(ne) - 16;
+  }
+
+  return i;
+}
+
+AVX2 static size_t avx2suffix(const char *aend, const char *bend, size_t n)
+{
+  size_t i;
+  unsigned ne;
+
+  for (i = 0; i + 32 <= n; i += 32)
+  {
+    ne = ~_mm256_movemask_epi8(
+        _mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i *)(aend - i - 32)),
+                          _mm256_loadu_si256((const __m256i *)(bend - i - 32))));
+    if (ne)
+      return i + __builtin_clz(ne);
+  }
+
+  return i;
+}
+
+#endif
+
+
+size_t commonprefix(const char *a, const char *b, size_t n)
+{
+  size_t i = 0;
+
+#ifdef SCANSSE2
+  i = avx2() ? avx2prefix(a, b, n) : sse2prefix(a, b, n);
+#endif
+  while (i < n && a[i] == b[i])
+    ++i;
+
+  return i;
+}
+
+
+size_t commonsuffix(const char *aend, const char *bend, size_t n)
+{
+  size_t i = 0;
+
+#ifdef SCANSSE2
+  i = avx2() ? avx2suffix(aend, bend, n) : sse2suffix(aend, bend, n);
+#endif
+  while (i < n && aend[-1 - (long)i] == bend[-1 - (long)i])
+    ++i;
+
+  return i;
+}
@@ -0,0 +1,161 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <criterion/criterion.h>
+#include <criterion/logging.h>
+
+#include "libpar.h"
+
+/*
+ * A par_writer which appends the output to a '\0'-terminated string.
+ */
+struct text {
+    char *s;
+    size_t n;
+};
+
+static int append(void *arg, const char *s, size_t n) {
+    struct text *t = arg;
+    t->s = realloc(t->s, t->n + n + 1);
+    memcpy(t->s + t->n, s, n);
+    t->n += n;
+    t->s[t->n] = '\0';
+    return 0;
+}
+
+static int fail(void *arg, const char *s, size_t n) {
+    return 1;
+}
+
+static char *format(struct parctx *ctx, const char *in, int *status) {
+    struct text t = {calloc(1, 1), 0};
+    *status = par_format(ctx, in, strlen(in), append, &t);
+    return t.s;
+}
+
+/*
+ * Reformat two paragraphs with options given as in PARINIT, and check
+ * that the blank lines between them are kept.
+ */
+Test(libpar_suite, format_test) {
+    struct parctx *ctx = par_newctx();
+    int status;
+    cr_assert_not_null(ctx);
+    cr_assert_eq(par_setoptions(ctx, "-w 20"), 0);
+    char *out = format(ctx, "one two three four five six\n\n\nseven\n", &status);
+    cr_assert_eq(status, 0);
+    cr_assert_null(par_error(ctx));
+    cr_assert_str_eq(out, "one two three four\nfive six\n\n\nseven\n");
+    free(out);
+    par_freectx(ctx);
+}
+
+/*
+ * A bad option is reported through the context, which keeps its
+ * previous options.
+ */
+Test(libpar_suite, bad_option_test) {
+    struct parctx *ctx = par_newctx();
+    int status;
+    cr_assert_eq(par_setoptions(ctx, "--window 10000"), 0);
+    cr_assert_eq(par_setoptions(ctx, "--window foo"), -1);
+    cr_assert_str_eq(par_error(ctx), "Bad Option: 'foo'\n");
+    cr_assert_eq(par_setoptions(ctx, "--cache 20000"), 0);
+    cr_assert_eq(par_setoptions(ctx, "--cache=20k"), -1);
+    cr_assert_str_eq(par_error(ctx), "Bad Option: '--cache=20k'\n");
+    cr_assert_eq(par_setoptions(ctx, "-w 20"), 0);
+    cr_assert_eq(par_setoptions(ctx, "-w 30 bogus"), -1);
+    cr_assert_str_eq(par_error(ctx), "Bad Option: 'bogus'\n");
+    cr_assert_eq(par_setoptions(ctx, "--version"), -1);
+    char *out = format(ctx, "one two three four five six\n", &status);
+    cr_assert_eq(status, 0);
+    cr_assert_str_eq(out, "one two three four\nfive six\n");
+    free(out);
+    par_freectx(ctx);
+}
+
+/*
+ * A paragraph which cannot be reformatted makes par_format() fail
+ * without exiting, after delivering the paragraphs before it.
+ */
+Test(libpar_suite, format_error_test) {
+    struct parctx *ctx = par_newctx();
+    int status;
+    cr_assert_eq(par_setoptions(ctx, "-w 10 -p 6 -s 6"), 0);
+    char *out = format(ctx, "\nword\n", &status);
+    cr_assert_eq(status, -1);
+    cr_assert_str_eq(out, "\n");
+    cr_assert_str_eq(par_error(ctx),
+                     "<width> = 10 shorter than <prefix> + <suffix> = 6 + 6 = 12\n");
+    free(out);
+    cr_assert_eq(par_setoptions(ctx, ""), 0);
+    out = format(ctx, "word\n", &status);
+    cr_assert_eq(status, 0);
+    cr_assert_str_eq(out, "word\n");
+    free(out);
+    par_freectx(ctx);
+}
+
+/*
+ * A failing par_writer makes par_format() fail.
+ */
+Test(libpar_suite, output_error_test) {
+    struct parctx *ctx = par_newctx();
+    cr_assert_eq(par_format(ctx, "word\n", 5, fail, NULL), -1);
+    cr_assert_str_eq(par_error(ctx), "Output error.\n");
+    par_freectx(ctx);
+}
+
+/*
+ * With a cache, a repeated paragraph is found in it, and comes out
+ * the same as the first time.
+ */
+Test(libpar_suite, cache_test) {
+    struct parctx *ctx = par_newctx();
+    unsigned long hits, misses, evictions;
+    int status;
+    cr_assert_eq(par_setoptions(ctx, "-w 20 --cache 64"), 0);
+    char *first = format(ctx, "one two three four five six\n", &status);
+    char *second = format(ctx, "one two three four five six\n", &status);
+    cr_assert_eq(status, 0);
+    cr_assert_str_eq(second, first);
+    par_cachestats(ctx, &hits, &misses, &evictions);
+    cr_assert_eq(hits, 1);
+    cr_assert_eq(misses, 1);
+    cr_assert_eq(evictions, 0);
+    free(first);
+    free(second);
+    par_freectx(ctx);
+}
+
+/*
+ * After an edit, par_reflow() reformats only the paragraph which
+ * changed, and its output is the same as that of par_format().
+ */
+Test(libpar_suite, reflow_test) {
+    struct parctx *ctx = par_newctx();
+    struct text t = {calloc(1, 1), 0};
+    unsigned long reused, reformatted;
+    int status;
+    char doc[] = "one two three four five six\n\nseven eight\n\nnine ten eleven\n";
+    cr_assert_eq(par_setoptions(ctx, "-w 20"), 0);
+    cr_assert_eq(par_reflow(ctx, doc, strlen(doc), append, &t), 0);
+    par_reflowstats(ctx, &reused, &reformatted);
+    cr_assert_eq(reused, 0);
+    cr_assert_eq(reformatted, 3);
+    free(t.s);
+
+    doc[29] = 'S';
+    t.s = calloc(1, 1);
+    t.n = 0;
+    cr_assert_eq(par_reflow(ctx, doc, strlen(doc), append, &t), 0);
+    par_reflowstats(ctx, &reused, &reformatted);
+    cr_assert_eq(reused, 2);
+    cr_assert_eq(reformatted, 1);
+    char *expected = format(ctx, doc, &status);
+    cr_assert_str_eq(t.s, expected);
+    free(expected);
+    free(t.s);
+    par_freectx(ctx);
+}
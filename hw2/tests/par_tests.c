@@ -0,0 +1,399 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <signal.h>
+#include <arpa/inet.h>
+#include <sys/prctl.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+
+#include <criterion/criterion.h>
+#include <criterion/logging.h>
+
+#include "test_common.h"
+
+/*
+ * Tests which run bin/par on input made up for them, and compare what it
+ * does with what it does otherwise, or with what it did before.
+ */
+
+static char *read_file(char *path, size_t *len) {
+    FILE *f = fopen(path, "r");
+    cr_assert_not_null(f, "Could not open %s.\n", path);
+    char *s = NULL;
+    size_t size = 0;
+    *len = 0;
+    do {
+        size = size ? 2 * size : 4096;
+        s = realloc(s, size + 1);
+        *len += fread(s + *len, 1, size - *len, f);
+    } while (*len == size);
+    s[*len] = '\0';
+    fclose(f);
+    return s;
+}
+
+/*
+ * Run bin/par with options on the file in and return its output.
+ */
+static char *par_output(char *options, char *in, size_t *len) {
+    char cmd[1000], out[200];
+    sprintf(out, "%s/expected.out", TEST_OUTPUT_DIR);
+    sprintf(cmd, "mkdir -p %s; " PROGNAME " %s < %s > %s 2> /dev/null",
+            TEST_OUTPUT_DIR, options, in, out);
+    system(cmd);
+    return read_file(out, len);
+}
+
+/*
+ * --serve: requests are framed as a length and the options, then a length
+ * and the text, and each gets a status and a length followed by the output
+ * or the error message.
+ */
+
+#define SERVE_SOCKET TEST_OUTPUT_DIR "/serve.sock"
+
+static void start_server(void) {
+    system("mkdir -p " TEST_OUTPUT_DIR "; rm -f " SERVE_SOCKET);
+    pid_t pid = fork();
+    cr_assert_neq(pid, -1, "Could not fork.\n");
+    if (!pid) {
+        prctl(PR_SET_PDEATHSIG, SIGKILL); /* Goes when the test does. */
+        freopen(TEST_OUTPUT_DIR "/serve.err", "w", stderr);
+        execl(PROGNAME, PROGNAME, "--serve", SERVE_SOCKET, (char *)NULL);
+        _exit(127);
+    }
+}
+
+static int connect_server(void) {
+    struct sockaddr_un addr = {AF_UNIX};
+    strcpy(addr.sun_path, SERVE_SOCKET);
+    for (int tries = 0; tries < 100; tries++) {
+        int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+        if (!connect(fd, (struct sockaddr *)&addr, sizeof addr))
+            return fd;
+        close(fd);
+        usleep(50000);
+    }
+    cr_assert_fail("Could not connect to the server.\n");
+    return -1;
+}
+
+/*
+ * Send a request, chunk bytes per write.
+ */
+static void send_request(int fd, char *options, char *text, size_t len, size_t chunk) {
+    size_t olen = strlen(options), n = 8 + olen + len;
+    char *frame = malloc(n);
+    uint32_t l = htonl(olen);
+    memcpy(frame, &l, 4);
+    memcpy(frame + 4, options, olen);
+    l = htonl(len);
+    memcpy(frame + 4 + olen, &l, 4);
+    memcpy(frame + 8 + olen, text, len);
+    for (size_t i = 0; i < n; i += chunk)
+        cr_assert_eq(write(fd, frame + i, i + chunk < n ? chunk : n - i),
+                     (ssize_t)(i + chunk < n ? chunk : n - i), "Write failed.\n");
+    free(frame);
+}
+
+/*
+ * Read n bytes, returning 0 if the connection ends first.
+ */
+static int read_full(int fd, char *buf, size_t n) {
+    while (n) {
+        ssize_t r = read(fd, buf, n);
+        if (r <= 0)
+            return 0;
+        buf += r;
+        n -= r;
+    }
+    return 1;
+}
+
+static char *read_reply(int fd, uint32_t *status, uint32_t *len) {
+    cr_assert(read_full(fd, (char *)status, 4) && read_full(fd, (char *)len, 4),
+              "The connection ended before a reply.\n");
+    *status = ntohl(*status);
+    *len = ntohl(*len);
+    char *s = malloc(*len + 1);
+    cr_assert(read_full(fd, s, *len), "The connection ended inside a reply.\n");
+    s[*len] = '\0';
+    return s;
+}
+
+/*
+ * Requests written a byte or a few at a time get the same output as
+ * bin/par with the same options, and the connection carries several.
+ */
+Test(par_suite, serve_split_request_test, .timeout = TEST_TIMEOUT) {
+    size_t len, elen;
+    uint32_t status, rlen;
+    char *text = read_file(TEST_REF_DIR "/gettysburg.txt", &len);
+    start_server();
+    int fd = connect_server();
+
+    char *expected = par_output("-w 40", TEST_REF_DIR "/gettysburg.txt", &elen);
+    send_request(fd, "-w 40", text, len, 1);
+    char *out = read_reply(fd, &status, &rlen);
+    cr_assert_eq(status, 0, "Status %u for a good request.\n", status);
+    cr_assert(rlen == elen && !memcmp(out, expected, elen),
+              "The output differs from that of bin/par -w 40.\n");
+    free(out);
+    free(expected);
+
+    expected = par_output("-w 60 -l", TEST_REF_DIR "/gettysburg.txt", &elen);
+    send_request(fd, "-w 60 -l", text, len, 7);
+    out = read_reply(fd, &status, &rlen);
+    cr_assert_eq(status, 0, "Status %u for a good request.\n", status);
+    cr_assert(rlen == elen && !memcmp(out, expected, elen),
+              "The output differs from that of bin/par -w 60 -l.\n");
+    free(out);
+    free(expected);
+    close(fd);
+}
+
+/*
+ * A request with a bad option gets status 1 and the message, and the
+ * connection goes on.
+ */
+Test(par_suite, serve_bad_option_test, .timeout = TEST_TIMEOUT) {
+    uint32_t status, rlen;
+    start_server();
+    int fd = connect_server();
+
+    send_request(fd, "-x", "one two\n", 8, 3);
+    char *out = read_reply(fd, &status, &rlen);
+    cr_assert_eq(status, 1, "Status %u for a bad option.\n", status);
+    cr_assert_str_eq(out, "Bad Option: '-x'\n");
+    free(out);
+
+    send_request(fd, "-w 4", "one two\n", 8, 3);
+    out = read_reply(fd, &status, &rlen);
+    cr_assert_eq(status, 0, "Status %u after a bad option.\n", status);
+    cr_assert_str_eq(out, "one\ntwo\n");
+    free(out);
+    close(fd);
+}
+
+/*
+ * Options or text longer than a request may have get an error, and the
+ * connection is closed without reading the rest.
+ */
+Test(par_suite, serve_too_long_test, .timeout = TEST_TIMEOUT) {
+    uint32_t status, rlen, l;
+    char c;
+    start_server();
+
+    int fd = connect_server();
+    l = htonl(4097);
+    write(fd, &l, 4);
+    char *out = read_reply(fd, &status, &rlen);
+    cr_assert_eq(status, 1, "Status %u for options too long.\n", status);
+    cr_assert_str_eq(out, "Options too long.\n");
+    cr_assert_eq(read(fd, &c, 1), 0, "The connection was not closed.\n");
+    free(out);
+    close(fd);
+
+    fd = connect_server();
+    l = htonl(0);
+    write(fd, &l, 4);
+    l = htonl((64 << 20) + 1);
+    write(fd, &l, 4);
+    out = read_reply(fd, &status, &rlen);
+    cr_assert_eq(status, 1, "Status %u for text too long.\n", status);
+    cr_assert_str_eq(out, "Text too long.\n");
+    cr_assert_eq(read(fd, &c, 1), 0, "The connection was not closed.\n");
+    free(out);
+    close(fd);
+}
+
+/*
+ * --files: each file named, or under a directory named, is reformatted in
+ * place, as bin/par would reformat it from stdin.
+ */
+#define FILES_DIR TEST_OUTPUT_DIR "/files"
+
+static void assert_reformatted(char *path, char *original) {
+    size_t len, elen;
+    char *out = read_file(path, &len);
+    char *expected = par_output("-w 50", original, &elen);
+    cr_assert(len == elen && !memcmp(out, expected, len),
+              "%s is not what bin/par -w 50 makes of %s.\n", path, original);
+    free(out);
+    free(expected);
+}
+
+/*
+ * Reformat a directory, a symbolic link, and a path which does not exist,
+ * and check that the rest is reformatted in spite of it.
+ */
+Test(par_suite, files_test, .timeout = TEST_TIMEOUT) {
+    char cmd[1000];
+    struct stat st;
+    system("rm -rf " FILES_DIR "; mkdir -p " FILES_DIR "/dir; "
+           "cp " TEST_REF_DIR "/gettysburg.txt " FILES_DIR "/dir/a.txt; "
+           "cp " TEST_REF_DIR "/loremipsum.txt " FILES_DIR "/dir/b.txt; "
+           "chmod 604 " FILES_DIR "/dir/a.txt; "
+           "cp " TEST_REF_DIR "/basic.in " FILES_DIR "/target.txt; "
+           "ln -s target.txt " FILES_DIR "/link.txt; "
+           "cp " TEST_REF_DIR "/basic.in " FILES_DIR "/other.txt; "
+           "ln -s ../other.txt " FILES_DIR "/dir/c.txt");
+
+    sprintf(cmd, PROGNAME " -w 50 --files %s/dir %s/link.txt %s/missing.txt "
+            "> /dev/null 2> %s/files.err", FILES_DIR, FILES_DIR, FILES_DIR,
+            TEST_OUTPUT_DIR);
+    int status = system(cmd);
+    assert_expected_status(1, status);
+    status = system("grep -q 'missing.txt: No such file or directory' "
+                    TEST_OUTPUT_DIR "/files.err && "
+                    "grep -q '^1 of 4 files could not be reformatted' "
+                    TEST_OUTPUT_DIR "/files.err");
+    cr_assert_eq(status, 0, "The missing path was not reported.\n");
+
+    assert_reformatted(FILES_DIR "/dir/a.txt", TEST_REF_DIR "/gettysburg.txt");
+    assert_reformatted(FILES_DIR "/dir/b.txt", TEST_REF_DIR "/loremipsum.txt");
+    assert_reformatted(FILES_DIR "/target.txt", TEST_REF_DIR "/basic.in");
+    cr_assert(!stat(FILES_DIR "/dir/a.txt", &st) && (st.st_mode & 07777) == 0604,
+              "The mode of a.txt was not kept.\n");
+    cr_assert(!lstat(FILES_DIR "/link.txt", &st) && S_ISLNK(st.st_mode),
+              "link.txt is no longer a symbolic link.\n");
+    status = system("cmp -s " FILES_DIR "/other.txt " TEST_REF_DIR "/basic.in");
+    cr_assert_eq(status, 0, "A symbolic link in a directory was followed.\n");
+}
+
+/*
+ * A paragraph of more than 2 * PARTWORDS words is split into parts at
+ * forced breaks (see reformat.c) when there is more than one processor.
+ * Its output is compared with that of par from before the split was
+ * added, given here by cksum, as the fixture is too big to keep.
+ */
+static void write_long_paragraph(char *path, int nwords) {
+    FILE *f = fopen(path, "w");
+    unsigned long x = 12345;
+    cr_assert_not_null(f, "Could not create %s.\n", path);
+    for (int i = 0; i < nwords; i++) {
+        x = x * 6364136223846793005UL + 1442695040888963407UL;
+        /* A word this long cannot share a line of 60 with its neighbors. */
+        int n = i % 997 == 0 ? 59 : 1 + (x >> 33) % 8;
+        for (int j = 0; j < n; j++)
+            putc('a' + (x >> (13 + j % 40)) % 26, f);
+        putc(i % 12 == 11 ? '\n' : ' ', f);
+    }
+    putc('\n', f);
+    fclose(f);
+}
+
+static void assert_cksum(char *options, char *in, char *expected) {
+    char cmd[1000];
+    size_t len;
+    sprintf(cmd, PROGNAME " %s < %s | cksum > %s/cksum.out", options, in,
+            TEST_OUTPUT_DIR);
+    system(cmd);
+    char *sum = read_file(TEST_OUTPUT_DIR "/cksum.out", &len);
+    cr_assert_str_eq(sum, expected, "bin/par %s: the output has changed.\n", options);
+    free(sum);
+}
+
+Test(par_suite, splitparts_test, .timeout = TEST_TIMEOUT) {
+    system("mkdir -p " TEST_OUTPUT_DIR);
+    write_long_paragraph(TEST_OUTPUT_DIR "/splitparts.in", 140000);
+    assert_cksum("-w 60 -p 0 -s 0", TEST_OUTPUT_DIR "/splitparts.in",
+                 "760844323 777911\n");
+    assert_cksum("-w 60 -p 0 -s 0 -l 1 -m 1", TEST_OUTPUT_DIR "/splitparts.in",
+                 "182904358 778187\n");
+}
+
+/*
+ * A paragraph of at least QUEUEWORDS words, set at a width with at least
+ * QUEUELINE words per line, is broken by sumsquaresqueue() rather than
+ * sumsquares(). Its output is compared with that of par from before
+ * sumsquaresqueue() was added.
+ */
+Test(par_suite, sumsquaresqueue_test, .timeout = TEST_TIMEOUT) {
+    char *in = TEST_OUTPUT_DIR "/queue.in";
+    system("mkdir -p " TEST_OUTPUT_DIR);
+    write_long_paragraph(in, 3000);
+    assert_cksum("-w 200 -p 0 -s 0", in, "2680539488 16491\n");
+    assert_cksum("-w 200 -p 0 -s 0 -l 1", in, "1399575840 16291\n");
+    assert_cksum("-w 200 -p 0 -s 0 -m 1", in, "1399575840 16291\n");
+    assert_cksum("-w 100 -p 0 -s 0", in, "1967816024 16491\n");
+    assert_cksum("-w 100 -p 0 -s 0 -l 1 -m 1", in, "2278668386 16375\n");
+}
+
+/*
+ * Input of more than BATCHBYTES is reformatted in batches by a pipeline
+ * of workers when there is more than one processor. Paragraphs 250 and
+ * 330 of 400 have a prefix longer than the width; par must write every
+ * paragraph before 250 in order, as it did before the pipeline was
+ * added, then report the error for 250 and stop.
+ */
+Test(par_suite, formatparallel_error_test, .timeout = TEST_TIMEOUT) {
+    char *in = TEST_OUTPUT_DIR "/batches.in";
+    size_t len;
+    system("mkdir -p " TEST_OUTPUT_DIR);
+    FILE *f = fopen(in, "w");
+    cr_assert_not_null(f, "Could not create %s.\n", in);
+    for (int i = 0; i < 400; i++) {
+        if (i == 250 || i == 330) {
+            for (int j = 0; j < 3; j++)
+                fprintf(f, "%s %d and %d\n", i == 250
+                        ? "##########################################"
+                        : "%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%",
+                        j, i);
+        } else {
+            for (int j = 0; j < 8; j++)
+                fprintf(f, "%d some words of paragraph %d go in here %d\n", j, i, j);
+        }
+        putc('\n', f);
+    }
+    fclose(f);
+
+    system(PROGNAME " -w 30 < " TEST_OUTPUT_DIR "/batches.in 2> "
+           TEST_OUTPUT_DIR "/batches.err | cksum > " TEST_OUTPUT_DIR "/cksum.out");
+    char *sum = read_file(TEST_OUTPUT_DIR "/cksum.out", &len);
+    cr_assert_str_eq(sum, "1382296839 85370\n",
+                     "The paragraphs before the error were not all written in order.\n");
+    free(sum);
+    char *err = read_file(TEST_OUTPUT_DIR "/batches.err", &len);
+    cr_assert_str_eq(err, "<width> = 30 shorter than <prefix> + <suffix> = 43 + 8 = 51\n",
+                     "The first error was not the one reported.\n");
+    free(err);
+    int status = system(PROGNAME " -w 30 < " TEST_OUTPUT_DIR "/batches.in "
+                        "> /dev/null 2>&1");
+    assert_expected_status(1, status);
+}
+
+/*
+ * With --window, paragraphs that fit in the window are reformatted just
+ * as without it, however long the input. A paragraph longer than the
+ * window is reformatted in pieces, which may break it differently, but
+ * must keep its words in order and within the width.
+ */
+Test(par_suite, window_test, .timeout = TEST_TIMEOUT) {
+    char *in = TEST_OUTPUT_DIR "/window.in";
+    size_t len, wlen;
+    system("mkdir -p " TEST_OUTPUT_DIR "; for i in `seq 50`; do cat "
+           TEST_REF_DIR "/gettysburg.txt; echo; done > " TEST_OUTPUT_DIR "/window.in");
+
+    char *out = par_output("-w 40", in, &len);
+    char *wout = par_output("-w 40 --window 4", in, &wlen);
+    cr_assert(len == wlen && !memcmp(out, wout, len),
+              "The output changed with a window of 4 lines.\n");
+    free(out);
+    free(wout);
+
+    int status = system(PROGNAME " -w 40 --window 5 < " TEST_REF_DIR "/loremipsum.txt > "
+                        TEST_OUTPUT_DIR "/window.out");
+    assert_expected_status(0, status);
+    status = system("tr -s ' \\n' '\\n\\n' < " TEST_REF_DIR "/loremipsum.txt > "
+                    TEST_OUTPUT_DIR "/window.words; "
+                    "tr -s ' \\n' '\\n\\n' < " TEST_OUTPUT_DIR "/window.out | "
+                    "cmp -s - " TEST_OUTPUT_DIR "/window.words");
+    cr_assert_eq(status, 0, "The words of a long paragraph changed with a window.\n");
+    status = system("awk 'length > 40 { exit 1 }' " TEST_OUTPUT_DIR "/window.out");
+    cr_assert_eq(status, 0, "A line is wider than 40 with a window.\n");
+}
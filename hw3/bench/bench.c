@@ -0,0 +1,887 @@
+/**
+ * Benchmarks sfmm against glibc's malloc by replaying traces (see trace.h):
+ *
+ *     bench [-n CALLS] [-s SEED] [-m BYTES] [-T BYTES] [-k] [-t THREADS] [-o JSON] [TRACE...]
+ *     bench -g GENERATOR [-n CALLS] [-s SEED] -w TRACE
+ *
+ * The first form replays each TRACE, or if there are none, a trace of about
+ * CALLS calls (200000 by default) from each of the synthetic generators, once
+ * with each allocator, each time in a process of its own.  It prints a table of
+ * the results, followed by the RSS of each replay over time.  It then times each
+ * allocator with 1, 2, 4 and so on up to THREADS threads (8 by default, none if
+ * 0) each making CALLS calls to malloc and free of small objects, with sfmm in
+ * its thread-safe mode, and prints the calls per second of each run.  It writes
+ * the same results as JSON to JSON if it is given.  -m, -T and -k turn on
+ * sfmm's mmap threshold, its trim threshold and its slabs (see sfmm_ext.h).  The
+ * second form writes a trace from one of the generators to TRACE.  SEED seeds
+ * the generators.
+ *
+ * Each call is timed on its own, less the time the clock takes, and every byte
+ * a call hands out is then written to, as a program would.  Throughput is the
+ * number of calls over the time spent in them.  The RSS, and sfmm's internal
+ * fragmentation, are sampled at RSS_SAMPLES evenly spaced points of a replay;
+ * the fragmentation reported is the mean of the samples at which anything was
+ * allocated.  sfutil's heap is limited to 24 KB, so the generators keep their
+ * live data well under that, and calls which fail are counted.
+ */
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <math.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/wait.h>
+#include "sfmm_ext.h"
+#include "trace.h"
+
+#define NUM_TYPES 3
+#define RSS_SAMPLES 16
+#define MAX_LIVE 32     /* Most objects a generator keeps live at once. */
+#define MAX_THREADS 64  /* Most threads of a threaded run. */
+#define THREAD_LIVE 8   /* Objects each thread of a threaded run keeps live. */
+#define THREAD_SIZE 40  /* Largest object of a threaded run, within a thread cache. */
+
+static const char *const op_names[NUM_TYPES] = {"malloc", "free", "realloc"};
+
+/*
+ ---------------------------------------------GENERATORS----------------------------------------------------
+*/
+
+static uint64_t random_state;
+static uint32_t live_sizes[MAX_LIVE]; // Of the generator's objects, or 0 if not live.
+static long written;                  // Calls written by the generator.
+
+static uint32_t next_random()
+{
+    // xorshift64*, so that a seed gives the same trace everywhere.
+    random_state ^= random_state >> 12;
+    random_state ^= random_state << 25;
+    random_state ^= random_state >> 27;
+    return (random_state * 0x2545F4914F6CDD1Dull) >> 32;
+}
+
+static void emit(struct trace_writer *writer, char type, uint32_t id, uint32_t size)
+{
+    if (trace_write(writer, type, id, size))
+    {
+        perror("bench: trace");
+        exit(EXIT_FAILURE);
+    }
+    live_sizes[id] = type == TRACE_FREE ? 0 : size;
+    written++;
+}
+
+/*
+ * Random calls on random objects, of sizes spread evenly over 1 to 512 bytes:
+ * a free object is allocated, and a live one freed, or one time in four,
+ * reallocated.
+ */
+static void make_uniform(struct trace_writer *writer, long calls)
+{
+    while (written < calls)
+    {
+        uint32_t id = next_random() % MAX_LIVE;
+        if (!live_sizes[id])
+            emit(writer, TRACE_MALLOC, id, 1 + next_random() % 512);
+        else if (next_random() % 4)
+            emit(writer, TRACE_FREE, id, 0);
+        else
+            emit(writer, TRACE_REALLOC, id, 1 + next_random() % 512);
+    }
+}
+
+/*
+ * Sizes from 8 bytes up, with a Pareto distribution of index 1.2, capped at
+ * 8 KB: most requests are small, but a few are very large.  The calls are
+ * chosen as for uniform.
+ */
+static uint32_t power_law_size()
+{
+    double size = 8 / pow(1 - next_random() / 4294967296.0, 1 / 1.2);
+    return size < 8192 ? (uint32_t)size : 8192;
+}
+
+static void make_power_law(struct trace_writer *writer, long calls)
+{
+    while (written < calls)
+    {
+        uint32_t id = next_random() % MAX_LIVE;
+        if (!live_sizes[id])
+            emit(writer, TRACE_MALLOC, id, power_law_size());
+        else if (next_random() % 4)
+            emit(writer, TRACE_FREE, id, 0);
+        else
+            emit(writer, TRACE_REALLOC, id, power_law_size());
+    }
+}
+
+/*
+ * Messages of 16 to 256 bytes are allocated by a producer and freed by a
+ * consumer in the order they were made, each working in bursts of 1 to 16.
+ */
+static void make_producer_consumer(struct trace_writer *writer, long calls)
+{
+    uint32_t queue[MAX_LIVE];
+    int head = 0, length = 0, producing = 0, burst = 0;
+    while (written < calls)
+    {
+        if (!burst)
+        {
+            producing = next_random() % 2;
+            burst = 1 + next_random() % 16;
+        }
+        burst--;
+        if (producing && length < MAX_LIVE)
+        {
+            uint32_t id = 0;
+            while (live_sizes[id])
+                id++;
+            emit(writer, TRACE_MALLOC, id, 16 + next_random() % 241);
+            queue[(head + length++) % MAX_LIVE] = id;
+        }
+        else if (length)
+        {
+            emit(writer, TRACE_FREE, queue[head], 0);
+            head = (head + 1) % MAX_LIVE;
+            length--;
+        }
+    }
+}
+
+/*
+ * Four buffers grow from 16 bytes, by reallocs, to a limit of 256 to 4096
+ * bytes, when they are freed and started again.  Two grow by 1 to 64 bytes at a
+ * time, like strings being appended to, and two by half, like vectors.
+ */
+static void make_realloc_growth(struct trace_writer *writer, long calls)
+{
+    uint32_t limits[4];
+    while (written < calls)
+    {
+        uint32_t id = next_random() % 4, size = live_sizes[id];
+        if (!size)
+        {
+            limits[id] = 256 + next_random() % 3841;
+            emit(writer, TRACE_MALLOC, id, 16);
+        }
+        else if (size >= limits[id])
+            emit(writer, TRACE_FREE, id, 0);
+        else
+        {
+            size += id % 2 ? 1 + next_random() % 64 : size / 2;
+            emit(writer, TRACE_REALLOC, id, size < limits[id] ? size : limits[id]);
+        }
+    }
+}
+
+struct generator
+{
+    const char *name;
+    void (*make)(struct trace_writer *writer, long calls);
+};
+
+static const struct generator generators[] = {
+    {"uniform", make_uniform},
+    {"power-law", make_power_law},
+    {"producer-consumer", make_producer_consumer},
+    {"realloc-growth", make_realloc_growth},
+};
+
+#define NUM_GENERATORS (sizeof(generators) / sizeof(*generators))
+
+/*
+ * Writes a trace of about calls calls from generator to path, freeing whatever
+ * is left live at the end.  Returns 0 on success.
+ */
+static int generate(const struct generator *generator, long calls, unsigned long seed, const char *path)
+{
+    struct trace_writer *writer = malloc(sizeof(struct trace_writer));
+    if (!writer || trace_open(writer, path))
+    {
+        free(writer);
+        return -1;
+    }
+    random_state = seed * 0x9E3779B97F4A7C15ull + 1;
+    memset(live_sizes, 0, sizeof(live_sizes));
+    written = 0;
+    generator->make(writer, calls);
+    for (uint32_t id = 0; id < MAX_LIVE; id++)
+        if (live_sizes[id])
+            emit(writer, TRACE_FREE, id, 0);
+    int status = trace_close(writer);
+    free(writer);
+    return status;
+}
+
+/*
+ ---------------------------------------------REPLAY----------------------------------------------------
+*/
+
+struct allocator
+{
+    const char *name;
+    void *(*malloc)(size_t size);
+    void (*free)(void *pointer);
+    void *(*realloc)(void *pointer, size_t size);
+    double (*utilization)();   // NULL if the allocator has no such measure.
+    double (*fragmentation)(); // NULL if the allocator has no such measure.
+};
+
+static void *sfmm_malloc(size_t size)
+{
+    return sf_malloc(size);
+}
+
+static void sfmm_free(void *pointer)
+{
+    sf_free(pointer);
+}
+
+static void *sfmm_realloc(void *pointer, size_t size)
+{
+    return sf_realloc(pointer, size);
+}
+
+static const struct allocator allocators[] = {
+    {"sfmm", sfmm_malloc, sfmm_free, sfmm_realloc, sf_peak_utilization, sf_internal_fragmentation},
+    {"glibc", malloc, free, realloc, NULL, NULL},
+};
+
+#define NUM_ALLOCATORS (sizeof(allocators) / sizeof(*allocators))
+
+struct result
+{
+    int failed; // Set if the replay did not finish.
+    long calls[NUM_TYPES], failures;
+    double seconds;                                  // Spent in the allocator.
+    double p50[NUM_TYPES], p99[NUM_TYPES], max[NUM_TYPES]; // In nanoseconds.
+    double utilization, fragmentation;               // Or -1 if not measured.
+    long rss[RSS_SAMPLES + 1];                       // In KB, over that at the start.
+};
+
+static uint64_t now()
+{
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec * 1000000000ull + t.tv_nsec;
+}
+
+/*
+ * Returns the shortest time the clock reports between two readings of it.
+ */
+static uint64_t clock_overhead()
+{
+    uint64_t least = UINT64_MAX;
+    for (int i = 0; i < 1000; i++)
+    {
+        uint64_t start = now(), end = now();
+        if (end - start < least)
+            least = end - start;
+    }
+    return least;
+}
+
+/*
+ * Returns the anonymous resident memory of the process in KB, read without
+ * allocating.  Pages of code and other files are left out, since they are
+ * mapped in as the replay first runs each part of the allocator.  The count is
+ * taken from smaps_rollup, which counts the pages themselves, or failing that
+ * from statm, whose counts the kernel only brings up to date every so often.
+ */
+static long rss_kb()
+{
+    char buffer[4096];
+    int fd = open("/proc/self/smaps_rollup", O_RDONLY), rollup = fd >= 0;
+    if (!rollup)
+        fd = open("/proc/self/statm", O_RDONLY);
+    if (fd < 0)
+        return 0;
+    ssize_t length = read(fd, buffer, sizeof(buffer) - 1);
+    close(fd);
+    if (length <= 0)
+        return 0;
+    buffer[length] = '\0';
+    char *p = buffer;
+    if (rollup)
+    {
+        p = strstr(buffer, "\nAnonymous:");
+        return p ? strtol(p + 11, NULL, 10) : 0;
+    }
+    strtol(buffer, &p, 10);
+    long resident = strtol(p, &p, 10), shared = strtol(p, NULL, 10);
+    return (resident - shared) * (sysconf(_SC_PAGESIZE) / 1024);
+}
+
+/*
+ * Writes to every page of memory, so that it is resident before the replay
+ * starts, and filling it in does not add to the RSS measured.
+ */
+static void touch(void *memory, size_t size)
+{
+    for (size_t i = 0; i < size; i += 1024)
+        ((volatile char *)memory)[i] = 0;
+}
+
+static int compare_latencies(const void *a, const void *b)
+{
+    uint32_t x = *(const uint32_t *)a, y = *(const uint32_t *)b;
+    return x < y ? -1 : x > y;
+}
+
+static int type_index(char type)
+{
+    return type == TRACE_MALLOC ? 0 : type == TRACE_FREE ? 1 : 2;
+}
+
+/*
+ * Replays a trace with allocator, filling in *result.  A free of an object the
+ * allocator failed to allocate is skipped, and a realloc of one is a malloc.
+ */
+static void replay(const struct allocator *allocator, const struct trace_op *ops, size_t count, uint32_t objects,
+                   struct result *result)
+{
+    void **pointers = calloc(objects, sizeof(void *));
+    uint32_t *sizes = calloc(objects, sizeof(uint32_t));
+    uint32_t *latencies[NUM_TYPES];
+    size_t type_counts[NUM_TYPES] = {0};
+    for (size_t i = 0; i < count; i++)
+        type_counts[type_index(ops[i].type)]++;
+    for (int t = 0; t < NUM_TYPES; t++)
+        latencies[t] = calloc(type_counts[t] + 1, sizeof(uint32_t));
+    if (!pointers || !sizes || !latencies[0] || !latencies[1] || !latencies[2])
+    {
+        result->failed = 1;
+        return;
+    }
+    touch(pointers, objects * sizeof(void *));
+    touch(sizes, objects * sizeof(uint32_t));
+    for (int t = 0; t < NUM_TYPES; t++)
+        touch(latencies[t], (type_counts[t] + 1) * sizeof(uint32_t));
+
+    uint64_t overhead = clock_overhead(), total = 0;
+    long start_rss = rss_kb();
+    double fragmentation = 0;
+    int fragmentation_samples = 0, sample = 0;
+    for (size_t i = 0; i <= count; i++)
+    {
+        while (sample <= RSS_SAMPLES && i >= sample * count / RSS_SAMPLES)
+        {
+            result->rss[sample++] = rss_kb() - start_rss;
+            double f = allocator->fragmentation ? allocator->fragmentation() : 0;
+            if (f > 0)
+            {
+                fragmentation += f;
+                fragmentation_samples++;
+            }
+        }
+        if (i == count)
+            break;
+
+        const struct trace_op *op = &ops[i];
+        int t = type_index(op->type);
+        void *pointer = pointers[op->id], *new_pointer = NULL;
+        if (op->type == TRACE_FREE && !pointer)
+            continue;
+        uint64_t start = now();
+        if (op->type == TRACE_FREE)
+            allocator->free(pointer);
+        else if (op->type == TRACE_MALLOC || !pointer)
+            new_pointer = allocator->malloc(op->size);
+        else
+            new_pointer = allocator->realloc(pointer, op->size);
+        uint64_t latency = now() - start;
+        latency = latency > overhead ? latency - overhead : 0;
+        latencies[t][result->calls[t]++] = latency < UINT32_MAX ? latency : UINT32_MAX;
+        total += latency;
+
+        if (op->type == TRACE_FREE || (op->type == TRACE_REALLOC && !op->size))
+        {
+            pointers[op->id] = NULL;
+            sizes[op->id] = 0;
+        }
+        else if (new_pointer)
+        {
+            uint32_t old_size = op->type == TRACE_REALLOC && pointer ? sizes[op->id] : 0;
+            if (op->size > old_size)
+                memset((char *)new_pointer + old_size, op->id, op->size - old_size);
+            pointers[op->id] = new_pointer;
+            sizes[op->id] = op->size;
+        }
+        else if (op->size)
+            result->failures++;
+    }
+
+    result->seconds = total / 1e9;
+    for (int t = 0; t < NUM_TYPES; t++)
+    {
+        long n = result->calls[t];
+        qsort(latencies[t], n, sizeof(uint32_t), compare_latencies);
+        result->p50[t] = n ? latencies[t][n / 2] : 0;
+        result->p99[t] = n ? latencies[t][n * 99 / 100] : 0;
+        result->max[t] = n ? latencies[t][n - 1] : 0;
+    }
+    result->utilization = allocator->utilization ? allocator->utilization() : -1;
+    result->fragmentation = !allocator->fragmentation ? -1
+                            : fragmentation_samples ? fragmentation / fragmentation_samples
+                                                    : 0;
+}
+
+/*
+ ---------------------------------------------THREADS----------------------------------------------------
+*/
+
+struct thread_result
+{
+    int failed; // Set if the run did not finish.
+    long calls, failures;
+    double seconds; // From the start of the threads to the end of the last.
+};
+
+struct thread_work
+{
+    const struct allocator *allocator;
+    pthread_barrier_t *start;
+    uint64_t random_state;
+    long calls, failures;
+    uint64_t begin, end; // When the thread passed the barrier and finished its calls.
+};
+
+/*
+ * The body of a thread of a threaded run, which frees a random one of its
+ * THREAD_LIVE objects, or allocates it if it is not live, calls times.
+ */
+static void *thread_body(void *arg)
+{
+    struct thread_work *work = arg;
+    void *pointers[THREAD_LIVE] = {NULL};
+    uint64_t x = work->random_state;
+    pthread_barrier_wait(work->start);
+    work->begin = now();
+    for (long i = 0; i < work->calls; i++)
+    {
+        x ^= x << 13;
+        x ^= x >> 7;
+        x ^= x << 17;
+        int slot = x % THREAD_LIVE;
+        if (pointers[slot])
+        {
+            work->allocator->free(pointers[slot]);
+            pointers[slot] = NULL;
+        }
+        else if ((pointers[slot] = work->allocator->malloc(1 + (x >> 32) % THREAD_SIZE)))
+            *(char *)pointers[slot] = i;
+        else
+            work->failures++;
+    }
+    work->end = now();
+    for (int slot = 0; slot < THREAD_LIVE; slot++)
+        if (pointers[slot])
+            work->allocator->free(pointers[slot]);
+    return NULL;
+}
+
+/*
+ * Times threads threads each making calls calls with allocator, filling in
+ * *result.  The threads are started together, once all of them exist, and the
+ * run lasts from the first of them starting its calls to the last finishing.
+ */
+static void run_threads(const struct allocator *allocator, int threads, long calls, struct thread_result *result)
+{
+    pthread_t ids[MAX_THREADS];
+    struct thread_work work[MAX_THREADS];
+    pthread_barrier_t start;
+    int created = 0;
+    if (allocator->malloc == sfmm_malloc)
+        sf_set_thread_safe(1);
+    pthread_barrier_init(&start, NULL, threads + 1);
+    for (; created < threads; created++)
+    {
+        work[created] = (struct thread_work){allocator, &start, 0x9E3779B97F4A7C15ull * (created + 1), calls, 0, 0, 0};
+        if (pthread_create(&ids[created], NULL, thread_body, &work[created]))
+            break;
+    }
+    if (created < threads)
+    {
+        // The threads already started wait at the barrier for good.
+        result->failed = 1;
+        return;
+    }
+    pthread_barrier_wait(&start);
+    uint64_t begin = UINT64_MAX, end = 0;
+    for (int i = 0; i < threads; i++)
+    {
+        pthread_join(ids[i], NULL);
+        result->calls += work[i].calls;
+        result->failures += work[i].failures;
+        if (work[i].begin < begin)
+            begin = work[i].begin;
+        if (work[i].end > end)
+            end = work[i].end;
+    }
+    result->seconds = (end - begin) / 1e9;
+}
+
+/*
+ ---------------------------------------------RUNS----------------------------------------------------
+*/
+
+static sf_size_t mmap_threshold, trim_threshold;
+static int slabs;
+
+struct run
+{
+    const struct allocator *allocator;
+    const struct trace_op *ops; // The trace to replay, or NULL for a threaded run.
+    size_t count;
+    uint32_t objects;
+    int threads;
+    long calls;
+};
+
+/*
+ * Does a run in a child process, so that each starts with a fresh heap and its
+ * own RSS, and copies back its result, of size bytes, which starts with the
+ * failed flag.  Returns 0 if the run finished.
+ */
+static int run_in_child(const struct run *run, void *result, size_t size)
+{
+    int fds[2];
+    pid_t pid = -1;
+    memset(result, 0, size);
+    fflush(stdout);
+    if (!pipe(fds) && (pid = fork()) < 0)
+    {
+        close(fds[0]);
+        close(fds[1]);
+    }
+    if (pid < 0)
+    {
+        *(int *)result = 1;
+        return -1;
+    }
+    if (!pid)
+    {
+        close(fds[0]);
+        if (run->allocator->malloc == sfmm_malloc)
+        {
+            sf_set_mmap_threshold(mmap_threshold);
+            sf_set_trim_threshold(trim_threshold);
+            sf_set_slabs(slabs);
+        }
+        if (run->ops)
+            replay(run->allocator, run->ops, run->count, run->objects, result);
+        else
+            run_threads(run->allocator, run->threads, run->calls, result);
+        _exit(write(fds[1], result, size) == (ssize_t)size ? 0 : 1);
+    }
+    close(fds[1]);
+    size_t got = 0;
+    ssize_t n;
+    while (got < size && (n = read(fds[0], (char *)result + got, size - got)) != 0)
+        if (n > 0)
+            got += n;
+        else if (errno != EINTR)
+            break;
+    close(fds[0]);
+    int status;
+    waitpid(pid, &status, 0);
+    if (got != size || !WIFEXITED(status) || WEXITSTATUS(status))
+        *(int *)result = 1;
+    return *(int *)result ? -1 : 0;
+}
+
+/*
+ ---------------------------------------------OUTPUT----------------------------------------------------
+*/
+
+static double calls_per_second(const struct result *result)
+{
+    long calls = result->calls[0] + result->calls[1] + result->calls[2];
+    return result->seconds > 0 ? calls / result->seconds : 0;
+}
+
+static long peak_rss(const struct result *result)
+{
+    long peak = 0;
+    for (int i = 0; i <= RSS_SAMPLES; i++)
+        if (result->rss[i] > peak)
+            peak = result->rss[i];
+    return peak;
+}
+
+static void print_row(const char *trace, const char *allocator, const struct result *result)
+{
+    printf("%-18s %-6s", trace, allocator);
+    if (result->failed)
+    {
+        printf("  FAILED\n");
+        return;
+    }
+    printf(" %9ld %6ld %8.2f", result->calls[0] + result->calls[1] + result->calls[2], result->failures,
+           calls_per_second(result) / 1e6);
+    for (int t = 0; t < NUM_TYPES; t++)
+        printf("  %5.0f %6.0f %8.0f", result->p50[t], result->p99[t], result->max[t]);
+    if (result->utilization >= 0)
+        printf("  %5.3f %5.3f", result->utilization, result->fragmentation);
+    else
+        printf("  %5s %5s", "-", "-");
+    printf(" %8ld\n", peak_rss(result));
+}
+
+static void write_json(FILE *f, char **names, int num_traces, const struct result *results, long calls,
+                       unsigned long seed, int num_thread_runs, const int *thread_counts,
+                       const struct thread_result *thread_results)
+{
+    fprintf(f, "{\n  \"calls\": %ld,\n  \"seed\": %lu,\n", calls, seed);
+    fprintf(f, "  \"sfmm\": {\"mmap_threshold\": %u, \"trim_threshold\": %u, \"slabs\": %s},\n", mmap_threshold,
+            trim_threshold, slabs ? "true" : "false");
+    fprintf(f, "  \"runs\": [\n");
+    for (int i = 0; i < num_traces; i++)
+        for (size_t a = 0; a < NUM_ALLOCATORS; a++)
+        {
+            const struct result *result = &results[i * NUM_ALLOCATORS + a];
+            fprintf(f, "    {\"trace\": \"%s\", \"allocator\": \"%s\", \"failed\": %s,\n", names[i],
+                    allocators[a].name, result->failed ? "true" : "false");
+            fprintf(f, "     \"calls\": {");
+            for (int t = 0; t < NUM_TYPES; t++)
+                fprintf(f, "%s\"%s\": %ld", t ? ", " : "", op_names[t], result->calls[t]);
+            fprintf(f, "}, \"failures\": %ld, \"calls_per_s\": %.0f,\n     \"latency_ns\": {", result->failures,
+                    calls_per_second(result));
+            for (int t = 0; t < NUM_TYPES; t++)
+                fprintf(f, "%s\"%s\": {\"p50\": %.0f, \"p99\": %.0f, \"max\": %.0f}", t ? ", " : "", op_names[t],
+                        result->p50[t], result->p99[t], result->max[t]);
+            fprintf(f, "},\n");
+            if (result->utilization >= 0)
+                fprintf(f, "     \"peak_utilization\": %.4f, \"internal_fragmentation\": %.4f,\n",
+                        result->utilization, result->fragmentation);
+            fprintf(f, "     \"rss_kb\": [");
+            for (int s = 0; s <= RSS_SAMPLES; s++)
+                fprintf(f, "%s%ld", s ? ", " : "", result->rss[s]);
+            fprintf(f, "]}%s\n", i + 1 < num_traces || a + 1 < NUM_ALLOCATORS ? "," : "");
+        }
+    fprintf(f, "  ],\n  \"threads\": [\n");
+    for (int i = 0; i < num_thread_runs; i++)
+        for (size_t a = 0; a < NUM_ALLOCATORS; a++)
+        {
+            const struct thread_result *result = &thread_results[i * NUM_ALLOCATORS + a];
+            fprintf(f, "    {\"threads\": %d, \"allocator\": \"%s\", \"failed\": %s, \"calls\": %ld, \"failures\": %ld, "
+                       "\"calls_per_s\": %.0f}%s\n",
+                    thread_counts[i], allocators[a].name, result->failed ? "true" : "false", result->calls,
+                    result->failures, result->seconds > 0 ? result->calls / result->seconds : 0,
+                    i + 1 < num_thread_runs || a + 1 < NUM_ALLOCATORS ? "," : "");
+        }
+    fprintf(f, "  ]\n}\n");
+}
+
+int main(int argc, char *argv[])
+{
+    const char *json = NULL, *generator_name = NULL, *output = NULL;
+    long calls = 200000;
+    unsigned long seed = 1;
+    int opt, status = EXIT_SUCCESS, max_threads = 8;
+
+    while ((opt = getopt(argc, argv, "n:s:m:T:kt:o:g:w:")) != -1)
+        switch (opt)
+        {
+        case 'n':
+            calls = atol(optarg);
+            break;
+        case 's':
+            seed = strtoul(optarg, NULL, 10);
+            break;
+        case 'm':
+            mmap_threshold = strtoul(optarg, NULL, 10);
+            break;
+        case 'T':
+            trim_threshold = strtoul(optarg, NULL, 10);
+            break;
+        case 'k':
+            slabs = 1;
+            break;
+        case 't':
+            max_threads = atoi(optarg);
+            break;
+        case 'o':
+            json = optarg;
+            break;
+        case 'g':
+            generator_name = optarg;
+            break;
+        case 'w':
+            output = optarg;
+            break;
+        default:
+            goto usage;
+        }
+    if (calls < 1 || max_threads < 0 || max_threads > MAX_THREADS || !generator_name != !output ||
+        (generator_name && optind != argc))
+        goto usage;
+
+    if (generator_name)
+    {
+        for (size_t g = 0; g < NUM_GENERATORS; g++)
+            if (!strcmp(generators[g].name, generator_name))
+            {
+                if (!generate(&generators[g], calls, seed, output))
+                    return EXIT_SUCCESS;
+                perror(output);
+                return EXIT_FAILURE;
+            }
+        fprintf(stderr, "bench: no generator %s; there are", generator_name);
+        for (size_t g = 0; g < NUM_GENERATORS; g++)
+            fprintf(stderr, " %s", generators[g].name);
+        fprintf(stderr, "\n");
+        return EXIT_FAILURE;
+    }
+
+    // Without traces, each generator makes one in a temporary directory.
+    char dir[] = "/tmp/sfbenchXXXXXX";
+    int generated = optind == argc, num_traces = generated ? (int)NUM_GENERATORS : argc - optind;
+    char **paths = calloc(num_traces, sizeof(char *)), **names = calloc(num_traces, sizeof(char *));
+    struct result *results = calloc(num_traces * NUM_ALLOCATORS, sizeof(struct result));
+    if (!paths || !names || !results || (generated && !mkdtemp(dir)))
+    {
+        perror("bench");
+        return EXIT_FAILURE;
+    }
+    for (int i = 0; i < num_traces; i++)
+        if (generated)
+        {
+            names[i] = (char *)generators[i].name;
+            if (asprintf(&paths[i], "%s/%s.trace", dir, names[i]) < 0 ||
+                generate(&generators[i], calls, seed, paths[i]))
+            {
+                perror("bench: generating a trace");
+                return EXIT_FAILURE;
+            }
+        }
+        else
+        {
+            paths[i] = argv[optind + i];
+            names[i] = strrchr(paths[i], '/') ? strrchr(paths[i], '/') + 1 : paths[i];
+        }
+
+    printf("%-18s %-6s %9s %6s %8s", "trace", "alloc", "calls", "fails", "Mcalls/s");
+    for (int t = 0; t < NUM_TYPES; t++)
+        printf("  %-7s %5s %8s", op_names[t], "p99", "max");
+    printf("  %5s %5s %8s\n", "util", "frag", "rss KB");
+    printf("%-18s %-6s %9s %6s %8s", "", "", "", "", "");
+    for (int t = 0; t < NUM_TYPES; t++)
+        printf("  %5s %6s %8s", "p50ns", "ns", "ns");
+    printf("\n");
+
+    for (int i = 0; i < num_traces; i++)
+    {
+        size_t count;
+        uint32_t objects;
+        struct trace_op *ops = trace_read(paths[i], &count, &objects);
+        if (!ops)
+        {
+            if (errno == EINVAL)
+                fprintf(stderr, "bench: %s: not a trace\n", paths[i]);
+            else
+                perror(paths[i]);
+            status = EXIT_FAILURE;
+            for (size_t a = 0; a < NUM_ALLOCATORS; a++)
+                results[i * NUM_ALLOCATORS + a].failed = 1;
+            continue;
+        }
+        for (size_t a = 0; a < NUM_ALLOCATORS; a++)
+        {
+            struct result *result = &results[i * NUM_ALLOCATORS + a];
+            struct run replay_run = {&allocators[a], ops, count, objects, 0, 0};
+            if (run_in_child(&replay_run, result, sizeof(struct result)))
+                status = EXIT_FAILURE;
+            print_row(names[i], allocators[a].name, result);
+        }
+        free(ops);
+        if (generated)
+            unlink(paths[i]);
+    }
+    if (generated)
+        rmdir(dir);
+
+    printf("\nRSS in KB over that at the start, at every 1/%d of the calls:\n", RSS_SAMPLES);
+    for (int i = 0; i < num_traces; i++)
+        for (size_t a = 0; a < NUM_ALLOCATORS; a++)
+        {
+            if (results[i * NUM_ALLOCATORS + a].failed)
+                continue;
+            printf("%-18s %-6s", names[i], allocators[a].name);
+            for (int s = 0; s <= RSS_SAMPLES; s++)
+                printf(" %5ld", results[i * NUM_ALLOCATORS + a].rss[s]);
+            printf("\n");
+        }
+
+    // Threaded runs with 1, 2, 4 and so on up to max_threads threads, and max_threads itself.
+    int thread_counts[32], num_thread_runs = 0;
+    for (int threads = 1; threads < max_threads; threads *= 2)
+        thread_counts[num_thread_runs++] = threads;
+    if (max_threads)
+        thread_counts[num_thread_runs++] = max_threads;
+    struct thread_result thread_results[32 * NUM_ALLOCATORS];
+    if (num_thread_runs)
+    {
+        printf("\nMcalls/s with threads each making %ld calls of up to %d bytes, and speedup over 1 thread:\n",
+               calls, THREAD_SIZE);
+        printf("%-7s", "threads");
+        for (size_t a = 0; a < NUM_ALLOCATORS; a++)
+            printf(" %8s %6s %6s", allocators[a].name, "speed", "fails");
+        printf("\n");
+    }
+    for (int i = 0; i < num_thread_runs; i++)
+    {
+        printf("%-7d", thread_counts[i]);
+        for (size_t a = 0; a < NUM_ALLOCATORS; a++)
+        {
+            struct thread_result *result = &thread_results[i * NUM_ALLOCATORS + a];
+            struct run thread_run = {&allocators[a], NULL, 0, 0, thread_counts[i], calls};
+            if (run_in_child(&thread_run, result, sizeof(struct thread_result)))
+            {
+                status = EXIT_FAILURE;
+                printf(" %8s %6s %6s", "FAILED", "", "");
+                continue;
+            }
+            const struct thread_result *first = &thread_results[a];
+            double rate = result->calls / result->seconds, first_rate = first->calls / first->seconds;
+            printf(" %8.2f %5.2fx %6ld", rate / 1e6, first->failed ? 0 : rate / first_rate, result->failures);
+        }
+        printf("\n");
+    }
+
+    if (json)
+    {
+        FILE *f = fopen(json, "w");
+        if (!f)
+        {
+            perror(json);
+            return EXIT_FAILURE;
+        }
+        write_json(f, names, num_traces, results, calls, seed, num_thread_runs, thread_counts, thread_results);
+        if (fclose(f))
+        {
+            perror(json);
+            return EXIT_FAILURE;
+        }
+    }
+
+    if (generated)
+        for (int i = 0; i < num_traces; i++)
+            free(paths[i]);
+    free(paths);
+    free(names);
+    free(results);
+    return status;
+
+usage:
+    fprintf(stderr,
+            "usage: %s [-n CALLS] [-s SEED] [-m BYTES] [-T BYTES] [-k] [-t THREADS] [-o JSON] [TRACE...]\n"
+            "       %s -g GENERATOR [-n CALLS] [-s SEED] -w TRACE\n",
+            argv[0], argv[0]);
+    return EXIT_FAILURE;
+}
@@ -0,0 +1,286 @@
+/**
+ * A recorder of malloc traces, built as a shared library to be preloaded into
+ * the program to trace:
+ *
+ *     SFTRACE=prog.trace LD_PRELOAD=bin/sfrecord.so prog ...
+ *
+ * It wraps malloc, calloc, realloc and free, passing each call on to glibc's
+ * allocator and adding a record of it to the trace named by SFTRACE (see
+ * trace.h).  A calloc is recorded as a malloc of the same total size.  Only the
+ * process started with SFTRACE set is traced: the variable is removed from its
+ * environment, and children it forks stop recording.  If SFTRACE contains %p,
+ * though, that is replaced by the process id, and the variable is left alone,
+ * so that every program the process execs gets a trace of its own, as when the
+ * program to trace is started by a wrapper script.  Pointers from the other
+ * allocation functions, such as posix_memalign, are not tracked, so frees of
+ * them are not recorded.
+ */
+#define _GNU_SOURCE // For unsetenv.
+#include <errno.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "trace.h"
+
+#define EXPORT __attribute__((visibility("default")))
+
+void *__libc_malloc(size_t size);
+void *__libc_calloc(size_t count, size_t size);
+void *__libc_realloc(void *pointer, size_t size);
+void __libc_free(void *pointer);
+
+/*
+ * The ids of the pointers the program holds are kept in a hash table with open
+ * addressing and linear probing, and the ids given up are kept in a stack, so
+ * that the lowest ones are reused first most of the time.  Everything is
+ * protected by record_lock, and only uses glibc's allocator directly.
+ */
+struct entry
+{
+    void *pointer; // NULL if the entry is empty.
+    uint32_t id;
+};
+
+struct entry *table;
+size_t table_size, table_used; // table_size is a power of two.
+uint32_t *free_ids;
+size_t free_id_count, free_id_capacity;
+uint32_t next_id;
+
+int recording = 0;
+struct trace_writer writer;
+pthread_mutex_t record_lock = PTHREAD_MUTEX_INITIALIZER;
+
+size_t hash_pointer(void *pointer)
+{
+    return ((uintptr_t)pointer >> 4) * 0x9E3779B97F4A7C15ull >> 20 & (table_size - 1);
+}
+
+int grow_table()
+{
+    size_t old_size = table_size;
+    struct entry *old_table = table;
+    table_size = old_size ? old_size * 2 : 1024;
+    table = __libc_calloc(table_size, sizeof(struct entry));
+    if (!table)
+        return -1;
+    for (size_t i = 0; i < old_size; i++)
+        if (old_table[i].pointer)
+        {
+            size_t j = hash_pointer(old_table[i].pointer);
+            while (table[j].pointer)
+                j = (j + 1) & (table_size - 1);
+            table[j] = old_table[i];
+        }
+    __libc_free(old_table);
+    return 0;
+}
+
+/*
+ * Puts pointer in the table with the given id, or with a new one if id is
+ * UINT32_MAX.  Returns its id, or UINT32_MAX if there is no memory.
+ */
+uint32_t add_pointer(void *pointer, uint32_t id)
+{
+    if (2 * (table_used + 1) > table_size && grow_table())
+        return UINT32_MAX;
+    if (id == UINT32_MAX)
+        id = free_id_count ? free_ids[--free_id_count] : next_id++;
+    size_t i = hash_pointer(pointer);
+    while (table[i].pointer)
+        i = (i + 1) & (table_size - 1);
+    table[i].pointer = pointer;
+    table[i].id = id;
+    table_used++;
+    return id;
+}
+
+/*
+ * Takes pointer out of the table, and returns its id, or UINT32_MAX if it is
+ * not there.  The entries after it in its run are moved back to fill the hole.
+ */
+uint32_t remove_pointer(void *pointer)
+{
+    if (!table_size)
+        return UINT32_MAX;
+    size_t i = hash_pointer(pointer);
+    while (table[i].pointer != pointer)
+    {
+        if (!table[i].pointer)
+            return UINT32_MAX;
+        i = (i + 1) & (table_size - 1);
+    }
+    uint32_t id = table[i].id;
+    table_used--;
+    for (size_t j = (i + 1) & (table_size - 1); table[j].pointer; j = (j + 1) & (table_size - 1))
+    {
+        size_t home = hash_pointer(table[j].pointer);
+        // Moves entry j into the hole at i unless its home lies between them.
+        if (((j - home) & (table_size - 1)) >= ((j - i) & (table_size - 1)))
+        {
+            table[i] = table[j];
+            i = j;
+        }
+    }
+    table[i].pointer = NULL;
+    return id;
+}
+
+void release_id(uint32_t id)
+{
+    if (free_id_count == free_id_capacity)
+    {
+        size_t capacity = free_id_capacity ? free_id_capacity * 2 : 1024;
+        uint32_t *ids = __libc_realloc(free_ids, capacity * sizeof(uint32_t));
+        if (!ids)
+            return;
+        free_ids = ids;
+        free_id_capacity = capacity;
+    }
+    free_ids[free_id_count++] = id;
+}
+
+/*
+ * Records a call which gave back new_pointer, having been passed old_pointer,
+ * either of which may be NULL, and size, with record_lock held.  The lock is
+ * taken before any call that frees memory, and released after it is recorded,
+ * so that no other thread can be given the same address and record it first.
+ */
+void record(void *old_pointer, void *new_pointer, size_t size)
+{
+    int saved_errno = errno;
+    if (recording)
+    {
+        uint32_t id = old_pointer ? remove_pointer(old_pointer) : UINT32_MAX;
+        if (size > UINT32_MAX)
+            size = UINT32_MAX;
+        if (!new_pointer)
+        {
+            if (id != UINT32_MAX)
+            {
+                trace_write(&writer, TRACE_FREE, id, 0);
+                release_id(id);
+            }
+        }
+        else if (id != UINT32_MAX)
+        {
+            if (add_pointer(new_pointer, id) == UINT32_MAX)
+            {
+                // The object can no longer be tracked, so it is as good as freed.
+                trace_write(&writer, TRACE_FREE, id, 0);
+                release_id(id);
+            }
+            else
+                trace_write(&writer, TRACE_REALLOC, id, size);
+        }
+        else if ((id = add_pointer(new_pointer, UINT32_MAX)) != UINT32_MAX)
+            trace_write(&writer, TRACE_MALLOC, id, size);
+    }
+    errno = saved_errno;
+}
+
+EXPORT void *malloc(size_t size)
+{
+    void *pointer = __libc_malloc(size);
+    if (pointer)
+    {
+        pthread_mutex_lock(&record_lock);
+        record(NULL, pointer, size);
+        pthread_mutex_unlock(&record_lock);
+    }
+    return pointer;
+}
+
+EXPORT void *calloc(size_t count, size_t size)
+{
+    void *pointer = __libc_calloc(count, size);
+    if (pointer)
+    {
+        pthread_mutex_lock(&record_lock);
+        record(NULL, pointer, count * size);
+        pthread_mutex_unlock(&record_lock);
+    }
+    return pointer;
+}
+
+EXPORT void *realloc(void *pointer, size_t size)
+{
+    pthread_mutex_lock(&record_lock);
+    void *new_pointer = __libc_realloc(pointer, size);
+    // A failed realloc leaves the old pointer as it was, unless it freed it.
+    if (new_pointer || (pointer && !size))
+        record(pointer, new_pointer, size);
+    pthread_mutex_unlock(&record_lock);
+    return new_pointer;
+}
+
+EXPORT void free(void *pointer)
+{
+    if (pointer)
+    {
+        pthread_mutex_lock(&record_lock);
+        record(pointer, NULL, 0);
+        pthread_mutex_unlock(&record_lock);
+    }
+    __libc_free(pointer);
+}
+
+void stop_recording()
+{
+    recording = 0;
+}
+
+/*
+ * Copies path to buffer, of the given size, with each %p replaced by the
+ * process id.  Returns 1 if there was a %p, 0 if not, or -1 if it is too long.
+ */
+int expand_path(const char *path, char *buffer, size_t size)
+{
+    char pid[24];
+    int pid_length = 0, found = 0;
+    for (long n = getpid(); n || !pid_length; n /= 10)
+        pid[pid_length++] = '0' + n % 10;
+    size_t length = 0;
+    for (; *path; path++)
+    {
+        if (length + pid_length + 1 >= size)
+            return -1;
+        if (path[0] == '%' && path[1] == 'p')
+        {
+            for (int i = pid_length - 1; i >= 0; i--)
+                buffer[length++] = pid[i];
+            path++;
+            found = 1;
+        }
+        else
+            buffer[length++] = *path;
+    }
+    buffer[length] = '\0';
+    return found;
+}
+
+__attribute__((constructor)) void start_recording()
+{
+    char path[4096];
+    const char *pattern = getenv("SFTRACE");
+    int per_process = pattern ? expand_path(pattern, path, sizeof(path)) : -1;
+    if (per_process < 0 || trace_open(&writer, path))
+        return;
+    if (!per_process)
+        unsetenv("SFTRACE");
+    pthread_atfork(NULL, NULL, stop_recording);
+    recording = 1;
+}
+
+__attribute__((destructor)) void finish_recording()
+{
+    pthread_mutex_lock(&record_lock);
+    if (recording)
+    {
+        recording = 0;
+        trace_close(&writer);
+    }
+    pthread_mutex_unlock(&record_lock);
+}
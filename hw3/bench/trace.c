@@ -0,0 +1,138 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "trace.h"
+
+static int flush_trace(struct trace_writer *writer)
+{
+    size_t written = 0;
+    while (written < writer->length)
+    {
+        ssize_t n = write(writer->fd, writer->buffer + written, writer->length - written);
+        if (n < 0 && errno != EINTR)
+            return -1;
+        if (n > 0)
+            written += n;
+    }
+    writer->length = 0;
+    return 0;
+}
+
+static void put_number(struct trace_writer *writer, uint32_t number)
+{
+    while (number >= 0x80)
+    {
+        writer->buffer[writer->length++] = number | 0x80;
+        number >>= 7;
+    }
+    writer->buffer[writer->length++] = number;
+}
+
+int trace_open(struct trace_writer *writer, const char *path)
+{
+    writer->fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (writer->fd < 0)
+        return -1;
+    memcpy(writer->buffer, TRACE_MAGIC, TRACE_MAGIC_SIZE);
+    writer->length = TRACE_MAGIC_SIZE;
+    return 0;
+}
+
+int trace_write(struct trace_writer *writer, char type, uint32_t id, uint32_t size)
+{
+    // A record takes at most 11 bytes.
+    if (writer->length + 11 > sizeof(writer->buffer) && flush_trace(writer))
+        return -1;
+    writer->buffer[writer->length++] = type;
+    put_number(writer, id);
+    if (type != TRACE_FREE)
+        put_number(writer, size);
+    return 0;
+}
+
+int trace_close(struct trace_writer *writer)
+{
+    int status = flush_trace(writer);
+    if (close(writer->fd))
+        status = -1;
+    return status;
+}
+
+/*
+ * Decodes a number at *p, before end, and moves *p past it.  Returns -1 if it
+ * runs past end or does not fit in 32 bits.
+ */
+static int get_number(const unsigned char **p, const unsigned char *end, uint32_t *number)
+{
+    *number = 0;
+    for (int shift = 0; shift < 35; shift += 7)
+    {
+        if (*p == end)
+            return -1;
+        unsigned char byte = *(*p)++;
+        *number |= (uint32_t)(byte & 0x7f) << shift;
+        if (!(byte & 0x80))
+            return 0;
+    }
+    return -1;
+}
+
+struct trace_op *trace_read(const char *path, size_t *count, uint32_t *objects)
+{
+    FILE *f = fopen(path, "r");
+    if (!f)
+        return NULL;
+    unsigned char *data = NULL;
+    size_t length = 0, got;
+    do
+    {
+        unsigned char *more = realloc(data, length + (1 << 16));
+        if (!more)
+        {
+            free(data);
+            fclose(f);
+            return NULL;
+        }
+        data = more;
+        got = fread(data + length, 1, 1 << 16, f);
+        length += got;
+    } while (got);
+    fclose(f);
+
+    // Every record takes at least two bytes.
+    struct trace_op *ops = malloc((length / 2 + 1) * sizeof(struct trace_op));
+    if (!ops)
+    {
+        free(data);
+        return NULL;
+    }
+    if (length < TRACE_MAGIC_SIZE || memcmp(data, TRACE_MAGIC, TRACE_MAGIC_SIZE))
+        goto invalid;
+    const unsigned char *p = data + TRACE_MAGIC_SIZE, *end = data + length;
+    *count = 0;
+    *objects = 0;
+    while (p < end)
+    {
+        struct trace_op *op = &ops[*count];
+        op->type = *p++;
+        op->size = 0;
+        if ((op->type != TRACE_MALLOC && op->type != TRACE_FREE && op->type != TRACE_REALLOC) ||
+            get_number(&p, end, &op->id) ||
+            (op->type != TRACE_FREE && get_number(&p, end, &op->size)) || op->id == UINT32_MAX)
+            goto invalid;
+        if (op->id >= *objects)
+            *objects = op->id + 1;
+        (*count)++;
+    }
+    free(data);
+    return ops;
+
+invalid:
+    free(data);
+    free(ops);
+    errno = EINVAL;
+    return NULL;
+}
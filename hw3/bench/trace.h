@@ -0,0 +1,78 @@
+/**
+ * Traces of the calls a program makes to malloc, free and realloc, as written by
+ * the recorder (record.c) and the synthetic generators, and replayed by bench.
+ */
+#ifndef TRACE_H
+#define TRACE_H
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * A trace file is TRACE_MAGIC followed by one record per call: the type of the
+ * call, as a byte, then the id of the object, and for TRACE_MALLOC and
+ * TRACE_REALLOC the size requested, each as an unsigned LEB128 number (7 bits a
+ * byte, lowest first, the high bit set on every byte but the last).
+ *
+ * Ids stand for the pointers the program held: an object gets the lowest id not
+ * in use when it is allocated, keeps it across reallocs, and gives it up when it
+ * is freed.  So ids stay as small as the number of objects live at once, most
+ * records take three or four bytes, and a replay needs one slot per id.
+ */
+#define TRACE_MAGIC "SFTRACE1"
+#define TRACE_MAGIC_SIZE 8
+
+#define TRACE_MALLOC 'm'
+#define TRACE_FREE 'f'
+#define TRACE_REALLOC 'r'
+
+struct trace_op
+{
+    char type;     // TRACE_MALLOC, TRACE_FREE or TRACE_REALLOC.
+    uint32_t id;   // Of the object.
+    uint32_t size; // Requested, or 0 for TRACE_FREE.
+};
+
+/*
+ * Writes a trace through a buffer, with nothing but open, write and close, so
+ * that it may be used from within malloc.
+ */
+struct trace_writer
+{
+    int fd;
+    size_t length; // Of what is in buffer.
+    unsigned char buffer[1 << 16];
+};
+
+/*
+ * Creates the trace file at path and writes TRACE_MAGIC to it.
+ *
+ * @return 0 on success, -1 with errno set on failure.
+ */
+int trace_open(struct trace_writer *writer, const char *path);
+
+/*
+ * Adds a record to the trace.  size is ignored for TRACE_FREE.
+ *
+ * @return 0 on success, -1 with errno set if the buffer could not be written.
+ */
+int trace_write(struct trace_writer *writer, char type, uint32_t id, uint32_t size);
+
+/*
+ * Writes out what is left in the buffer and closes the trace file.
+ *
+ * @return 0 on success, -1 with errno set on failure.
+ */
+int trace_close(struct trace_writer *writer);
+
+/*
+ * Reads a whole trace file.
+ *
+ * @param count Set to the number of records.
+ * @param objects Set to one more than the highest id in the trace.
+ *
+ * @return The records, in an array from malloc, or NULL with errno set if the
+ * file cannot be read, or to EINVAL if it is not a trace.
+ */
+struct trace_op *trace_read(const char *path, size_t *count, uint32_t *objects);
+
+#endif
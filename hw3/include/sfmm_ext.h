@@ -0,0 +1,107 @@
+/**
+ * Extensions to the sfmm interface.
+ * These are kept out of sfmm.h, which must not be modified.
+ */
+#ifndef SFMM_EXT_H
+#define SFMM_EXT_H
+#include "sfmm.h"
+
+/*
+ * Turns the thread-safe mode of the allocator on or off.
+ *
+ * @param enable Nonzero to make sf_malloc, sf_free and sf_realloc safe to call
+ * from several threads at once, zero to go back to the single-threaded mode.
+ *
+ * In thread-safe mode each thread keeps a private cache of small blocks (those
+ * of the quick list sizes), modeled on the quick lists: blocks freed by a thread
+ * go into its cache, and are handed out again to that thread without any locking.
+ * Everything else goes through the heap, which is protected by a lock.  A thread
+ * whose cache runs dry refills it from the heap in a batch, and one whose cache
+ * fills up drains half of it back into the heap, in each case taking the lock
+ * once.  A thread's cache is returned to the heap when the thread exits.
+ *
+ * The payload a thread allocates and frees through its cache is only added to
+ * the allocator's totals when it next takes the lock, so sf_peak_utilization()
+ * may be off by the payload of the blocks a cache holds.
+ *
+ * Blocks in a thread's cache are marked as allocated and "in quick list", just
+ * like blocks in the quick lists, but they are not on any of sf_quick_lists.
+ *
+ * A block freed into a cache is checked less than sf_free otherwise checks, as
+ * the heap around it may be changing: the pointer must be non-NULL, aligned and
+ * inside the heap, and the block's own header must mark it allocated and not
+ * in a quick list (which catches freeing it twice).  Its size is not checked
+ * against the heap's end, nor are its neighbors or the previous block's
+ * allocated bit, so a pointer into the middle of a block whose bytes happen
+ * to look like such a header is not caught.
+ *
+ * This must be called while no other thread is using the allocator.
+ */
+void sf_set_thread_safe(int enable);
+
+/*
+ * Turns the slab allocator for small requests on or off.
+ *
+ * @param enable Nonzero to serve requests of up to 256 bytes from slabs, zero to
+ * serve them from the heap as usual.
+ *
+ * A slab is an allocated block whose 1024-byte payload is aligned to 1024 bytes
+ * and holds objects of a single size class (16, 32, 48, 64, 96, 128, 192 or 256
+ * bytes) with no header or footer of their own.  This cuts the overhead of small
+ * requests to the one byte a slab keeps per object for its size, and keeps
+ * objects allocated together on the same page.  The payload size recorded in a
+ * slab's header is the total payload of the objects in use in it.  A slab left
+ * empty is given back to the heap, unless it is the last one of its class with
+ * free objects.
+ *
+ * Objects in slabs may be passed to sf_free and sf_realloc like any other
+ * pointer returned by sf_malloc, whether or not slabs are still turned on.
+ */
+void sf_set_slabs(int enable);
+
+/*
+ * Sets the size from which requests are served by mmap instead of the heap.
+ *
+ * @param threshold The smallest request, in bytes, to be given a region of its
+ * own, or zero (the default) to serve every request from the heap.
+ *
+ * A region is mapped for each such request, and unmapped as soon as it is freed,
+ * so big transient buffers neither grow the heap nor stay resident once freed.
+ * sf_realloc resizes a region with mremap, which does not copy the payload, and
+ * moves it into the heap if it shrinks below the threshold.  A block of the heap
+ * grown by sf_realloc to the threshold or beyond is moved into a region.
+ *
+ * Regions count towards sf_internal_fragmentation() like allocated blocks, and
+ * towards sf_peak_utilization(), whose denominator becomes the most memory the
+ * heap and the regions have taken up at once.
+ */
+void sf_set_mmap_threshold(sf_size_t threshold);
+
+/*
+ * Gives memory the heap is not using back to the system.
+ *
+ * @param pad The number of bytes of free space to leave at the end of the heap.
+ *
+ * @return 1 if any memory was given back, 0 otherwise.
+ *
+ * The free block at the end of the heap, if there is one, is cut down, in whole
+ * pages, to no less than pad bytes, and the epilogue moved back to match.  Since
+ * sfutil's heap cannot really shrink, the pages past the new end stay part of
+ * it, but are released with madvise(MADV_DONTNEED), and are taken back before
+ * sf_mem_grow() is called again.  From then on sf_mem_end() is past the end of
+ * the heap.  The system pages within every free block are released in the same
+ * way, leaving the block itself in place.
+ */
+int sf_trim(sf_size_t pad);
+
+/*
+ * Sets the size of the free block at the end of the heap above which sf_free
+ * trims the heap.
+ *
+ * @param threshold The size, in bytes, above which the free block at the end of
+ * the heap is trimmed, down to threshold bytes, or zero (the default) never to
+ * trim the heap but in sf_trim().
+ */
+void sf_set_trim_threshold(sf_size_t threshold);
+
+#endif
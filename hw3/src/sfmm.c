@@ -2,12 +2,17 @@
  * Do not submit your assignment with a main function in this file.
  * If you submit with a main function in this file, you will get a zero.
  */
+#define _GNU_SOURCE // For mremap.
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include "debug.h"
 #include "sfmm.h"
+#include "sfmm_ext.h"
 #include "errno.h"
+#include <pthread.h>
+#include <sys/mman.h>
+#include <unistd.h>
 
 /*
  ---------------------------------------------PERSONAL MACROS----------------------------------------------------
@@ -25,26 +30,92 @@
 #define SET_PRV_ALLOC_BYTES 0xFFFFFFFFFFFFFFFD
 #define SET_IN_QCKLST_BYTES 0xFFFFFFFFFFFFFFFE
 
+#define HEAP_GROWTH_SHIFT 3 /* The heap grows by at least 1/2^HEAP_GROWTH_SHIFT of itself. */
+#define NUM_SUB_LISTS 8 /* Number of sub-lists each free list is divided into. */
+
+#define THREAD_CACHE_MAX 16  /* Most blocks of one size a thread's cache holds. */
+#define THREAD_CACHE_BATCH 4 /* Blocks taken from the heap to refill a cache. */
+
 /*
  ---------------------------------------GLOBAL VARIABLES----------------------------------------------------
 */
 // int first_alloc = 1;
 int current_payload = 0;
 int max_payload = 0;
+
+/*
+ * Each free list is kept in order of its sub-lists, which split the list's size
+ * class into NUM_SUB_LISTS equal ranges (two-level segregated fit), so that every
+ * block in a sub-list starting above the requested size fits.  sub_list_first
+ * points to the first block of each sub-list in its free list, and the bitmaps
+ * record which lists and sub-lists are not empty, so the first one that fits
+ * is found with a couple of ctz instructions, however big the heap is.
+ */
+unsigned int free_list_bitmap = 0;                       // Bit i set if free list i is not empty.
+unsigned int sub_list_bitmap[NUM_FREE_LISTS];            // Bit j set if sub-list j of list i is not empty.
+sf_block *sub_list_first[NUM_FREE_LISTS][NUM_SUB_LISTS]; // First block of each sub-list, or NULL.
+
+/*
+ * In thread-safe mode, heap_lock protects the heap, the quick lists and the
+ * free lists, and each thread has a cache of small blocks, which only it
+ * touches, indexed like the quick lists.  current_payload and max_payload are
+ * protected by the lock too.  What a thread allocates and frees without the
+ * lock is added up in its cache instead, and folded into them the next time
+ * it takes the lock, as it does to refill or drain its cache, so that the fast
+ * paths share nothing between threads.  max_payload is then only approximate:
+ * it can be off by the payload a thread's cache deals out or takes in between
+ * two visits to the heap.
+ */
+int thread_safe = 0;
+pthread_mutex_t heap_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_key_t thread_cache_key;
+pthread_once_t thread_cache_once = PTHREAD_ONCE_INIT;
+
+struct thread_cache
+{
+    int registered;                          // Set once the exit handler knows about it.
+    int payload;                             // Not yet added to current_payload.
+    int length[NUM_QUICK_LISTS];             // Number of blocks in each list.
+    struct sf_block *first[NUM_QUICK_LISTS]; // Singly linked through body.links.next.
+};
+__thread struct thread_cache thread_cache;
+
+/*
+ * sfutil's heap cannot shrink, so sf_trim() ends the heap trimmed_bytes short of
+ * sf_mem_end(), with the epilogue moved back, and releases the pages in between
+ * to the system.  They are the first to be taken back when the heap grows.  It
+ * only changes with the heap lock held, but is read without it by heap_end().
+ */
+long int trimmed_bytes = 0;
 /*
  ---------------------------------------GETTER/SETTER FUNCTIONS----------------------------------------------------
 */
 sf_header obfiscate(sf_header *header)
 {
-    return ((long int)*header) ^ MAGIC;
+    return ((long int)__atomic_load_n(header, __ATOMIC_RELAXED)) ^ MAGIC;
+}
+
+/*
+ * Replaces the bits of the header not in keep with bits, in a single store.
+ * In thread-safe mode it is a compare-and-swap, since the heap may change the
+ * prv alloc bit of a block while the thread which owns it changes the rest.
+ */
+void update_header(sf_header *header, sf_header keep, sf_header bits)
+{
+    sf_header old = __atomic_load_n(header, __ATOMIC_RELAXED);
+    sf_header new = (((old ^ MAGIC) & keep) | bits) ^ MAGIC;
+    if (!thread_safe)
+    {
+        *header = new;
+        return;
+    }
+    while (!__atomic_compare_exchange_n(header, &old, new, 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+        new = (((old ^ MAGIC) & keep) | bits) ^ MAGIC;
 }
 
 void set_block_payload_size(sf_header *header, sf_header size)
 {
-    size <<= 32;
-    *header = obfiscate(header);
-    *header = (*header & SET_PAYLOAD_BYTES) + size;
-    *header = obfiscate(header);
+    update_header(header, SET_PAYLOAD_BYTES, size << 32);
 }
 int get_block_payload_size(sf_header *header)
 {
@@ -60,10 +131,7 @@ int get_block_size(sf_header *header)
 
 void set_block_size(sf_header *header, int new_size)
 {
-    // new_size <<= ;
-    sf_header unobfiscated_header = obfiscate(header);
-    *header = (unobfiscated_header & SET_BLOCK_BYTES) + new_size;
-    *header = obfiscate(header);
+    update_header(header, SET_BLOCK_BYTES, (sf_header)new_size & BLOCK_BYTES);
 }
 
 int get_header_alloc(sf_header *header)
@@ -73,10 +141,7 @@ int get_header_alloc(sf_header *header)
 }
 void set_block_alloc(sf_header *header, int alloc)
 {
-    alloc <<= 2;
-    *header = obfiscate(header);
-    *header = (*header & SET_ALLOC_BYTES) + alloc;
-    *header = obfiscate(header);
+    update_header(header, SET_ALLOC_BYTES, alloc ? THIS_BLOCK_ALLOCATED : 0);
 }
 
 int get_header_prv_alloc(sf_header *header)
@@ -86,17 +151,12 @@ int get_header_prv_alloc(sf_header *header)
 }
 void set_block_prv_alloc(sf_header *header, int prv_alloc)
 {
-    prv_alloc <<= 1;
-    *header = obfiscate(header);
-    *header = (*header & SET_PRV_ALLOC_BYTES) + prv_alloc;
-    *header = obfiscate(header);
+    update_header(header, SET_PRV_ALLOC_BYTES, prv_alloc ? PREV_BLOCK_ALLOCATED : 0);
 }
 
 void set_block_in_qcklst(sf_header *header, int in_qcklst)
 {
-    *header = obfiscate(header);
-    *header = (*header & SET_IN_QCKLST_BYTES) + in_qcklst;
-    *header = obfiscate(header);
+    update_header(header, SET_IN_QCKLST_BYTES, in_qcklst ? IN_QUICK_LIST : 0);
 }
 int get_header_in_qcklst(sf_header *header)
 {
@@ -104,6 +164,51 @@ int get_header_in_qcklst(sf_header *header)
     return (unobfiscated_header & IN_QUICK_LIST);
 }
 
+/*
+ * Counts size bytes of payload as allocated, or freed if size is negative,
+ * with the heap lock held.
+ */
+void add_payload(int size)
+{
+    current_payload += size;
+    if (current_payload > max_payload)
+        max_payload = current_payload;
+}
+
+/*
+ * The same, without the heap lock.  In thread-safe mode the change is kept in
+ * the calling thread's cache until lock_heap() folds it in.
+ */
+void add_payload_unlocked(int size)
+{
+    if (thread_safe)
+        thread_cache.payload += size;
+    else
+        add_payload(size);
+}
+
+void *heap_end()
+{
+    return sf_mem_end() - __atomic_load_n(&trimmed_bytes, __ATOMIC_RELAXED);
+}
+
+void lock_heap()
+{
+    if (thread_safe)
+        pthread_mutex_lock(&heap_lock);
+    if (thread_cache.payload)
+    {
+        add_payload(thread_cache.payload);
+        thread_cache.payload = 0;
+    }
+}
+
+void unlock_heap()
+{
+    if (thread_safe)
+        pthread_mutex_unlock(&heap_lock);
+}
+
 /*
  ---------------------------------------------PERSONAL FUNCTIONS----------------------------------------------------
 */
@@ -116,16 +221,14 @@ void validate_pointer(void *pp)
         abort();
 
     sf_block *pp_block = (sf_block *)((long int)pp - HEADER_SIZE - HEADER_SIZE);
-    pp_block->body.links.next = NULL;
-    pp_block->body.links.prev = NULL;
-    if ((get_block_size(&pp_block->header)) < MIN_BLOCK_SIZE)
+    sf_block *first_block = (sf_block *)(sf_mem_start() + 4 * HEADER_SIZE);
+    if ((long int)&pp_block->header < (long int)first_block || pp >= heap_end())
         abort();
 
-    sf_block *first_block = (sf_block *)(sf_mem_start() + 4 * HEADER_SIZE);
-    if ((long int)&pp_block->header < (long int)first_block)
+    if ((get_block_size(&pp_block->header)) < MIN_BLOCK_SIZE)
         abort();
 
-    sf_block *heap_block_end = (sf_block *)(sf_mem_end() - 2 * HEADER_SIZE);
+    sf_block *heap_block_end = (sf_block *)(heap_end() - 2 * HEADER_SIZE);
     if ((long int)pp_block + get_block_size(&pp_block->header) > (long int)heap_block_end)
         abort();
 
@@ -147,247 +250,286 @@ sf_size_t correct_size(sf_size_t size)
     return size;
 }
 
+sf_block *next_heap_block(sf_block *block)
+{
+    return (sf_block *)((long int)block + get_block_size(&block->header));
+}
+
+sf_block *get_prev_heap_block(sf_block *block)
+{
+    return (sf_block *)((long int)block - get_block_size(&block->prev_footer));
+}
+
+/*
+ * Takes the first block of the given size off its quick list, or returns NULL
+ * if the list is empty.  The block stays marked as allocated.
+ */
 void *check_quick_lists(sf_size_t size)
 {
     int quick_list_index = ((int)size - MIN_BLOCK_SIZE) / ALIGN_SIZE;
 
-    if (quick_list_index > 9 || quick_list_index < 0)
+    if (quick_list_index > NUM_QUICK_LISTS - 1 || quick_list_index < 0)
         return NULL;
     if (!sf_quick_lists[quick_list_index].length)
         return NULL;
 
-    sf_block *currentBlock = sf_quick_lists[quick_list_index].first;
-    for (int i = 0; i < sf_quick_lists[quick_list_index].length; i++)
-    {
-        if (get_block_size(&currentBlock->header) == size)
-        {
-            sf_block *prevBlock = currentBlock->body.links.prev;
-            sf_block *nextBlock = currentBlock->body.links.next;
-            if (prevBlock)
-                prevBlock->body.links.next = nextBlock;
-            if (nextBlock)
-                nextBlock->body.links.prev = prevBlock;
-            if (currentBlock == sf_quick_lists[quick_list_index].first)
-                sf_quick_lists[quick_list_index].first = nextBlock;
-            set_block_in_qcklst(&currentBlock->header, 0);
-            sf_quick_lists[quick_list_index].length--;
-            currentBlock->body.links.next = NULL;
-            currentBlock->body.links.prev = NULL;
-            return currentBlock;
-        }
-        currentBlock = currentBlock->body.links.next;
-    }
-    return NULL;
+    sf_block *block = sf_quick_lists[quick_list_index].first;
+    sf_quick_lists[quick_list_index].first = block->body.links.next;
+    sf_quick_lists[quick_list_index].length--;
+    set_block_in_qcklst(&block->header, 0);
+    return block;
 }
 
 int get_free_list_index(sf_size_t size)
 {
-    int list_min = MIN_BLOCK_SIZE;
-    if (list_min == size)
+    if (size <= MIN_BLOCK_SIZE)
         return 0;
-    int index = 0;
-    while ((size > list_min) && index != NUM_FREE_LISTS - 1)
-    {
-        if (size <= list_min * 2)
-        {
-            return index + 1;
-        }
-        index++;
-        list_min *= 2;
-    }
-    return NUM_FREE_LISTS - 1;
+    // (size - 1) / M has i bits when size is in (2^(i-1) M, 2^i M].
+    int index = 32 - __builtin_clz((size - 1) / MIN_BLOCK_SIZE);
+    return index < NUM_FREE_LISTS - 1 ? index : NUM_FREE_LISTS - 1;
 }
 
-sf_block *get_prev_heap_block(sf_block *block)
+/*
+ * Free list i > 0 starts above (2^(i-1))M, and its sub-lists each span a range
+ * of an eighth of that, but at least ALIGN_SIZE.  The last list is divided as
+ * if it ended at 512M, with its last sub-list holding everything bigger.
+ */
+sf_size_t sub_list_step(int index)
 {
-    // sf_block *prev_block = (sf_block *)(prev_footer - (get_block_size(prev_footer) * 8) + (HEADER_SIZE * 8));
-    if (!block->prev_footer)
-        return NULL;
-    sf_block *prev_block = (sf_block *)((long int)block - (get_block_size(&block->prev_footer)));
-    return prev_block;
+    sf_size_t step = (MIN_BLOCK_SIZE << (index - 1)) / NUM_SUB_LISTS;
+    return step > ALIGN_SIZE ? step : ALIGN_SIZE;
+}
+
+int get_sub_list_index(sf_size_t size, int index)
+{
+    if (!index)
+        return 0;
+    sf_size_t sub = (size - (MIN_BLOCK_SIZE << (index - 1)) - 1) / sub_list_step(index);
+    return sub < NUM_SUB_LISTS ? sub : NUM_SUB_LISTS - 1;
 }
 
+/*
+ * Returns the smallest size a block in the given sub-list can have.
+ */
+sf_size_t sub_list_min(int index, int sub)
+{
+    if (!index)
+        return MIN_BLOCK_SIZE;
+    return (MIN_BLOCK_SIZE << (index - 1)) + sub * sub_list_step(index) + ALIGN_SIZE;
+}
+
+/*
+ * Free blocks are inserted at the front of their sub-list (LIFO).  Every free
+ * block is on exactly one free list, except while it is being split or coalesced.
+ */
 void place_in_free_list(sf_block *block)
 {
-    int block_size = get_block_size(&block->header);
-    int free_list_index = get_free_list_index(block_size);
-    sf_block *sentinell = &sf_free_list_heads[free_list_index];
-    sf_block *next_block = sentinell->body.links.next;
-    block->body.links.prev = sentinell;
-    if (block == next_block)
-        return;
-    if (next_block != sentinell)
+    sf_size_t size = get_block_size(&block->header);
+    int index = get_free_list_index(size), sub = get_sub_list_index(size, index);
+    sf_block *before = sub_list_first[index][sub];
+    if (!before)
     {
-        block->body.links.next = next_block;
-        next_block->body.links.prev = block;
+        unsigned int later = sub_list_bitmap[index] & (~0u << (sub + 1));
+        before = later ? sub_list_first[index][__builtin_ctz(later)] : &sf_free_list_heads[index];
     }
-    else
+    block->body.links.next = before;
+    block->body.links.prev = before->body.links.prev;
+    before->body.links.prev->body.links.next = block;
+    before->body.links.prev = block;
+    sub_list_first[index][sub] = block;
+    sub_list_bitmap[index] |= 1u << sub;
+    free_list_bitmap |= 1u << index;
+}
+
+void remove_from_free_list(sf_block *block)
+{
+    sf_size_t size = get_block_size(&block->header);
+    int index = get_free_list_index(size), sub = get_sub_list_index(size, index);
+    if (sub_list_first[index][sub] == block)
     {
-        block->body.links.next = sentinell;
-        sentinell->body.links.prev = block;
+        sf_block *next = block->body.links.next;
+        if (next != &sf_free_list_heads[index] && get_sub_list_index(get_block_size(&next->header), index) == sub)
+            sub_list_first[index][sub] = next;
+        else
+        {
+            sub_list_first[index][sub] = NULL;
+            sub_list_bitmap[index] &= ~(1u << sub);
+            if (!sub_list_bitmap[index])
+                free_list_bitmap &= ~(1u << index);
+        }
     }
-    sentinell->body.links.next = block;
+    block->body.links.prev->body.links.next = block->body.links.next;
+    block->body.links.next->body.links.prev = block->body.links.prev;
+    block->body.links.next = NULL;
+    block->body.links.prev = NULL;
+}
 
-    // int block_size = get_block_size(&block->header);
-    // int free_list_index = get_free_list_index(block_size);
-    // sf_block *sentinell = &sf_free_list_heads[free_list_index];
-    // sf_block *prev_block = sentinell->body.links.next;
-    // block->body.links.next = sentinell;
+/*
+ * Returns a free block of at least the given size, or NULL if there is none.
+ * The first sub-list whose smallest size is at least size is found from the
+ * bitmaps, and its first block taken.  Only when there is no such block is the
+ * sub-list holding size itself searched, since only some of its blocks fit.
+ */
+sf_block *find_free_block(sf_size_t size)
+{
+    int index = get_free_list_index(size), sub = get_sub_list_index(size, index);
+    int next_sub = size > sub_list_min(index, sub) ? sub + 1 : sub;
 
-    // if (prev_block != sentinell)
-    // {
-    //     block->body.links.prev = prev_block;
-    //     prev_block->body.links.next = block;
-    // }
-    // else
-    // {
-    //     block->body.links.prev = sentinell;
-    //     sentinell->body.links.next = block;
-    // }
-    // sentinell->body.links.prev = block;
+    unsigned int subs = sub_list_bitmap[index] & (~0u << next_sub);
+    if (subs)
+        return sub_list_first[index][__builtin_ctz(subs)];
+    unsigned int lists = free_list_bitmap & (~0u << (index + 1));
+    if (lists)
+    {
+        int found = __builtin_ctz(lists);
+        return sub_list_first[found][__builtin_ctz(sub_list_bitmap[found])];
+    }
+    if (next_sub == sub)
+        return NULL;
+    for (sf_block *block = sub_list_first[index][sub];
+         block && block != &sf_free_list_heads[index] &&
+         get_sub_list_index(get_block_size(&block->header), index) == sub;
+         block = block->body.links.next)
+        if (get_block_size(&block->header) >= size)
+            return block;
+    return NULL;
 }
 
-void remove_from_free_list(sf_block *block)
+/*
+ * Makes block a free block of the given size, keeping its prv alloc bit, and
+ * writes its footer and clears the prv alloc bit of the block after it.
+ */
+void make_free(sf_block *block, int size)
 {
-    sf_block *prev_block = block->body.links.prev;
-    sf_block *next_block = block->body.links.next;
-    if (prev_block)
-        prev_block->body.links.next = next_block;
-    if (next_block)
-        next_block->body.links.prev = prev_block;
-    block->body.links.next = NULL;
-    block->body.links.prev = NULL;
+    update_header(&block->header, PREV_BLOCK_ALLOCATED, size);
+    sf_block *next = (sf_block *)((long int)block + size);
+    next->prev_footer = block->header;
+    set_block_prv_alloc(&next->header, 0);
 }
 
+/*
+ * Frees block, which must not be on any list, merging it with whichever of
+ * the blocks before and after it are free, and puts the result on a free list.
+ */
 sf_block *coalesce(sf_block *block)
 {
-
-    sf_block *epilogue = (sf_block *)(sf_mem_end() - HEADER_SIZE - HEADER_SIZE);
-    sf_block *next_block = (sf_block *)((long int)block + get_block_size(&block->header));
+    int size = get_block_size(&block->header);
+    sf_block *next = next_heap_block(block);
+    if (!get_header_alloc(&next->header))
+    {
+        remove_from_free_list(next);
+        size += get_block_size(&next->header);
+    }
     if (!get_header_prv_alloc(&block->header))
     {
-        if (block->body.links.next || block->body.links.prev)
-            remove_from_free_list(block);
-        sf_block *prev_block = get_prev_heap_block(block);
-        if (!prev_block)
-            return block;
-        if (prev_block->body.links.next || prev_block->body.links.prev)
-            remove_from_free_list(prev_block);
-        int prev_block_size = get_block_size(&prev_block->header);
-        int curr_block_size = get_block_size(&block->header);
-        set_block_size(&prev_block->header, prev_block_size + curr_block_size);
-        place_in_free_list(prev_block);
-        sf_footer *footer = (sf_footer *)((long int)prev_block + prev_block_size + curr_block_size);
-        *footer = prev_block->header;
-        if (!get_header_prv_alloc(&prev_block->header))
-            prev_block = coalesce(prev_block);
-        next_block = (sf_block *)((long int)prev_block + get_block_size(&prev_block->header));
-        set_block_prv_alloc(&next_block->header, 0);
-        if (!get_header_alloc(&next_block->header))
-        {
-            sf_footer *footer = (sf_footer *)((long int)next_block + get_block_size(&next_block->header));
-            *footer = next_block->header;
-            sf_block *next = (sf_block *)footer;
-            next->prev_footer = next_block->header;
-            if (next_block != epilogue)
-                return coalesce(next_block);
-        }
-        return prev_block;
+        block = get_prev_heap_block(block);
+        remove_from_free_list(block);
+        size += get_block_size(&block->header);
     }
-    if (next_block != epilogue && !get_header_alloc(&next_block->header))
-
-        return coalesce(next_block);
+    make_free(block, size);
+    place_in_free_list(block);
     return block;
-    // TO BE IMPLEMENTED
-    // gotta coalesce the next block
 }
 
-sf_block *mem_grow_block()
+/*
+ * Grows the heap so that the free block at its end has at least the given size.
+ * The heap grows by the shortfall, counting the free block already at the end,
+ * rounded up to pages, and by at least 1/2^HEAP_GROWTH_SHIFT of its size, so that
+ * a heap which keeps growing does so in geometrically bigger steps.  Pages given
+ * up by sf_trim() are taken back first, and sf_mem_grow() adds a page per call
+ * after that, but the new pages become one block, with the old epilogue as its
+ * header, which is coalesced, and the epilogue rewritten, just once.
+ * Returns the free block at the end of the heap, or NULL if the heap cannot grow
+ * enough, in which case whatever it did grow by is left in the free lists.
+ */
+sf_block *mem_grow_block(sf_size_t size)
 {
-    sf_block *epilogue = (sf_block *)(sf_mem_end() - HEADER_SIZE - HEADER_SIZE);
-    sf_block *new_page = epilogue;
-    void *mem_grow = sf_mem_grow();
-    if (!mem_grow)
+    sf_block *new_page = (sf_block *)(heap_end() - HEADER_SIZE - HEADER_SIZE);
+    long int have = 0;
+    if (!get_header_prv_alloc(&new_page->header))
+        have = get_block_size(&new_page->prev_footer);
+    long int pages = ((long int)size - have + PAGE_SZ - 1) / PAGE_SZ;
+    long int heap_pages = (heap_end() - sf_mem_start()) / PAGE_SZ;
+    if (pages < heap_pages >> HEAP_GROWTH_SHIFT)
+        pages = heap_pages >> HEAP_GROWTH_SHIFT;
+    if (pages < 1)
+        pages = 1;
+
+    long int grown = trimmed_bytes / PAGE_SZ < pages ? trimmed_bytes / PAGE_SZ : pages;
+    __atomic_store_n(&trimmed_bytes, trimmed_bytes - grown * PAGE_SZ, __ATOMIC_RELAXED);
+    while (grown < pages && sf_mem_grow())
+        grown++;
+    if (!grown)
         return NULL;
-    size_t epilogue_size = sizeof(*epilogue);
-    epilogue = memcpy((void *)(sf_mem_end() - HEADER_SIZE - HEADER_SIZE), epilogue, epilogue_size);
-    set_block_alloc(&new_page->header, 0);
-    set_block_in_qcklst(&new_page->header, 0);
-    set_block_prv_alloc(&new_page->header, 0); // fix
-    set_block_size(&new_page->header, PAGE_SZ);
-    new_page->prev_footer = epilogue->prev_footer;
-    // new_page->prev_footer = *((sf_footer *)((long int)new_page));
-    epilogue->prev_footer = new_page->header;
-    return new_page;
+    sf_block *epilogue = (sf_block *)(heap_end() - HEADER_SIZE - HEADER_SIZE);
+    update_header(&epilogue->header, 0, THIS_BLOCK_ALLOCATED);
+    update_header(&new_page->header, PREV_BLOCK_ALLOCATED, (grown * PAGE_SZ) | THIS_BLOCK_ALLOCATED);
+    sf_block *block = coalesce(new_page);
+    return get_block_size(&block->header) >= (int)size ? block : NULL;
 }
 
+/*
+ * Takes a block of at least the given size off the free lists, growing the
+ * heap if there is none.  Returns NULL if the heap cannot grow enough.
+ */
 void *check_free_lists(sf_size_t size)
 {
+    sf_block *block = find_free_block(size);
+    if (!block)
+        block = mem_grow_block(size);
+    if (!block)
+        return NULL;
+    remove_from_free_list(block);
+    return block;
+}
 
-    for (int free_list_index = get_free_list_index(size); free_list_index < NUM_FREE_LISTS; free_list_index++)
-    {
-        sf_block *list_head = &sf_free_list_heads[free_list_index];
-        sf_block *current_block = list_head->body.links.next;
-        if (!list_head->body.links.next)
-            continue;
-        while (list_head != current_block)
-        {
-            if (get_block_size(&current_block->header) >= size)
-            {
-                sf_block *prev_block = current_block->body.links.prev;
-                sf_block *next_block = current_block->body.links.next;
-                prev_block->body.links.next = next_block;
-                next_block->body.links.prev = prev_block;
-                return current_block;
-            }
-            current_block = current_block->body.links.next;
-        }
-    }
-    sf_block *coalesced_block;
-    int keep_looping = 1;
-    while (keep_looping)
-    {
-        sf_block *new_block = mem_grow_block();
-        // sf_show_heap();
-        if (!new_block)
-            return NULL;
-        coalesced_block = coalesce(new_block);
-        if (get_block_size(&coalesced_block->header) >= (int)size)
-        {
-            keep_looping = 0;
-        }
-    }
-    return coalesced_block;
+/*
+ * Marks a block which is on no list as allocated.
+ */
+void allocate(sf_block *block)
+{
+    update_header(&block->header, PREV_BLOCK_ALLOCATED | BLOCK_BYTES, THIS_BLOCK_ALLOCATED);
+    set_block_prv_alloc(&next_heap_block(block)->header, 1);
 }
 
+/*
+ * Shrinks an allocated block to size, which must leave at least MIN_BLOCK_SIZE,
+ * and frees the remainder.
+ */
 void split(sf_block *block, sf_size_t size)
 {
-    sf_block *epilogue = (sf_block *)(sf_mem_end() - HEADER_SIZE - HEADER_SIZE);
-    // sf_show_heap();
     int curr_size = get_block_size(&block->header);
     set_block_size(&block->header, size);
-    remove_from_free_list(block);
-    sf_block *new_block = (sf_block *)((long int)block + (size));
-    set_block_size(&new_block->header, curr_size - size);
-    set_block_payload_size(&new_block->header, 0);
-    set_block_alloc(&new_block->header, 0);
-    set_block_prv_alloc(&new_block->header, 1);
-    set_block_in_qcklst(&new_block->header, 0);
-    sf_footer *footer = (sf_footer *)((long int)block + curr_size);
-    *footer = new_block->header;
-    place_in_free_list(new_block);
-    new_block->prev_footer = block->header;
-    set_block_prv_alloc(&((sf_block *)((long int)new_block + get_block_size(&new_block->header)))->header, 0);
-    if ((sf_block *)((long int)new_block + get_block_size(&new_block->header)) == epilogue)
-    {
-        set_block_prv_alloc(&epilogue->header, 0);
-    }
+    sf_block *new_block = (sf_block *)((long int)block + size);
+    update_header(&new_block->header, 0, (curr_size - size) | PREV_BLOCK_ALLOCATED | THIS_BLOCK_ALLOCATED);
+    coalesce(new_block);
 }
 
-void allocate(sf_block *block)
+/*
+ * Grows an allocated block to at least size without moving it, by absorbing the
+ * free block after it, and growing the heap first if that does not suffice but
+ * reaches the epilogue.  Any remainder of at least MIN_BLOCK_SIZE is split off
+ * again.  Returns 0, changing nothing, if the block cannot grow in place.
+ */
+int extend_in_place(sf_block *block, sf_size_t size)
 {
-    set_block_alloc(&block->header, 1);
-    set_block_in_qcklst(&block->header, 0);
+    int block_size = get_block_size(&block->header);
+    sf_block *next = next_heap_block(block);
+    sf_block *epilogue = (sf_block *)(heap_end() - HEADER_SIZE - HEADER_SIZE);
+    int next_size = get_header_alloc(&next->header) ? 0 : get_block_size(&next->header);
+    if (block_size + next_size < (int)size)
+    {
+        if ((sf_block *)((long int)next + next_size) != epilogue || !mem_grow_block(size - block_size))
+            return 0;
+        next = next_heap_block(block);
+        next_size = get_block_size(&next->header);
+    }
+    remove_from_free_list(next);
+    set_block_size(&block->header, block_size + next_size);
+    set_block_prv_alloc(&next_heap_block(block)->header, 1);
+    if (block_size + next_size - (int)size >= MIN_BLOCK_SIZE)
+        split(block, size);
+    return 1;
 }
 
 void initialize_quick_lists()
@@ -403,265 +545,990 @@ void initialize_free_lists()
 {
     for (int i = 0; i < NUM_FREE_LISTS; i++)
     {
-        if (!sf_free_list_heads[i].body.links.next || !sf_free_list_heads[i].body.links.prev)
-        {
-            sf_free_list_heads[i].body.links.next = &sf_free_list_heads[i];
-            sf_free_list_heads[i].body.links.prev = &sf_free_list_heads[i];
-        }
+        sf_free_list_heads[i].body.links.next = &sf_free_list_heads[i];
+        sf_free_list_heads[i].body.links.prev = &sf_free_list_heads[i];
+        sub_list_bitmap[i] = 0;
+        for (int j = 0; j < NUM_SUB_LISTS; j++)
+            sub_list_first[i][j] = NULL;
     }
+    free_list_bitmap = 0;
 }
 
 void place_in_quick_list(sf_block *block)
 {
     int quick_list_index = (get_block_size(&block->header) - MIN_BLOCK_SIZE) / ALIGN_SIZE;
-    set_block_in_qcklst(&block->header, 1);
 
-    if (sf_quick_lists[quick_list_index].length == 0)
-    {
-        sf_quick_lists[quick_list_index].first = block;
-        sf_quick_lists[quick_list_index].length++;
-    }
-    else if (sf_quick_lists[quick_list_index].length != QUICK_LIST_MAX)
-    {
-        sf_block *head = sf_quick_lists[quick_list_index].first;
-        block->body.links.next = head;
-        block->body.links.prev = NULL;
-
-        head->body.links.prev = block;
-        sf_quick_lists[quick_list_index].first = block;
-        sf_quick_lists[quick_list_index].length++;
-    }
-    else
+    if (sf_quick_lists[quick_list_index].length == QUICK_LIST_MAX)
     {
+        // Flush the list, returning its blocks to the main pool.
         sf_block *current_block = sf_quick_lists[quick_list_index].first;
-        sf_block *next_block = (sf_block *)current_block->body.links.next;
-        for (int i = 0; i < sf_quick_lists[quick_list_index].length; i++)
+        while (current_block)
         {
-            set_block_in_qcklst(&current_block->header, 0);
-            set_block_alloc(&current_block->header, 0);
-            sf_footer *footer = (sf_footer *)((long int)current_block + get_block_size(&current_block->header));
-            *footer = current_block->header;
-            sf_block *next = (sf_block *)footer;
-            next->prev_footer = current_block->header;
-            set_block_prv_alloc(&next->header, 0);
-            current_block = coalesce(current_block);
-            footer = (sf_footer *)((long int)current_block + get_block_size(&current_block->header));
-            *footer = current_block->header;
-            next = (sf_block *)footer;
-            next->prev_footer = current_block->header;
-            place_in_free_list(current_block);
+            sf_block *next_block = current_block->body.links.next;
+            coalesce(current_block);
             current_block = next_block;
-            if (next_block)
-                next_block = (sf_block *)next_block->body.links.next;
         }
-        sf_quick_lists[quick_list_index].first = block;
-        sf_quick_lists[quick_list_index].length = 1;
-
-        // sf_block *head = sf_quick_lists[quick_list_index].first;
-        // sf_block *next_block = (sf_block *)head->body.links.next;
-        // block->body.links.next = next_block;
-        // block->body.links.prev = NULL;
-
-        // next_block->body.links.prev = block;
-        // sf_quick_lists[quick_list_index].first = block;
-        // set_block_in_qcklst(&head->header, 0);
-        // set_block_alloc(&head->header, 0);
-        // sf_footer *footer = (sf_footer *)((long int)head + get_block_size(&head->header));
-        // *footer = head->header;
-        // sf_block *next = (sf_block *)footer;
-        // next->prev_footer = head->header;
-        // head = coalesce(head);
-        // place_in_free_list(head);
+        sf_quick_lists[quick_list_index].first = NULL;
+        sf_quick_lists[quick_list_index].length = 0;
     }
+    set_block_in_qcklst(&block->header, 1);
+    block->body.links.next = sf_quick_lists[quick_list_index].first;
+    sf_quick_lists[quick_list_index].first = block;
+    sf_quick_lists[quick_list_index].length++;
 }
 
 /*
- ---------------------------------------------REQUIRED FUNCTIONS----------------------------------------------------
+ ---------------------------------------------HEAP FUNCTIONS----------------------------------------------------
 */
-void *sf_malloc(sf_size_t size)
+
+/*
+ * heap_malloc, heap_free and heap_realloc do the work of sf_malloc, sf_free and
+ * sf_realloc on the heap itself.  In thread-safe mode they are called with the
+ * heap lock held.  heap_malloc takes a block size and returns a block with no
+ * payload size set, or NULL.
+ */
+sf_block *heap_malloc(sf_size_t size)
 {
-    sf_size_t client_size = size;
-    if (!size)
-        return NULL;
-    size = correct_size(size);
-    sf_block *epilogue;
     if (sf_mem_start() == sf_mem_end())
     {
         initialize_quick_lists();
         initialize_free_lists();
-        void *mem_grow = sf_mem_grow();
-        epilogue = (sf_block *)(sf_mem_end() - HEADER_SIZE - HEADER_SIZE);
-        if (!mem_grow)
-        {
-            sf_errno = ENOMEM;
+        if (!sf_mem_grow())
             return NULL;
-        }
-        sf_block *prologue = (sf_block *)(mem_grow);
-        set_block_payload_size(&prologue->header, 0);
-        set_block_size(&prologue->header, MIN_BLOCK_SIZE);
-        set_block_alloc(&prologue->header, 1);
-        set_block_in_qcklst(&prologue->header, 0);
+        sf_block *prologue = (sf_block *)sf_mem_start();
+        update_header(&prologue->header, 0, MIN_BLOCK_SIZE | THIS_BLOCK_ALLOCATED);
+
+        sf_block *epilogue = (sf_block *)(sf_mem_end() - HEADER_SIZE - HEADER_SIZE);
+        update_header(&epilogue->header, 0, THIS_BLOCK_ALLOCATED);
 
         sf_block *first_block = (sf_block *)(sf_mem_start() + 4 * HEADER_SIZE);
-        set_block_size(&first_block->header, PAGE_SZ - MIN_BLOCK_SIZE - 2 * HEADER_SIZE);
-        set_block_alloc(&first_block->header, 0);
-        set_block_prv_alloc(&first_block->header, 1);
-        set_block_in_qcklst(&first_block->header, 0);
+        update_header(&first_block->header, 0, PREV_BLOCK_ALLOCATED);
+        make_free(first_block, PAGE_SZ - MIN_BLOCK_SIZE - 2 * HEADER_SIZE);
         place_in_free_list(first_block);
-
-        set_block_payload_size(&prologue->header, 0);
-        set_block_size(&epilogue->header, 0);
-        set_block_alloc(&epilogue->header, 1);
-        set_block_prv_alloc(&epilogue->header, 0);
-        set_block_in_qcklst(&epilogue->header, 0);
-        // epilogue->header = first_block->header;
-
-        sf_footer *footer = (sf_footer *)((long int)epilogue);
-        *footer = first_block->header;
-        epilogue->prev_footer = first_block->header;
-        // sf_show_heap();
-
-        // first_alloc = 0;
     }
     sf_block *address = check_quick_lists(size);
     if (address)
-        goto block_found;
+        return address;
 
     address = check_free_lists(size);
     if (!address)
-    {
-        sf_errno = ENOMEM;
         return NULL;
-    }
-block_found:
+    allocate(address);
     if (get_block_size(&address->header) - (int)size >= MIN_BLOCK_SIZE)
-    {
         split(address, size);
-    }
-    allocate(address);
-    if (address->body.links.next)
-    {
-        remove_from_free_list(address);
-    }
-    sf_block *next_block = (sf_block *)((long int)address + get_block_size(&address->header));
-    set_block_prv_alloc(&next_block->header, 1);
-    if ((sf_block *)((long int)address + get_block_size(&address->header)) == epilogue)
-    {
-        set_block_prv_alloc(&epilogue->header, 1);
-    }
-    set_block_payload_size(&address->header, client_size);
-
-    // printf("address: 0x%.8lx\n", (long int)address);
-    current_payload += client_size;
-    if (current_payload > max_payload)
-        max_payload = current_payload;
-    return &address->body.payload;
+    return address;
 }
 
-void sf_free(void *pp)
+void heap_free(sf_block *pp_block)
 {
-    validate_pointer(pp);
-    sf_block *pp_block = (sf_block *)((long int)pp - HEADER_SIZE - HEADER_SIZE);
     int quick_list_index = (get_block_size(&pp_block->header) - MIN_BLOCK_SIZE) / ALIGN_SIZE;
-    // printf("%d", quick_list_index);
-    // abort();
 
-    current_payload -= get_block_payload_size(&pp_block->header);
+    add_payload(-get_block_payload_size(&pp_block->header));
     set_block_payload_size(&pp_block->header, 0);
     if (quick_list_index < NUM_QUICK_LISTS)
-    {
         place_in_quick_list(pp_block);
-    }
     else
-    {
-        sf_block *epilogue = (sf_block *)(sf_mem_end() - HEADER_SIZE - HEADER_SIZE);
-        set_block_alloc(&pp_block->header, 0);
-        sf_footer *footer = (sf_footer *)((long int)pp_block + get_block_size(&pp_block->header));
-        sf_block *next_block = (sf_block *)footer;
-        next_block->prev_footer = pp_block->header;
-        set_block_prv_alloc(&next_block->header, 0);
-        *footer = pp_block->header;
-        int pp_size = get_block_size(&pp_block->header);
-        pp_block = coalesce(pp_block);
-        if (pp_size == get_block_size(&pp_block->header))
-            place_in_free_list(pp_block);
-        if ((sf_block *)((long int)pp_block + get_block_size(&pp_block->header)) == epilogue)
-        {
-            set_block_prv_alloc(&epilogue->header, 1);
-        }
+        coalesce(pp_block);
+}
 
-        sf_block *next = (sf_block *)((long int)pp_block + get_block_size(&pp_block->header));
-        set_block_prv_alloc(&next->header, 0);
-    }
+/*
+ ---------------------------------------------THREAD CACHES----------------------------------------------------
+*/
+int thread_cache_index(sf_size_t size)
+{
+    int index = ((int)size - MIN_BLOCK_SIZE) / ALIGN_SIZE;
+    if (index < 0 || index >= NUM_QUICK_LISTS)
+        return -1;
+    return index;
 }
 
-void *sf_realloc(void *pp, sf_size_t rsize)
+void thread_cache_push(struct thread_cache *cache, int index, sf_block *block)
 {
-    validate_pointer(pp);
-    if (!rsize)
-    {
-        sf_free(pp);
-        return NULL;
-    }
-    int client_size = rsize;
-    rsize = correct_size(rsize);
-    sf_block *pp_block = (sf_block *)((long int)pp - HEADER_SIZE - HEADER_SIZE);
+    update_header(&block->header, SET_PAYLOAD_BYTES & SET_IN_QCKLST_BYTES, IN_QUICK_LIST);
+    block->body.links.next = cache->first[index];
+    cache->first[index] = block;
+    cache->length[index]++;
+}
 
-    if (rsize > get_block_size(&pp_block->header))
+sf_block *thread_cache_pop(struct thread_cache *cache, int index)
+{
+    sf_block *block = cache->first[index];
+    cache->first[index] = block->body.links.next;
+    cache->length[index]--;
+    block->body.links.next = NULL; // As validate_pointer() leaves them for heap_free().
+    block->body.links.prev = NULL;
+    set_block_in_qcklst(&block->header, 0);
+    return block;
+}
+
+/*
+ * Returns all but keep of the blocks in one list of a cache to the heap.
+ */
+void thread_cache_drain(struct thread_cache *cache, int index, int keep)
+{
+    lock_heap();
+    while (cache->length[index] > keep)
+        heap_free(thread_cache_pop(cache, index));
+    unlock_heap();
+}
+
+/*
+ * Returns every block in a cache to the heap, and folds in the thread's payload.
+ */
+void thread_cache_flush(void *cache)
+{
+    lock_heap();
+    for (int i = 0; i < NUM_QUICK_LISTS; i++)
+        while (((struct thread_cache *)cache)->length[i])
+            heap_free(thread_cache_pop(cache, i));
+    unlock_heap();
+}
+
+void make_thread_cache_key()
+{
+    pthread_key_create(&thread_cache_key, thread_cache_flush);
+}
+
+/*
+ * Takes a block of the given size from the calling thread's cache, first
+ * refilling the cache from the heap if it is empty.  Returns NULL if there
+ * is no memory for it.
+ */
+sf_block *thread_cache_get(sf_size_t size)
+{
+    struct thread_cache *cache = &thread_cache;
+    int index = thread_cache_index(size);
+
+    if (!cache->registered)
     {
-        void *newmem = sf_malloc(client_size);
-        int pp_size = get_block_payload_size(&pp_block->header);
-        memcpy(newmem, pp, pp_size);
-        sf_free(pp);
-        return newmem;
+        pthread_once(&thread_cache_once, make_thread_cache_key);
+        pthread_setspecific(thread_cache_key, cache);
+        cache->registered = 1;
     }
-    else if (rsize < get_block_size(&pp_block->header))
+    if (!cache->length[index])
     {
-        current_payload -= (get_block_payload_size(&pp_block->header) - client_size);
-        if (get_block_size(&pp_block->header) - (int)rsize >= MIN_BLOCK_SIZE)
+        lock_heap();
+        for (int i = 0; i < THREAD_CACHE_BATCH; i++)
         {
-            split(pp_block, rsize);
-            // sf_show_heap();
-            sf_block *free_block = (sf_block *)((long int)pp_block + get_block_size(&pp_block->header));
-            coalesce(free_block);
-            set_block_payload_size(&pp_block->header, client_size);
-
-            // memcpy(pp_block->body.payload, pp, client_size);
-            return pp_block->body.payload;
+            sf_block *block = heap_malloc(size);
+            if (!block)
+                break;
+            thread_cache_push(cache, index, block);
         }
-        else if (get_block_size(&pp_block->header) - (int)rsize >= 0)
-        {
+        unlock_heap();
+        if (!cache->length[index])
+            return NULL;
+    }
+    return thread_cache_pop(cache, index);
+}
+
+/*
+ * Puts a block being freed into the calling thread's cache, if it is of a
+ * cached size, draining half the cache into the heap first if it is full.
+ * Only the block's own header is checked, as the heap around it may be
+ * changing.  Returns 0 if the block is not of a cached size.
+ */
+int thread_cache_put(void *pp)
+{
+    struct thread_cache *cache = &thread_cache;
+
+    if (!pp || (long int)pp % ALIGN_SIZE != 0 || pp < sf_mem_start() + 6 * HEADER_SIZE || pp >= heap_end())
+        abort();
+    sf_block *block = (sf_block *)((long int)pp - HEADER_SIZE - HEADER_SIZE);
+    int index = thread_cache_index(get_block_size(&block->header));
+    if (index < 0)
+        return 0;
+    if (!get_header_alloc(&block->header) || get_header_in_qcklst(&block->header))
+        abort();
+
+    if (!cache->registered)
+    {
+        pthread_once(&thread_cache_once, make_thread_cache_key);
+        pthread_setspecific(thread_cache_key, cache);
+        cache->registered = 1;
+    }
+    if (cache->length[index] == THREAD_CACHE_MAX)
+        thread_cache_drain(cache, index, THREAD_CACHE_MAX / 2);
+    add_payload_unlocked(-get_block_payload_size(&block->header));
+    thread_cache_push(cache, index, block);
+    return 1;
+}
+
+/*
+ ---------------------------------------------SLABS----------------------------------------------------
+*/
+
+/*
+ * With slabs turned on, requests of up to SLAB_MAX bytes are served from slabs:
+ * blocks of the heap with a SLAB_SIZE payload aligned to SLAB_SIZE, each holding
+ * objects of one size class with no header of their own, after a slab header
+ * with a bitmap of the free objects.  The slab of an object is found by masking
+ * its address, and slab_pages, a bitmap over the heap's SLAB_SIZE pages, tells
+ * whether there is one.  The payload size of a slab's block is the total payload
+ * of its objects, so sf_internal_fragmentation() counts them as they are.
+ * Slabs are only touched with the heap lock held.
+ */
+#define SLAB_SIZE PAGE_SZ
+#define SLAB_MAX 256
+#define NUM_SLAB_CLASSES 8
+#define MAX_SLAB_PAGES 4096 /* Slabs must lie in the first this many pages of the heap. */
+
+const sf_size_t slab_class_sizes[NUM_SLAB_CLASSES] = {16, 32, 48, 64, 96, 128, 192, 256};
+
+struct slab
+{
+    struct slab *next, *prev; // In the list of slabs of its class with free objects.
+    sf_size_t class_index, object_size;
+    sf_size_t capacity, free_count;
+    sf_size_t objects, unused;   // Offset of the first object from the slab.
+    uint64_t free_bitmap[2];     // Bit i set if object i is free.
+    unsigned char sizes[];       // Payload size of each object in use, less one.
+};
+
+int slabs_enabled = 0;
+struct slab *partial_slabs[NUM_SLAB_CLASSES]; // Slabs with free objects, by class.
+unsigned char slab_pages[MAX_SLAB_PAGES / 8];
+
+long int slab_page_index(void *pp)
+{
+    long int base = (long int)sf_mem_start() & ~(long int)(SLAB_SIZE - 1);
+    return ((long int)pp - base) / SLAB_SIZE;
+}
+
+/*
+ * Returns the slab holding pp, or NULL if pp is not in a slab.
+ */
+struct slab *slab_of(void *pp)
+{
+    if (pp < sf_mem_start() || pp >= sf_mem_end())
+        return NULL;
+    long int page = slab_page_index(pp);
+    if (page >= MAX_SLAB_PAGES ||
+        !(__atomic_load_n(&slab_pages[page / 8], __ATOMIC_RELAXED) & (1 << page % 8)))
+        return NULL;
+    return (struct slab *)((long int)pp & ~(long int)(SLAB_SIZE - 1));
+}
+
+void mark_slab_page(struct slab *slab, int in_use)
+{
+    long int page = slab_page_index(slab);
+    if (in_use)
+        __atomic_fetch_or(&slab_pages[page / 8], 1 << page % 8, __ATOMIC_RELAXED);
+    else
+        __atomic_fetch_and(&slab_pages[page / 8], ~(1 << page % 8), __ATOMIC_RELAXED);
+}
+
+sf_block *slab_block(struct slab *slab)
+{
+    return (sf_block *)((long int)slab - HEADER_SIZE - HEADER_SIZE);
+}
+
+/*
+ * Allocates a block whose payload is aligned to align, a multiple of ALIGN_SIZE,
+ * by allocating enough to leave room for a free block in front of it, which is
+ * split off, as is any remainder at the end.  Returns NULL if there is no memory.
+ */
+sf_block *heap_memalign(sf_size_t size, sf_size_t align)
+{
+    sf_block *block = heap_malloc(size + align + MIN_BLOCK_SIZE);
+    if (!block)
+        return NULL;
+    long int payload = (long int)block->body.payload;
+    long int aligned = (payload + align - 1) & ~(long int)(align - 1);
+    if (aligned != payload && aligned - payload < MIN_BLOCK_SIZE)
+        aligned += align;
+    if (aligned != payload)
+    {
+        int front = aligned - payload;
+        sf_block *rest = (sf_block *)((long int)block + front);
+        update_header(&rest->header, 0, (get_block_size(&block->header) - front) | PREV_BLOCK_ALLOCATED | THIS_BLOCK_ALLOCATED);
+        set_block_size(&block->header, front);
+        coalesce(block);
+        block = rest;
+    }
+    if (get_block_size(&block->header) - (int)size >= MIN_BLOCK_SIZE)
+        split(block, size);
+    return block;
+}
+
+int slab_class_index(sf_size_t size)
+{
+    int index = 0;
+    while (slab_class_sizes[index] < size)
+        index++;
+    return index;
+}
+
+void link_slab(struct slab *slab)
+{
+    slab->prev = NULL;
+    slab->next = partial_slabs[slab->class_index];
+    if (slab->next)
+        slab->next->prev = slab;
+    partial_slabs[slab->class_index] = slab;
+}
+
+void unlink_slab(struct slab *slab)
+{
+    if (slab->prev)
+        slab->prev->next = slab->next;
+    else
+        partial_slabs[slab->class_index] = slab->next;
+    if (slab->next)
+        slab->next->prev = slab->prev;
+}
+
+struct slab *new_slab(int class_index)
+{
+    sf_block *block = heap_memalign(correct_size(SLAB_SIZE), SLAB_SIZE);
+    if (!block)
+        return NULL;
+    struct slab *slab = (struct slab *)block->body.payload;
+    if (slab_page_index(slab) >= MAX_SLAB_PAGES)
+    {
+        heap_free(block);
+        return NULL;
+    }
+    set_block_payload_size(&block->header, 0);
+
+    // As many objects as fit after the header and its table of sizes.
+    sf_size_t object_size = slab_class_sizes[class_index], capacity = SLAB_SIZE / object_size;
+    while (((sizeof(struct slab) + capacity + ALIGN_SIZE - 1) & ~(ALIGN_SIZE - 1)) + capacity * object_size > SLAB_SIZE)
+        capacity--;
+    slab->class_index = class_index;
+    slab->object_size = object_size;
+    slab->capacity = capacity;
+    slab->free_count = capacity;
+    slab->objects = (sizeof(struct slab) + capacity + ALIGN_SIZE - 1) & ~(ALIGN_SIZE - 1);
+    slab->free_bitmap[0] = capacity >= 64 ? ~(uint64_t)0 : ((uint64_t)1 << capacity) - 1;
+    slab->free_bitmap[1] = capacity <= 64 ? 0 : ((uint64_t)1 << (capacity - 64)) - 1;
+    mark_slab_page(slab, 1);
+    link_slab(slab);
+    return slab;
+}
+
+/*
+ * Returns an object of at least size bytes from a slab, or NULL if there is no
+ * memory for a new slab.
+ */
+void *slab_malloc(sf_size_t size)
+{
+    int class_index = slab_class_index(size);
+    struct slab *slab = partial_slabs[class_index];
+    if (!slab)
+        slab = new_slab(class_index);
+    if (!slab)
+        return NULL;
+
+    int word = slab->free_bitmap[0] ? 0 : 1;
+    int i = __builtin_ctzll(slab->free_bitmap[word]);
+    slab->free_bitmap[word] &= ~((uint64_t)1 << i);
+    i += 64 * word;
+    slab->sizes[i] = size - 1;
+    if (!--slab->free_count)
+        unlink_slab(slab);
+
+    sf_block *block = slab_block(slab);
+    set_block_payload_size(&block->header, get_block_payload_size(&block->header) + size);
+    add_payload(size);
+    return (char *)slab + slab->objects + i * slab->object_size;
+}
+
+/*
+ * Returns the index in its slab of an object in use, aborting if pp is not one.
+ */
+int slab_object_index(struct slab *slab, void *pp)
+{
+    long int offset = (long int)pp - (long int)slab - slab->objects;
+    if (offset < 0 || offset % slab->object_size != 0 || offset / slab->object_size >= slab->capacity)
+        abort();
+    int i = offset / slab->object_size;
+    if (slab->free_bitmap[i / 64] & ((uint64_t)1 << i % 64))
+        abort();
+    return i;
+}
+
+/*
+ * Frees an object, giving its slab back to the heap if it is left empty, unless
+ * it is the only slab of its class with free objects.
+ */
+void slab_free(struct slab *slab, void *pp)
+{
+    int i = slab_object_index(slab, pp);
+    sf_block *block = slab_block(slab);
+    set_block_payload_size(&block->header, get_block_payload_size(&block->header) - (slab->sizes[i] + 1));
+    add_payload(-(slab->sizes[i] + 1));
+    slab->free_bitmap[i / 64] |= (uint64_t)1 << i % 64;
+    if (++slab->free_count == 1)
+        link_slab(slab);
+    if (slab->free_count == slab->capacity && (slab->prev || slab->next))
+    {
+        unlink_slab(slab);
+        mark_slab_page(slab, 0);
+        heap_free(block);
+    }
+}
+
+/*
+ ---------------------------------------------MAPPED REGIONS----------------------------------------------------
+*/
+
+/*
+ * Requests of at least mmap_threshold bytes, when it is nonzero, get a region of
+ * their own from mmap, outside the heap, so that freeing them gives the memory
+ * back to the system at once.  A region starts like a block, with a header
+ * holding its length and payload size, but is marked as in a quick list and not
+ * allocated, which no block in the heap ever is.  mapped_bytes and mapped_payload
+ * total the regions in use, and max_footprint is the most memory the heap and
+ * the regions have taken up together, as of the last time a region changed.
+ * They are only updated with the heap lock held.
+ */
+sf_size_t mmap_threshold = 0;
+long int mapped_bytes = 0, mapped_payload = 0, max_footprint = 0;
+
+long int footprint()
+{
+    return heap_end() - sf_mem_start() + mapped_bytes;
+}
+
+/*
+ * Updates max_footprint, with the heap lock held.  The heap only shrinks in
+ * sf_trim(), so the footprint is at its largest just before it or a region
+ * changes, or now, and this is called at each of those times.
+ */
+void note_footprint()
+{
+    if (footprint() > max_footprint)
+        max_footprint = footprint();
+}
+
+/*
+ * Accounts for a change in the regions mapped, with the heap lock held.
+ */
+void account_region(long int bytes, long int payload)
+{
+    note_footprint();
+    __atomic_store_n(&mapped_bytes, mapped_bytes + bytes, __ATOMIC_RELAXED);
+    mapped_payload += payload;
+    note_footprint();
+    add_payload(payload);
+}
+
+/*
+ * Returns the length of a region for a payload of size bytes, or 0 if its
+ * length does not fit in a header.
+ */
+long int region_length(sf_size_t size)
+{
+    long int page = sysconf(_SC_PAGESIZE);
+    long int length = ((long int)size + HEADER_SIZE + HEADER_SIZE + page - 1) & ~(page - 1);
+    return length > (long int)BLOCK_BYTES ? 0 : length;
+}
+
+long int get_region_length(sf_block *region)
+{
+    return obfiscate(&region->header) & BLOCK_BYTES;
+}
+
+sf_size_t get_region_payload_size(sf_block *region)
+{
+    return (obfiscate(&region->header) & PAYLOAD_BYTES) >> 32;
+}
+
+void set_region_header(sf_block *region, long int length, sf_size_t size)
+{
+    update_header(&region->header, 0, (sf_header)size << 32 | length | IN_QUICK_LIST);
+}
+
+/*
+ * The regions mapped, in a hash table with linear probing kept with the heap
+ * lock held.  A pointer is only taken for a region once it is found here, so
+ * freeing a region twice, or a pointer that was never allocated, never reads
+ * or unmaps memory that is not a region.  The table is mapped too, and doubled
+ * whenever it would get more than half full.
+ */
+sf_block **region_table = NULL;
+long int region_slots = 0, region_count = 0;
+
+long int region_hash(sf_block *region)
+{
+    return ((unsigned long)region >> 12) * 0x9E3779B97F4A7C15UL >> 20 & (region_slots - 1);
+}
+
+/*
+ * Returns the slot holding region, or the empty slot it would go in.
+ */
+long int region_slot(sf_block *region)
+{
+    long int i = region_hash(region);
+    while (region_table[i] && region_table[i] != region)
+        i = (i + 1) & (region_slots - 1);
+    return i;
+}
+
+/*
+ * Adds a region to the table.  Returns -1 if the table needs to grow and there
+ * is no memory for it.
+ */
+int track_region(sf_block *region)
+{
+    if (2 * (region_count + 1) > region_slots)
+    {
+        long int slots = region_slots ? 2 * region_slots : sysconf(_SC_PAGESIZE) / (long int)sizeof(sf_block *);
+        sf_block **table = mmap(NULL, slots * sizeof(sf_block *), PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (table == MAP_FAILED)
+            return -1;
+        sf_block **old_table = region_table;
+        long int old_slots = region_slots;
+        region_table = table;
+        region_slots = slots;
+        for (long int i = 0; i < old_slots; i++)
+            if (old_table[i])
+                region_table[region_slot(old_table[i])] = old_table[i];
+        if (old_table)
+            munmap(old_table, old_slots * sizeof(sf_block *));
+    }
+    region_table[region_slot(region)] = region;
+    region_count++;
+    return 0;
+}
+
+/*
+ * Removes a region from the table, moving back any region after it in the run
+ * of full slots that could otherwise no longer be found.
+ */
+void untrack_region(sf_block *region)
+{
+    long int mask = region_slots - 1, i = region_slot(region);
+    region_table[i] = NULL;
+    region_count--;
+    for (long int j = (i + 1) & mask; region_table[j]; j = (j + 1) & mask)
+    {
+        long int home = region_hash(region_table[j]);
+        // The region in slot j stays put if its home slot is cyclically in (i, j].
+        if (i < j ? home <= i || home > j : home <= i && home > j)
+        {
+            region_table[i] = region_table[j];
+            region_table[j] = NULL;
+            i = j;
+        }
+    }
+}
+
+/*
+ * Returns 0 if pp cannot be the payload of a region, without taking the lock.
+ */
+int maybe_region(void *pp)
+{
+    return __atomic_load_n(&mapped_bytes, __ATOMIC_RELAXED) && pp && (long int)pp % ALIGN_SIZE == 0 &&
+           (pp < sf_mem_start() || pp >= sf_mem_end());
+}
+
+/*
+ * Returns the region pp is the payload of, or NULL if it is not one, with the
+ * heap lock held.
+ */
+sf_block *region_of(void *pp)
+{
+    if (!maybe_region(pp))
+        return NULL;
+    sf_block *region = (sf_block *)((long int)pp - HEADER_SIZE - HEADER_SIZE);
+    if (!region_slots || region_table[region_slot(region)] != region)
+        return NULL;
+    return region;
+}
+
+/*
+ * Maps a region for a payload of size bytes, which is left to the caller to
+ * add with add_region().  Returns NULL if there is no memory.
+ */
+sf_block *map_region(sf_size_t size)
+{
+    long int length = region_length(size);
+    if (!length)
+        return NULL;
+    sf_block *region = mmap(NULL, length, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (region == MAP_FAILED)
+        return NULL;
+    set_region_header(region, length, size);
+    return region;
+}
+
+/*
+ * Resizes a region for a payload of size bytes, moving it if need be without
+ * copying, and accounts for it.  Returns NULL, leaving the region as it was, if
+ * there is no memory.
+ */
+sf_block *remap_region(sf_block *region, sf_size_t size)
+{
+    long int length = get_region_length(region), new_length = region_length(size);
+    if (!new_length)
+        return NULL;
+    if (new_length != length)
+    {
+        sf_block *moved = mremap(region, length, new_length, MREMAP_MAYMOVE);
+        if (moved == MAP_FAILED)
+            return NULL;
+        if (moved != region)
+        {
+            untrack_region(region);
+            track_region(moved); // Cannot fail, as the table has just had a slot freed.
+        }
+        region = moved;
+    }
+    account_region(new_length - length, (long int)size - get_region_payload_size(region));
+    set_region_header(region, new_length, size);
+    return region;
+}
+
+void unmap_region(sf_block *region)
+{
+    munmap(region, get_region_length(region));
+}
+
+/*
+ * Accounts for a region just mapped and adds it to the table, with the heap
+ * lock held.  Returns -1, leaving the region to the caller to unmap, if there
+ * is no memory for that.
+ */
+int add_region(sf_block *region)
+{
+    if (track_region(region))
+        return -1;
+    account_region(get_region_length(region), get_region_payload_size(region));
+    return 0;
+}
+
+/*
+ * Accounts for a region about to be unmapped and takes it out of the table,
+ * with the heap lock held.
+ */
+void remove_region(sf_block *region)
+{
+    account_region(-get_region_length(region), -(long int)get_region_payload_size(region));
+    untrack_region(region);
+}
+
+/*
+ ---------------------------------------------TRIMMING----------------------------------------------------
+*/
+
+/*
+ * When trim_threshold is nonzero, sf_free trims the heap whenever the free block
+ * at its end is bigger than that.
+ */
+sf_size_t trim_threshold = 0;
+
+/*
+ * Releases the whole system pages between start and end to the system, keeping
+ * the memory mapped but letting the pages be dropped until they are touched
+ * again, when they read as zeros.  Returns the number of bytes released.
+ */
+long int release_pages(void *start, void *end)
+{
+    long int page = sysconf(_SC_PAGESIZE);
+    long int first = ((long int)start + page - 1) & ~(page - 1), last = (long int)end & ~(page - 1);
+    if (first >= last || madvise((void *)first, last - first, MADV_DONTNEED))
+        return 0;
+    return last - first;
+}
+
+/*
+ * Moves the end of the heap back over all but pad bytes of the free block at the
+ * end of it, in whole pages, and releases what is past the end, with the heap
+ * lock held.  Returns the number of bytes the heap shrank by.
+ */
+long int trim_top(sf_size_t pad)
+{
+    if (sf_mem_start() == sf_mem_end())
+        return 0;
+    sf_block *epilogue = (sf_block *)(heap_end() - HEADER_SIZE - HEADER_SIZE);
+    if (get_header_prv_alloc(&epilogue->header))
+        return 0;
+    long int top_size = get_block_size(&epilogue->prev_footer);
+    sf_block *top = (sf_block *)((long int)epilogue - top_size);
+    long int trim = top_size > (long int)pad ? (top_size - pad) / PAGE_SZ * PAGE_SZ : 0;
+    if (top_size - trim && top_size - trim < MIN_BLOCK_SIZE)
+        trim -= PAGE_SZ;
+    if (trim <= 0)
+        return 0;
+
+    note_footprint();
+    remove_from_free_list(top);
+    __atomic_store_n(&trimmed_bytes, trimmed_bytes + trim, __ATOMIC_RELAXED);
+    if (top_size - trim)
+    {
+        make_free(top, top_size - trim);
+        place_in_free_list(top);
+    }
+    epilogue = (sf_block *)(heap_end() - HEADER_SIZE - HEADER_SIZE);
+    update_header(&epilogue->header, 0, THIS_BLOCK_ALLOCATED | (top_size - trim ? 0 : PREV_BLOCK_ALLOCATED));
+    release_pages(&epilogue->body, sf_mem_end());
+    return trim;
+}
+
+/*
+ ---------------------------------------------REQUIRED FUNCTIONS----------------------------------------------------
+*/
+
+/*
+ * Does the work of sf_malloc with the heap lock held, for a nonzero size.
+ */
+void *locked_malloc(sf_size_t size)
+{
+    if (mmap_threshold && size >= mmap_threshold)
+    {
+        sf_block *region = map_region(size);
+        if (region && !add_region(region))
+            return region->body.payload;
+        if (region)
+            unmap_region(region);
+    }
+    if (slabs_enabled && size <= SLAB_MAX)
+    {
+        void *object = slab_malloc(size);
+        if (object)
+            return object;
+    }
+    sf_block *block = heap_malloc(correct_size(size));
+    if (!block)
+        return NULL;
+    set_block_payload_size(&block->header, size);
+    add_payload(size);
+    return block->body.payload;
+}
+
+/*
+ * An object in a slab stays where it is if the new size is in the same class.
+ */
+void *slab_realloc(struct slab *slab, void *pp, sf_size_t rsize)
+{
+    int i = slab_object_index(slab, pp);
+    sf_size_t size = slab->sizes[i] + 1;
+    if (!rsize)
+    {
+        slab_free(slab, pp);
+        return NULL;
+    }
+    if (rsize <= SLAB_MAX && slab_class_index(rsize) == (int)slab->class_index)
+    {
+        sf_block *block = slab_block(slab);
+        set_block_payload_size(&block->header, get_block_payload_size(&block->header) + rsize - size);
+        add_payload(rsize - size);
+        slab->sizes[i] = rsize - 1;
+        return pp;
+    }
+    void *newmem = locked_malloc(rsize);
+    if (!newmem)
+    {
+        sf_errno = ENOMEM;
+        return NULL;
+    }
+    memcpy(newmem, pp, size < rsize ? size : rsize);
+    slab_free(slab, pp);
+    return newmem;
+}
+
+/*
+ * A region is resized in place by mremap if it is still big enough for one, and
+ * is otherwise moved into the heap.
+ */
+void *region_realloc(sf_block *region, void *pp, sf_size_t rsize)
+{
+    sf_size_t size = get_region_payload_size(region);
+    if (rsize && mmap_threshold && rsize >= mmap_threshold)
+    {
+        region = remap_region(region, rsize);
+        if (!region)
+        {
+            sf_errno = ENOMEM;
+            return NULL;
+        }
+        return region->body.payload;
+    }
+    void *newmem = NULL;
+    if (rsize)
+    {
+        newmem = locked_malloc(rsize);
+        if (!newmem)
+        {
+            sf_errno = ENOMEM;
+            return NULL;
+        }
+        memcpy(newmem, pp, size < rsize ? size : rsize);
+    }
+    remove_region(region);
+    unmap_region(region);
+    return newmem;
+}
+
+void *heap_realloc(void *pp, sf_size_t rsize)
+{
+    struct slab *slab = slab_of(pp);
+    if (slab)
+        return slab_realloc(slab, pp, rsize);
+    sf_block *region = region_of(pp);
+    if (region)
+        return region_realloc(region, pp, rsize);
+    validate_pointer(pp);
+    sf_block *pp_block = (sf_block *)((long int)pp - HEADER_SIZE - HEADER_SIZE);
+    if (!rsize)
+    {
+        heap_free(pp_block);
+        return NULL;
+    }
+    int client_size = rsize;
+    rsize = correct_size(rsize);
+
+    if (rsize > get_block_size(&pp_block->header))
+    {
+        // A block big enough for a region of its own leaves the heap rather than grow it.
+        if (!(mmap_threshold && (sf_size_t)client_size >= mmap_threshold) && extend_in_place(pp_block, rsize))
+        {
+            add_payload(client_size - get_block_payload_size(&pp_block->header));
             set_block_payload_size(&pp_block->header, client_size);
             return pp;
         }
-        else
+        void *newmem = locked_malloc(client_size);
+        if (!newmem)
         {
-            return pp;
+            sf_errno = ENOMEM;
+            return NULL;
+        }
+        memcpy(newmem, pp, get_block_payload_size(&pp_block->header));
+        heap_free(pp_block);
+        return newmem;
+    }
+    add_payload(client_size - get_block_payload_size(&pp_block->header));
+    set_block_payload_size(&pp_block->header, client_size);
+    if (get_block_size(&pp_block->header) - (int)rsize >= MIN_BLOCK_SIZE)
+        split(pp_block, rsize);
+    return pp;
+}
+
+void *sf_malloc(sf_size_t size)
+{
+    sf_size_t client_size = size;
+    if (!size)
+        return NULL;
+    size = correct_size(size);
+
+    if (mmap_threshold && client_size >= mmap_threshold)
+    {
+        sf_block *region = map_region(client_size);
+        if (region)
+        {
+            lock_heap();
+            int added = !add_region(region);
+            unlock_heap();
+            if (added)
+                return region->body.payload;
+            unmap_region(region);
         }
     }
-    else
+
+    if (slabs_enabled && client_size <= SLAB_MAX)
     {
-        return pp;
+        lock_heap();
+        void *object = slab_malloc(client_size);
+        unlock_heap();
+        if (object)
+            return object;
+    }
+
+    sf_block *address = NULL;
+    if (thread_safe && thread_cache_index(size) >= 0)
+        address = thread_cache_get(size);
+    if (!address)
+    {
+        lock_heap();
+        address = heap_malloc(size);
+        unlock_heap();
+    }
+    if (!address && thread_safe)
+    {
+        // Blocks hoarded in this thread's cache may be what's missing.
+        thread_cache_flush(&thread_cache);
+        lock_heap();
+        address = heap_malloc(size);
+        unlock_heap();
     }
+    if (!address)
+    {
+        sf_errno = ENOMEM;
+        return NULL;
+    }
+    set_block_payload_size(&address->header, client_size);
+    add_payload_unlocked(client_size);
+    return &address->body.payload;
+}
+
+void sf_free(void *pp)
+{
+    struct slab *slab = slab_of(pp);
+    if (slab)
+    {
+        lock_heap();
+        slab_free(slab, pp);
+        unlock_heap();
+        return;
+    }
+    if (maybe_region(pp))
+    {
+        lock_heap();
+        sf_block *region = region_of(pp);
+        if (region)
+            remove_region(region);
+        unlock_heap();
+        if (region)
+        {
+            unmap_region(region);
+            return;
+        }
+    }
+    if (thread_safe && thread_cache_put(pp))
+        return;
+    lock_heap();
+    validate_pointer(pp);
+    heap_free((sf_block *)((long int)pp - HEADER_SIZE - HEADER_SIZE));
+    if (trim_threshold)
+        trim_top(trim_threshold);
+    unlock_heap();
+}
+
+void *sf_realloc(void *pp, sf_size_t rsize)
+{
+    lock_heap();
+    void *newmem = heap_realloc(pp, rsize);
+    unlock_heap();
+    return newmem;
+}
+
+void sf_set_thread_safe(int enable)
+{
+    if (!enable && thread_safe)
+        thread_cache_flush(&thread_cache);
+    sf_mem_start(); // Makes sure the heap's own state is set up before any threads use it.
+    thread_safe = enable;
 }
 
 double sf_internal_fragmentation()
 {
     // TO BE IMPLEMENTED
-    if (sf_mem_start() == sf_mem_end())
-        return 0;
-    sf_block *epilogue = (sf_block *)(sf_mem_end() - HEADER_SIZE - HEADER_SIZE);
-    int total_payload = 0, total_size = 0;
+    lock_heap();
+    long int total_payload = mapped_payload, total_size = mapped_bytes;
+    sf_block *epilogue = (sf_block *)(heap_end() - HEADER_SIZE - HEADER_SIZE);
     for (sf_block *current_block = (sf_block *)(sf_mem_start() + 4 * HEADER_SIZE);
          current_block < epilogue;
          current_block = (sf_block *)((long int)current_block + get_block_size(&current_block->header)))
     {
         if (get_header_alloc(&current_block->header) && !get_header_in_qcklst(&current_block->header))
         {
-            total_payload += (int)get_block_payload_size(&current_block->header);
-            total_size += (int)get_block_size(&current_block->header);
+            total_payload += get_block_payload_size(&current_block->header);
+            total_size += get_block_size(&current_block->header);
         }
     }
+    unlock_heap();
     if (total_size)
         return ((double)total_payload) / total_size;
     return 0;
@@ -670,7 +1537,41 @@ double sf_internal_fragmentation()
 
 double sf_peak_utilization()
 {
-    if (sf_mem_end() - sf_mem_start() == 0)
+    lock_heap();
+    long int heap_size = footprint() > max_footprint ? footprint() : max_footprint;
+    int payload = max_payload;
+    unlock_heap();
+    if (heap_size == 0)
+        return 0;
+    return ((double)payload) / heap_size;
+}
+
+void sf_set_slabs(int enable)
+{
+    slabs_enabled = enable;
+}
+
+void sf_set_mmap_threshold(sf_size_t threshold)
+{
+    mmap_threshold = threshold;
+}
+
+int sf_trim(sf_size_t pad)
+{
+    lock_heap();
+    if (sf_mem_start() == sf_mem_end()) { // Nothing allocated yet: the free lists are not set up.
+        unlock_heap();
         return 0;
-    return ((double)max_payload) / (sf_mem_end() - sf_mem_start());
+    }
+    long int released = trim_top(pad);
+    for (int i = 0; i < NUM_FREE_LISTS; i++)
+        for (sf_block *block = sf_free_list_heads[i].body.links.next; block != &sf_free_list_heads[i]; block = block->body.links.next)
+            released += release_pages(&block->body.links + 1, (void *)((long int)block + get_block_size(&block->header)));
+    unlock_heap();
+    return released > 0;
+}
+
+void sf_set_trim_threshold(sf_size_t threshold)
+{
+    trim_threshold = threshold;
 }
@@ -3,6 +3,8 @@
 #include <signal.h>
 #include "debug.h"
 #include "sfmm.h"
+#include "sfmm_ext.h"
+#include <pthread.h>
 #define TEST_TIMEOUT 15
 
 /*
@@ -432,3 +434,261 @@ Test(sfmm_student_suite, student_test_5, .timeout = TEST_TIMEOUT)
 	assert_free_block_count(816, 1);
 	assert_free_block_count(2176, 1);
 }
+
+/*
+ * Each thread allocates and frees small blocks of random sizes, checking that
+ * no other thread has written over the ones it holds.
+ */
+void *thread_safe_worker(void *arg)
+{
+	unsigned int seed = (unsigned int)(long)arg;
+	unsigned char *held[8] = {NULL};
+	sf_size_t sizes[8] = {0};
+
+	for (int i = 0; i < 5000; i++)
+	{
+		int j = rand_r(&seed) % 8;
+		if (held[j])
+		{
+			for (sf_size_t k = 0; k < sizes[j]; k++)
+				if (held[j][k] != (unsigned char)(long)arg)
+					return "corrupted";
+			sf_free(held[j]);
+			held[j] = NULL;
+		}
+		else
+		{
+			sizes[j] = 1 + rand_r(&seed) % (rand_r(&seed) % 16 ? 160 : 600);
+			held[j] = sf_malloc(sizes[j]);
+			if (held[j])
+				memset(held[j], (unsigned char)(long)arg, sizes[j]);
+		}
+	}
+	for (int j = 0; j < 8; j++)
+		if (held[j])
+			sf_free(held[j]);
+	return NULL;
+}
+
+Test(sfmm_student_suite, thread_safe, .timeout = TEST_TIMEOUT)
+{
+	pthread_t threads[4];
+	void *result;
+
+	sf_set_thread_safe(1);
+	for (long i = 0; i < 4; i++)
+		pthread_create(&threads[i], NULL, thread_safe_worker, (void *)(i + 1));
+	for (int i = 0; i < 4; i++)
+	{
+		pthread_join(threads[i], &result);
+		cr_assert_null(result, "Thread %d found its blocks corrupted!", i);
+	}
+	sf_set_thread_safe(0);
+
+	// Every block has come back to the heap, so none are allocated.
+	cr_assert(sf_internal_fragmentation() == 0.0, "Some blocks are still allocated!");
+	sf_block *epilogue = (sf_block *)(sf_mem_end() - 16);
+	sf_block *bp = (sf_block *)(sf_mem_start() + 32);
+	while (bp < epilogue)
+		bp = (sf_block *)((char *)bp + ((bp->header ^ MAGIC) & 0xfffffff0));
+	cr_assert_eq(bp, epilogue, "Blocks do not end at the epilogue!");
+}
+
+Test(sfmm_student_suite, sub_lists, .timeout = TEST_TIMEOUT)
+{ // free list 4 holds (256, 512], in sub-lists of 32 bytes
+	void *x = sf_malloc(312);
+	/* void *g1 = */ sf_malloc(sizeof(int));
+	void *y = sf_malloc(408);
+	/* void *g2 = */ sf_malloc(sizeof(int));
+
+	sf_free(x);
+	sf_free(y);
+
+	// Blocks in a free list are ordered by sub-list, LIFO within each.
+	sf_block *bp = sf_free_list_heads[4].body.links.next;
+	cr_assert_eq(&bp->header, (char *)x - 8, "Wrong first block in free list 4: (found=%p, exp=%p)",
+				 &bp->header, (char *)x - 8);
+	assert_free_block_count(320, 1);
+	assert_free_block_count(416, 1);
+
+	// A 392-byte payload needs a 400-byte block, and every block in the sub-list
+	// of sizes 400 to 416 fits, so one is taken without looking at the 320-byte one.
+	void *z = sf_malloc(392);
+	cr_assert_eq(z, y, "Wrong block allocated (found=%p, exp=%p)", z, y);
+	assert_free_block_count(320, 1);
+	assert_free_block_count(416, 0);
+}
+
+Test(sfmm_student_suite, heap_growth, .timeout = TEST_TIMEOUT)
+{ // the heap grows by the whole shortfall at once, but by at least 1/8 of itself
+	void *x = sf_malloc(16000);
+	cr_assert_not_null(x, "x is NULL!");
+	cr_assert(sf_mem_end() - sf_mem_start() == 16 * PAGE_SZ, "Heap is not 16 pages!");
+	assert_free_block_count(0, 1);
+	assert_free_block_count(320, 1);
+
+	void *y = sf_malloc(400);
+	cr_assert_not_null(y, "y is NULL!");
+	cr_assert(sf_mem_end() - sf_mem_start() == 18 * PAGE_SZ, "Heap did not grow by 2 pages!");
+	assert_free_block_count(0, 1);
+	assert_free_block_count(1952, 1);
+}
+
+Test(sfmm_student_suite, realloc_in_place, .timeout = TEST_TIMEOUT)
+{ // a growing block absorbs the free block after it, and then grows the heap
+	char *x = sf_malloc(100);
+	memset(x, 'x', 100);
+
+	char *y = sf_realloc(x, 500);
+	cr_assert_eq(y, x, "Block was moved (found=%p, exp=%p)", y, x);
+	assert_free_block_count(0, 1);
+	assert_free_block_count(464, 1);
+
+	char *z = sf_realloc(x, 2000);
+	cr_assert_eq(z, x, "Block was moved (found=%p, exp=%p)", z, x);
+	for (int i = 0; i < 100; i++)
+		cr_assert_eq(z[i], 'x', "Value is not preserved!");
+	sf_block *bp = (sf_block *)(z - 16);
+	cr_assert(((bp->header ^ MAGIC) & 0xfffffff0) == 2016,
+			  "Block size (%ld) not what was expected (%ld)!",
+			  (bp->header ^ MAGIC) & 0xfffffff0, 2016);
+	cr_assert(sf_mem_end() - sf_mem_start() == 3 * PAGE_SZ, "Heap is not 3 pages!");
+	assert_free_block_count(0, 1);
+	assert_free_block_count(1008, 1);
+}
+
+Test(sfmm_student_suite, slabs, .timeout = TEST_TIMEOUT)
+{ // small objects are packed into one page, with no headers between them
+	sf_set_slabs(1);
+	char *objects[56];
+	for (int i = 0; i < 56; i++)
+	{
+		objects[i] = sf_malloc(16);
+		cr_assert_not_null(objects[i], "objects[%d] is NULL!", i);
+		memset(objects[i], i, 16);
+	}
+	for (int i = 0; i < 56; i++)
+	{
+		cr_assert(((long int)objects[i] & ~(long int)(PAGE_SZ - 1)) == ((long int)objects[0] & ~(long int)(PAGE_SZ - 1)),
+				  "objects[%d] is not on the same page as objects[0]!", i);
+		if (i)
+			cr_assert(objects[i] - objects[i - 1] == 16, "objects[%d] is not right after objects[%d]!", i, i - 1);
+	}
+	double frag = sf_internal_fragmentation();
+	cr_assert(frag > 0.8, "Internal fragmentation (%f) is too low for packed objects!", frag);
+
+	char *x = sf_realloc(objects[3], 10);
+	cr_assert_eq(x, objects[3], "Object was moved within its class!");
+	x = sf_realloc(x, 200);
+	cr_assert_neq(x, objects[3], "Object was not moved to another class!");
+	for (int i = 0; i < 10; i++)
+		cr_assert_eq(x[i], 3, "Value is not preserved!");
+	sf_free(x);
+	for (int i = 0; i < 56; i++)
+		if (i != 3)
+			sf_free(objects[i]);
+	cr_assert(sf_internal_fragmentation() == 0.0, "Objects are still counted as allocated!");
+	sf_set_slabs(0);
+}
+
+Test(sfmm_student_suite, mmap_threshold, .timeout = TEST_TIMEOUT)
+{ // large requests get regions of their own, outside the heap
+	sf_set_mmap_threshold(4096);
+	sf_errno = 0;
+	char *x = sf_malloc(10000);
+	cr_assert_not_null(x, "x is NULL!");
+	cr_assert((void *)x < sf_mem_start() || (void *)x >= sf_mem_end(), "x is in the heap!");
+	cr_assert(sf_mem_end() - sf_mem_start() <= PAGE_SZ, "Heap grew for a mapped request!");
+	memset(x, 'x', 10000);
+
+	char *y = sf_realloc(x, 100000);
+	cr_assert_not_null(y, "y is NULL!");
+	for (int i = 0; i < 10000; i++)
+		cr_assert_eq(y[i], 'x', "Value is not preserved!");
+	memset(y, 'y', 100000);
+	cr_assert(sf_peak_utilization() > 0.9, "Peak utilization (%f) does not count the region!", sf_peak_utilization());
+
+	char *z = sf_realloc(y, 100);
+	cr_assert((void *)z >= sf_mem_start() && (void *)z < sf_mem_end(), "z was not moved into the heap!");
+	for (int i = 0; i < 100; i++)
+		cr_assert_eq(z[i], 'y', "Value is not preserved!");
+	sf_free(z);
+
+	z = sf_realloc(sf_malloc(100), 5000);
+	cr_assert((void *)z < sf_mem_start() || (void *)z >= sf_mem_end(), "z was not moved into a region!");
+	sf_free(z);
+	cr_assert(sf_errno == 0, "sf_errno is not zero!");
+	cr_assert(sf_internal_fragmentation() == 0.0, "Regions are still counted as allocated!");
+	sf_set_mmap_threshold(0);
+}
+
+Test(sfmm_student_suite, mmap_many_regions, .timeout = TEST_TIMEOUT)
+{ // regions are found again however many are mapped and in whatever order they go
+	sf_set_mmap_threshold(4096);
+	sf_errno = 0;
+	char *regions[1000];
+	for (int i = 0; i < 1000; i++)
+	{
+		regions[i] = sf_malloc(5000 + i);
+		cr_assert_not_null(regions[i], "Region %d is NULL!", i);
+		regions[i][0] = (char)i;
+	}
+	for (int i = 0; i < 1000; i++)
+	{
+		int j = i * 7 % 1000;
+		cr_assert_eq(regions[j][0], (char)j, "Region %d was overwritten!", j);
+		regions[j] = sf_realloc(regions[j], 20000 + 10 * j);
+		cr_assert_not_null(regions[j], "Region %d was not resized!", j);
+	}
+	for (int i = 0; i < 1000; i++)
+		sf_free(regions[i * 13 % 1000]);
+	cr_assert(sf_errno == 0, "sf_errno is not zero!");
+	cr_assert(sf_internal_fragmentation() == 0.0, "Regions are still counted as allocated!");
+	sf_set_mmap_threshold(0);
+}
+
+Test(sfmm_student_suite, mmap_double_free, .timeout = TEST_TIMEOUT, .signal = SIGABRT)
+{ // a region freed twice is caught before anything is read from it
+	sf_set_mmap_threshold(4096);
+	char *x = sf_malloc(10000);
+	char *y = sf_malloc(10000);
+	cr_assert_not_null(x, "x is NULL!");
+	sf_free(x);
+	sf_free(x);
+	sf_free(y);
+}
+
+Test(sfmm_student_suite, trim, .timeout = TEST_TIMEOUT)
+{ // the heap shrinks back over its free end, and grows into it again first
+	sf_set_trim_threshold(2048);
+	char *x = sf_malloc(100);
+	char *y = sf_malloc(15000);
+	cr_assert(sf_mem_end() - sf_mem_start() == 15 * PAGE_SZ, "Heap is not 15 pages!");
+	sf_free(y);
+	assert_free_block_count(0, 1);
+	assert_free_block_count(2912, 1);
+
+	cr_assert(sf_trim(0), "sf_trim() released nothing!");
+	assert_free_block_count(0, 1);
+	assert_free_block_count(864, 1);
+	cr_assert(!sf_trim(0), "sf_trim() released something twice!");
+
+	char *z = sf_malloc(5000);
+	memset(z, 'z', 5000);
+	cr_assert(sf_mem_end() - sf_mem_start() == 15 * PAGE_SZ, "Heap did not grow into the trimmed pages!");
+	assert_free_block_count(0, 1);
+	assert_free_block_count(976, 1);
+	sf_free(x);
+	sf_free(z);
+	sf_set_trim_threshold(0);
+}
+
+Test(sfmm_student_suite, trim_empty_heap, .timeout = TEST_TIMEOUT)
+{ // trimming before anything has been allocated releases nothing
+	cr_assert(!sf_trim(0), "sf_trim() released something from an empty heap!");
+	cr_assert(sf_mem_start() == sf_mem_end(), "sf_trim() grew the heap!");
+	cr_assert(sf_errno == 0, "sf_errno is not zero!");
+	char *x = sf_malloc(100);
+	cr_assert_not_null(x, "x is NULL!");
+	sf_free(x);
+}